@@ -388,6 +388,24 @@
           inherit (self) overlay;
         };
 
+        tests.chroot-templates = import ./tests/chroot-templates.nix {
+          system = "x86_64-linux";
+          inherit nixpkgs;
+          inherit (self) overlay;
+        };
+
+        tests.cgroups = import ./tests/cgroups.nix {
+          system = "x86_64-linux";
+          inherit nixpkgs;
+          inherit (self) overlay;
+        };
+
+        tests.s3-binary-cache-store = import ./tests/s3-binary-cache-store.nix {
+          system = "x86_64-linux";
+          inherit nixpkgs;
+          inherit (self) overlay;
+        };
+
         tests.githubFlakes = (import ./tests/github-flakes.nix rec {
           system = "x86_64-linux";
           inherit nixpkgs;
@@ -44,6 +44,50 @@ static bool allSupportedLocally(Store & store, const std::set<std::string>& requ
     return true;
 }
 
+/* Make the input closure of a remote build valid on the build
+   machine. Inputs that the machine already has are determined with a
+   single query. Missing inputs are either substituted by the machine
+   itself or uploaded from here. */
+static void copyInputs(ref<Store> store, ref<Store> sshStore, const StorePathSet & inputs)
+{
+    auto valid = sshStore->queryValidPaths(inputs);
+
+    StorePathSet missing;
+    for (auto & path : inputs)
+        if (!valid.count(path)) missing.insert(path);
+
+    debug("%d of %d inputs are missing on '%s'", missing.size(), inputs.size(), sshStore->getUri());
+
+    if (missing.empty()) return;
+
+    StorePathSet toSubstitute;
+
+    if (settings.buildersUseSubstitutes)
+        toSubstitute = missing;
+
+    else if (settings.buildersSubstituteMinSize) {
+        StorePathCAMap query;
+        for (auto & path : missing)
+            query.emplace(path, std::nullopt);
+
+        SubstitutablePathInfos infos;
+        store->querySubstitutablePathInfos(query, infos);
+
+        for (auto & [path, info] : infos)
+            if (info.narSize >= settings.buildersSubstituteMinSize)
+                toSubstitute.insert(path);
+    }
+
+    if (!toSubstitute.empty()) {
+        Activity act(*logger, lvlTalkative, actUnknown,
+            fmt("substituting %d paths on '%s'", toSubstitute.size(), sshStore->getUri()));
+        for (auto & path : sshStore->queryValidPaths(toSubstitute, Substitute))
+            missing.erase(path);
+    }
+
+    copyPaths(store, sshStore, missing, NoRepair, NoCheckSigs, NoSubstitute);
+}
+
 static int main_build_remote(int argc, char * * argv)
 {
     {
@@ -225,7 +269,14 @@ static int main_build_remote(int argc, char * * argv)
 
                     Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
 
-                    sshStore = bestMachine->openStore();
+                    std::map<std::string, std::string> extraParams;
+                    if (settings.buildersConnectionPersist) {
+                        extraParams["ssh-control-path"] = fmt("%s/%s.ssh",
+                            currentLoad, hashString(htSHA256, bestMachine->storeUri).to_string(Base32, false).substr(0, 32));
+                        extraParams["ssh-control-persist"] = std::to_string(settings.buildersConnectionPersist);
+                    }
+
+                    sshStore = bestMachine->openStore(extraParams);
                     sshStore->connect();
                     storeUri = bestMachine->storeUri;
 
@@ -263,11 +314,9 @@ connected:
             signal(SIGALRM, old);
         }
 
-        auto substitute = settings.buildersUseSubstitutes ? Substitute : NoSubstitute;
-
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
-            copyPaths(store, ref<Store>(sshStore), store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
+            copyInputs(store, ref<Store>(sshStore), store->parseStorePathSet(inputs));
         }
 
         uploadLock = -1;
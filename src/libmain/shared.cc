@@ -3,6 +3,8 @@
 #include "store-api.hh"
 #include "util.hh"
 #include "loggers.hh"
+#include "nar-info-disk-cache.hh"
+#include "finally.hh"
 
 #include <algorithm>
 #include <cctype>
@@ -323,6 +325,9 @@ int handleExceptions(const string & programName, std::function<void()> fun)
 
     ErrorInfo::programName = baseNameOf(programName);
 
+    /* Stop background threads while the logger still exists. */
+    Finally stopThreads([]() { shutdownNarInfoDiskCache(); });
+
     string error = ANSI_RED "error:" ANSI_NORMAL " ";
     try {
         try {
@@ -100,6 +100,18 @@ std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
     return sink.s;
 }
 
+void BinaryCacheStore::getFileRange(const std::string & path,
+    uint64_t offset, uint64_t length, Sink & sink)
+{
+    auto data = getFile(path);
+    if (!data)
+        throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+    if (offset + length > data->size())
+        throw Error("byte range %d-%d is outside of file '%s' in binary cache '%s'",
+            offset, offset + length, path, getUri());
+    sink({data->data() + offset, length});
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
@@ -141,31 +153,66 @@ struct FileSource : FdSource
     }
 };
 
+struct TempFileUpload : BinaryCacheStore::PendingUpload
+{
+    BinaryCacheStore & store;
+    AutoCloseFD fd;
+    Path fn;
+    AutoDelete autoDelete;
+    FdSink fileSink;
+
+    TempFileUpload(BinaryCacheStore & store)
+        : store(store)
+    {
+        std::tie(fd, fn) = createTempFile();
+        autoDelete.reset(fn, false);
+        fileSink.fd = fd.get();
+    }
+
+    Sink & sink() override
+    {
+        return fileSink;
+    }
+
+    void commit(const std::string & path, const std::string & mimeType) override
+    {
+        fileSink.flush();
+        store.upsertFile(path,
+            std::make_shared<std::fstream>(fn, std::ios_base::in | std::ios_base::binary),
+            mimeType);
+    }
+};
+
+std::unique_ptr<BinaryCacheStore::PendingUpload> BinaryCacheStore::startUpload()
+{
+    return std::make_unique<TempFileUpload>(*this);
+}
+
 ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
 {
-    auto [fdTemp, fnTemp] = createTempFile();
-
-    AutoDelete autoDelete(fnTemp);
+    auto upload = startUpload();
 
     auto now1 = std::chrono::steady_clock::now();
 
-    /* Read the NAR simultaneously into a CompressionSink+FileSink (to
-       write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+    /* Read the NAR simultaneously into a CompressionSink+upload (to
+       write the compressed NAR to the binary cache under a temporary
+       name), into a HashSink (to get the NAR hash), and into a
+       NarAccessor (to get the NAR listing). */
     HashSink fileHashSink { htSHA256 };
     std::shared_ptr<FSAccessor> narAccessor;
     HashSink narHashSink { htSHA256 };
+    CompressionFrames frames;
     {
-    FdSink fileSink(fdTemp.get());
-    TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed);
+    TeeSink teeSinkCompressed { upload->sink(), fileHashSink };
+    auto compressionSink = narFrameSize
+        ? makeFramedCompressionSink(compression, teeSinkCompressed, narFrameSize, frames)
+        : makeCompressionSink(compression, teeSinkCompressed);
     TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
     TeeSource teeSource { narSource, teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
     compressionSink->finish();
-    fileSink.flush();
     }
 
     auto now2 = std::chrono::steady_clock::now();
@@ -200,8 +247,10 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         }
 
     /* Optionally write a JSON file containing a listing of the
-       contents of the NAR. */
-    if (writeNARListing) {
+       contents of the NAR. If the NAR was compressed in frames, the
+       listing also contains the frame table needed to read parts of
+       the NAR. */
+    if (writeNARListing || narFrameSize) {
         std::ostringstream jsonOut;
 
         {
@@ -212,6 +261,15 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
                 auto res = jsonRoot.placeholder("root");
                 listNar(res, ref<FSAccessor>(narAccessor), "", true);
             }
+
+            if (!frames.empty()) {
+                auto res = jsonRoot.list("frames");
+                for (auto & [narOffset, fileOffset] : frames) {
+                    auto frame = res.list();
+                    frame.elem(narOffset);
+                    frame.elem(fileOffset);
+                }
+            }
         }
 
         upsertFile(std::string(info.path.hashPart()) + ".ls", jsonOut.str(), "application/json");
@@ -277,9 +335,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     /* Atomically write the NAR file. */
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
-        upsertFile(narInfo->url,
-            std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
-            "application/x-nix-nar");
+        upload->commit(narInfo->url, "application/x-nix-nar");
     } else
         stats.narWriteAverted++;
 
@@ -360,6 +416,70 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     stats.narReadBytes += narSize.length;
 }
 
+std::shared_ptr<FSAccessor> BinaryCacheStore::getSeekableNarAccessor(const StorePath & storePath)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    if (!supportsCompressionFrames(info->compression)) return nullptr;
+
+    auto listing = getFile(std::string(storePath.hashPart()) + ".ls");
+    if (!listing) return nullptr;
+
+    auto json = nlohmann::json::parse(*listing);
+
+    /* Uncompressed NARs can be read directly without a frame
+       table. */
+    CompressionFrames frames;
+    if (json.contains("frames")) {
+        for (auto & frame : json["frames"])
+            frames.emplace_back(frame[0], frame[1]);
+        if (frames.empty())
+            throw Error("NAR listing of '%s' in binary cache '%s' has an empty frame table",
+                printStorePath(storePath), getUri());
+    } else if (info->compression != "none" && info->compression != "")
+        return nullptr;
+
+    debug("using seekable NAR '%s' for '%s'", info->url, printStorePath(storePath));
+
+    auto self = shared_from_this();
+
+    return makeLazyNarAccessor(json["root"].dump(),
+        [this, self, info, frames](uint64_t offset, uint64_t length) -> std::string {
+            if (length == 0) return "";
+
+            StringSink sink;
+
+            if (frames.empty()) {
+                getFileRange(info->url, offset, length, sink);
+                stats.narReadCompressedBytes += length;
+                return *sink.s;
+            }
+
+            /* Find the frames that contain the requested range. */
+            auto first = std::upper_bound(frames.begin(), frames.end(), offset,
+                [](uint64_t offset, const std::pair<uint64_t, uint64_t> & frame) {
+                    return offset < frame.first;
+                });
+            assert(first != frames.begin());
+            --first;
+            auto last = std::lower_bound(first, frames.end(), offset + length,
+                [](const std::pair<uint64_t, uint64_t> & frame, uint64_t end) {
+                    return frame.first < end;
+                });
+            if (last == frames.end())
+                throw Error("byte range %d-%d is outside of NAR '%s' in binary cache '%s'",
+                    offset, offset + length, info->url, getUri());
+
+            auto decompressor = makeDecompressionSink(info->compression, sink);
+            getFileRange(info->url, first->second, last->second - first->second, *decompressor);
+            decompressor->finish();
+
+            stats.narReadCompressedBytes += last->second - first->second;
+
+            return sink.s->substr(offset - first->first, length);
+        });
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
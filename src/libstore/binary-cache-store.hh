@@ -22,6 +22,10 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<Path> localNarCache{(StoreConfig*) this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{(StoreConfig*) this, false, "parallel-compression",
         "enable multi-threading compression, available for xz only currently"};
+    const Setting<uint64_t> narFrameSize{(StoreConfig*) this, 0, "nar-frame-size",
+        "if non-zero, compress NARs as independently decompressible frames of this many bytes and "
+        "record the frame offsets in the NAR listing, allowing files to be read using ranged requests "
+        "(requires 'xz' or 'none' compression)"};
 };
 
 class BinaryCacheStore : public virtual BinaryCacheStoreConfig, public virtual Store
@@ -63,6 +67,40 @@ public:
 
     std::shared_ptr<std::string> getFile(const std::string & path);
 
+    /* A file that is being written to the binary cache before its
+       final name is known, e.g. because the name depends on the hash
+       of its contents. The file is discarded unless commit() is
+       called. */
+    struct PendingUpload
+    {
+        virtual ~PendingUpload() { }
+
+        /* The sink to which the contents of the file are written. */
+        virtual Sink & sink() = 0;
+
+        /* Make the file available as 'path'. */
+        virtual void commit(const std::string & path, const std::string & mimeType) = 0;
+    };
+
+    /* Start writing a file to the binary cache. The default
+       implementation buffers the contents in a temporary file and
+       passes it to upsertFile() when committed. Subclasses that can
+       rename files in place should write to the binary cache
+       directly. */
+    virtual std::unique_ptr<PendingUpload> startUpload();
+
+    /* Dump 'length' bytes of the specified file, starting at
+       'offset', to a sink. The default implementation fetches the
+       entire file. */
+    virtual void getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length, Sink & sink);
+
+    /* Return an accessor for the NAR of the specified path that
+       fetches only the parts of the compressed NAR needed to read a
+       file, or nullptr if the binary cache doesn't have a NAR
+       listing with a frame table for this path. */
+    std::shared_ptr<FSAccessor> getSeekableNarAccessor(const StorePath & storePath);
+
 public:
 
     virtual void init() override;
@@ -0,0 +1,180 @@
+#include "build-log.hh"
+#include "util.hh"
+
+#include <algorithm>
+
+#include <fcntl.h>
+
+namespace nix {
+
+struct IndexedLogSinkImpl : IndexedLogSink
+{
+    FdSink & fileSink;
+    AutoCloseFD fdIndex;
+
+    LengthSink compressedSize;
+    TeeSink teeSink;
+
+    std::shared_ptr<CompressionSink> frameSink;
+    LogCheckpoint pos;
+    uint64_t frameFill = 0;
+    time_t frameStart = 0;
+
+    IndexedLogSinkImpl(FdSink & fileSink, const Path & indexPath)
+        : fileSink(fileSink)
+        , teeSink(fileSink, compressedSize)
+    {
+        fdIndex = open(indexPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+        if (!fdIndex) throw SysError("creating log index '%1%'", indexPath);
+    }
+
+    /* Don't buffer: the output of a frame only becomes visible to
+       readers once the frame is closed, so delaying writes would
+       only delay readers further. */
+    void operator () (std::string_view data) override
+    {
+        write(data);
+    }
+
+    void finishFrame()
+    {
+        frameSink->finish();
+        frameSink.reset();
+        fileSink.flush();
+
+        pos.compressedOffset = compressedSize.length;
+        pos.time = time(0);
+        writeFull(fdIndex.get(), fmt("%d %d %d %d\n",
+                pos.offset, pos.compressedOffset, pos.lines, pos.time));
+    }
+
+    void flushFrame() override
+    {
+        if (frameSink) finishFrame();
+    }
+
+    void finish() override
+    {
+        flush();
+        flushFrame();
+        writeFull(fdIndex.get(), "end\n");
+    }
+
+    void write(std::string_view data) override
+    {
+        if (data.empty()) return;
+
+        if (!frameSink) {
+            frameSink = makeCompressionSink("xz", teeSink);
+            frameFill = 0;
+            frameStart = time(0);
+        }
+
+        (*frameSink)(data);
+        frameFill += data.size();
+        pos.offset += data.size();
+        pos.lines += std::count(data.begin(), data.end(), '\n');
+
+        if (frameFill >= logFrameSize || time(0) - frameStart >= logFrameInterval)
+            finishFrame();
+    }
+};
+
+ref<IndexedLogSink> makeIndexedLogSink(FdSink & fileSink, const Path & indexPath)
+{
+    return make_ref<IndexedLogSinkImpl>(fileSink, indexPath);
+}
+
+LogIndex readLogIndex(const Path & indexPath)
+{
+    LogIndex index;
+
+    auto s = readFile(indexPath);
+
+    /* Ignore a trailing partial line, which the builder may still be
+       writing. */
+    auto end = s.rfind('\n');
+    if (end == std::string::npos) return index;
+
+    for (auto & line : tokenizeString<Strings>(s.substr(0, end), "\n")) {
+        if (line == "end") {
+            index.complete = true;
+            break;
+        }
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        if (fields.size() != 4)
+            throw Error("log index '%s' is corrupt", indexPath);
+        LogCheckpoint cp;
+        auto offset = string2Int<uint64_t>(fields[0]);
+        auto compressedOffset = string2Int<uint64_t>(fields[1]);
+        auto lines = string2Int<uint64_t>(fields[2]);
+        auto time = string2Int<time_t>(fields[3]);
+        if (!offset || !compressedOffset || !lines || !time)
+            throw Error("log index '%s' is corrupt", indexPath);
+        cp.offset = *offset;
+        cp.compressedOffset = *compressedOffset;
+        cp.lines = *lines;
+        cp.time = *time;
+        index.checkpoints.push_back(cp);
+    }
+
+    return index;
+}
+
+std::string readIndexedLog(const Path & logPath, const LogIndex & index,
+    size_t from, size_t to)
+{
+    assert(from <= to && to < index.checkpoints.size());
+
+    auto start = index.checkpoints[from].compressedOffset;
+    auto size = index.checkpoints[to].compressedOffset - start;
+    if (!size) return "";
+
+    AutoCloseFD fd = open(logPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening build log '%1%'", logPath);
+
+    if (lseek(fd.get(), start, SEEK_SET) == -1)
+        throw SysError("seeking in build log '%1%'", logPath);
+
+    std::string buf(size, 0);
+    readFull(fd.get(), buf.data(), size);
+
+    return *decompress("xz", buf);
+}
+
+std::string tailIndexedLog(const Path & logPath, const LogIndex & index,
+    uint64_t lines)
+{
+    auto & cps = index.checkpoints;
+    auto total = index.last().lines;
+    auto wanted = total > lines ? total - lines : 0;
+
+    /* Find the last checkpoint that is followed by at least 'lines'
+       lines. */
+    auto i = std::upper_bound(cps.begin(), cps.end(), wanted,
+        [](uint64_t n, const LogCheckpoint & cp) { return n < cp.lines; });
+    size_t from = i - cps.begin() - 1;
+
+    auto s = readIndexedLog(logPath, index, from, cps.size() - 1);
+    return std::string(tailLines(s, lines));
+}
+
+std::string_view tailLines(std::string_view s, uint64_t lines)
+{
+    if (!lines) return "";
+
+    /* A final line without a trailing newline counts as a line. */
+    size_t pos = s.size();
+    if (pos && s[pos - 1] == '\n') pos--;
+
+    while (pos) {
+        auto i = s.rfind('\n', pos - 1);
+        if (i == std::string_view::npos) break;
+        if (--lines == 0) return s.substr(i + 1);
+        pos = i;
+    }
+
+    return s;
+}
+
+}
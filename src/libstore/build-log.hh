@@ -0,0 +1,74 @@
+#pragma once
+
+#include "types.hh"
+#include "compression.hh"
+
+namespace nix {
+
+/* An indexed build log consists of a file '<name>.xz' holding a
+   concatenation of independently compressed xz streams ("frames"),
+   and a file '<name>.idx' listing the position after each frame. A
+   frame is closed when it reaches 'logFrameSize' bytes or has been
+   open for 'logFrameInterval' seconds (checked on every write, and by
+   the builder's goal when the builder goes quiet), and the index is
+   appended to only after the frame has been written out. Thus readers can seek
+   to any checkpoint, or follow a log that is still being written,
+   without decompressing the parts they don't need. */
+
+const uint64_t logFrameSize = 1024 * 1024;
+
+const time_t logFrameInterval = 1;
+
+struct LogCheckpoint
+{
+    /* Offset in the uncompressed log. */
+    uint64_t offset = 0;
+
+    /* Offset in the '.xz' file. */
+    uint64_t compressedOffset = 0;
+
+    /* Number of newlines before 'offset'. */
+    uint64_t lines = 0;
+
+    /* Time at which the preceding frame was closed. */
+    time_t time = 0;
+};
+
+struct LogIndex
+{
+    /* The first checkpoint is always the start of the log. */
+    std::vector<LogCheckpoint> checkpoints{LogCheckpoint()};
+
+    /* Whether the log has been closed by the builder. */
+    bool complete = false;
+
+    const LogCheckpoint & last() const { return checkpoints.back(); }
+};
+
+struct IndexedLogSink : CompressionSink
+{
+    /* Close the current frame, if any, so that readers see
+       everything written so far. */
+    virtual void flushFrame() = 0;
+};
+
+/* Return a sink that writes an indexed build log to 'fileSink',
+   appending checkpoints to 'indexPath'. */
+ref<IndexedLogSink> makeIndexedLogSink(FdSink & fileSink, const Path & indexPath);
+
+LogIndex readLogIndex(const Path & indexPath);
+
+/* Return the uncompressed contents of the indexed build log 'logPath'
+   between the checkpoints 'from' and 'to'. */
+std::string readIndexedLog(const Path & logPath, const LogIndex & index,
+    size_t from, size_t to);
+
+/* Return the last 'lines' lines of the indexed build log 'logPath',
+   decompressing only the frames that contain them. */
+std::string tailIndexedLog(const Path & logPath, const LogIndex & index,
+    uint64_t lines);
+
+/* Return the suffix of 's' containing its last 'lines' lines. */
+std::string_view tailLines(std::string_view s, uint64_t lines);
+
+}
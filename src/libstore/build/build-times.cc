@@ -0,0 +1,148 @@
+#include "build-times.hh"
+#include "names.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "globals.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildTimes (
+    name      text primary key not null,
+    duration  integer not null, -- milliseconds
+    builds    integer not null,
+    timestamp integer not null
+);
+
+)sql";
+
+class BuildTimesImpl : public BuildTimes
+{
+    /* Weight (in percent) of the most recent build in the moving
+       average. */
+    const int64_t newWeight = 30;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt query, upsert;
+    };
+
+    Sync<State> _state;
+
+public:
+
+    BuildTimesImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/build-times.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->query.create(state->db,
+            "select duration, builds from BuildTimes where name = ?");
+
+        state->upsert.create(state->db,
+            "insert or replace into BuildTimes(name, duration, builds, timestamp) values (?, ?, ?, ?)");
+    }
+
+    std::optional<double> lookup(std::string_view drvName) override
+    {
+        return retrySQLite<std::optional<double>>([&]() -> std::optional<double> {
+            auto state(_state.lock());
+
+            for (auto & key : {std::string(drvName), DrvName(drvName).name}) {
+                auto query(state->query.use()(key));
+                if (query.next())
+                    return query.getInt(0) / 1000.0;
+            }
+
+            return std::nullopt;
+        });
+    }
+
+    void record(std::string_view drvName, double duration) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            int64_t ms = duration * 1000;
+
+            std::set<std::string> keys{std::string(drvName), DrvName(drvName).name};
+            for (auto & key : keys) {
+                int64_t avg = ms, builds = 1;
+                {
+                    auto query(state->query.use()(key));
+                    if (query.next()) {
+                        avg = (query.getInt(0) * (100 - newWeight) + ms * newWeight) / 100;
+                        builds += query.getInt(1);
+                    }
+                }
+                state->upsert.use()
+                    (key)
+                    (avg)
+                    (builds)
+                    (time(0))
+                    .exec();
+            }
+
+            txn.commit();
+        });
+    }
+};
+
+ref<BuildTimes> getBuildTimes()
+{
+    static ref<BuildTimes> buildTimes = make_ref<BuildTimesImpl>();
+    return buildTimes;
+}
+
+std::map<StorePath, double> computeCriticalPaths(
+    const std::map<StorePath, StorePathSet> & graph,
+    std::function<double(const StorePath &)> cost)
+{
+    /* Invert the graph so that we can walk from a derivation to the
+       derivations that depend on it. */
+    std::map<StorePath, StorePathSet> dependents;
+    for (auto & [drvPath, deps] : graph)
+        for (auto & dep : deps)
+            if (graph.count(dep))
+                dependents[dep].insert(drvPath);
+
+    std::map<StorePath, double> res;
+
+    std::function<double(const StorePath &)> visit;
+    visit = [&](const StorePath & drvPath) -> double {
+        auto i = res.find(drvPath);
+        if (i != res.end()) return i->second;
+
+        /* Guard against cycles, which a valid graph doesn't have. */
+        res.insert_or_assign(drvPath, 0);
+
+        double downstream = 0;
+        auto j = dependents.find(drvPath);
+        if (j != dependents.end())
+            for (auto & dependent : j->second)
+                downstream = std::max(downstream, visit(dependent));
+
+        auto weight = cost(drvPath) + downstream;
+        res.insert_or_assign(drvPath, weight);
+        return weight;
+    };
+
+    for (auto & [drvPath, _] : graph)
+        visit(drvPath);
+
+    return res;
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "ref.hh"
+#include "path.hh"
+
+#include <optional>
+
+namespace nix {
+
+/* A record of how long derivations took to build in the past, used
+   by the worker to estimate the remaining work behind a goal. Build
+   times are keyed on the derivation name, with the version stripped
+   as a fallback, so that estimates survive changes to the inputs. */
+class BuildTimes
+{
+public:
+
+    virtual ~BuildTimes() { }
+
+    /* Return the expected build time of a derivation in seconds, if
+       it (or something with the same package name) was built
+       before. */
+    virtual std::optional<double> lookup(std::string_view drvName) = 0;
+
+    /* Record that a derivation took 'duration' seconds to build. */
+    virtual void record(std::string_view drvName, double duration) = 0;
+};
+
+/* Return a singleton object backed by a SQLite database in the
+   user's cache directory. */
+ref<BuildTimes> getBuildTimes();
+
+/* Compute for every derivation in 'graph' (which maps a derivation
+   to the derivations in the graph that it depends on) the length of
+   the longest chain of builds that can't start before it finishes,
+   including itself. 'cost' returns the expected duration of a single
+   build. Cycles, which a valid graph doesn't have, are broken
+   arbitrarily. */
+std::map<StorePath, double> computeCriticalPaths(
+    const std::map<StorePath, StorePathSet> & graph,
+    std::function<double(const StorePath &)> cost);
+
+}
@@ -1,5 +1,6 @@
 #include "derivation-goal.hh"
 #include "hook-instance.hh"
+#include "jobserver.hh"
 #include "worker.hh"
 #include "builtins.hh"
 #include "builtins/buildenv.hh"
@@ -9,10 +10,13 @@
 #include "archive.hh"
 #include "json.hh"
 #include "compression.hh"
+#include "build-log.hh"
+#include "build-times.hh"
 #include "daemon.hh"
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
+#include "cgroup.hh"
 
 #include <regex>
 #include <queue>
@@ -173,6 +177,10 @@ inline bool DerivationGoal::needsHashRewrite()
 
 void DerivationGoal::killChild()
 {
+#if __linux__
+    destroyCgroup();
+#endif
+
     if (pid != -1) {
         worker.childTerminated(this);
 
@@ -205,10 +213,43 @@ void DerivationGoal::timedOut(Error && ex)
 
 void DerivationGoal::work()
 {
+    /* We may still be on the worker's wait lists after the
+       speculative substitutions finished the goal. */
+    if (exitCode != ecBusy) return;
+
+    if (substitutedSpeculatively) {
+        substitutedSpeculatively = false;
+        speculationFinished();
+        return;
+    }
+
     (this->*state)();
 }
 
 
+void DerivationGoal::waiteeDone(GoalPtr waitee, ExitCode result)
+{
+    if (!speculativeSubstitutions.count(waitee)) {
+        Goal::waiteeDone(waitee, result);
+        return;
+    }
+
+    speculativeSubstitutions.erase(waitee);
+
+    trace(fmt("speculative substitution '%s' done; %d left", waitee->name, speculativeSubstitutions.size()));
+
+    if (result != ecSuccess) speculationFailed = true;
+
+    /* Once the build is running it holds the output locks, so the
+       substitutions can't have produced the outputs; and waking up
+       the goal now would confuse buildDone(). */
+    if (speculativeSubstitutions.empty() && !speculationFailed && state != &DerivationGoal::buildDone) {
+        substitutedSpeculatively = true;
+        worker.wakeUp(shared_from_this());
+    }
+}
+
+
 void DerivationGoal::addWantedOutputs(const StringSet & outputs)
 {
     /* If we already want all outputs, there is nothing to do. */
@@ -298,6 +339,20 @@ void DerivationGoal::haveDerivation()
     parsedDrv = std::make_unique<ParsedDerivation>(drvPath, *drv);
 
 
+    /* For derivations that build quickly, don't wait for the
+       substituters: start realising the inputs and building right
+       away, and let the substitutions race with the build. The
+       output locks ensure that only one of them writes the outputs;
+       the other will find them valid. */
+    if (shouldSpeculate()) {
+        for (auto & [_, status] : initialOutputs) {
+            auto goal = upcast_goal(worker.makeSubstitutionGoal(status.known->path));
+            speculativeSubstitutions.insert(goal);
+            addToWeakGoals(goal->waiters, shared_from_this());
+        }
+        return DerivationGoal::gaveUpOnSubstitution();
+    }
+
     /* We are first going to try to create the invalid output paths
        through substitutes.  If that doesn't work, we'll build
        them. */
@@ -375,6 +430,67 @@ void DerivationGoal::outputsSubstitutionTried()
     gaveUpOnSubstitution();
 }
 
+bool DerivationGoal::shouldSpeculate()
+{
+    if (!settings.speculativeBuildMaxTime
+        || buildMode != bmNormal
+        || !wantedOutputs.empty()
+        || !settings.useSubstitutes
+        || !parsedDrv->substitutesAllowed())
+        return false;
+
+    for (auto & [_, status] : initialOutputs)
+        if (!status.known) return false;
+
+    /* The download size isn't known until the substituters have
+       answered, which is exactly what we don't want to wait for, so
+       only go by how long the build took before. */
+    std::optional<double> estimate;
+    try {
+        estimate = getBuildTimes()->lookup(drv->name);
+    } catch (Error & e) {
+        debug("cannot look up build time of '%s': %s", drv->name, e.msg());
+    }
+
+    return estimate && *estimate <= settings.speculativeBuildMaxTime;
+}
+
+
+void DerivationGoal::speculationFinished()
+{
+    checkPathValidity();
+    for (auto & [_, status] : initialOutputs)
+        if (!status.known || !status.known->isValid()) return;
+
+    trace("outputs were substituted before the build started");
+
+    /* Stop waiting for the inputs. */
+    for (auto & goal : waitees) {
+        WeakGoals waiters2;
+        for (auto & j : goal->waiters)
+            if (j.lock() != shared_from_this()) waiters2.push_back(j);
+        goal->waiters = waiters2;
+    }
+    waitees.clear();
+
+    outputLocks.unlock();
+
+    done(BuildResult::Substituted);
+}
+
+
+void DerivationGoal::dropSpeculativeSubstitutions()
+{
+    for (auto & goal : speculativeSubstitutions) {
+        WeakGoals waiters2;
+        for (auto & j : goal->waiters)
+            if (j.lock() != shared_from_this()) waiters2.push_back(j);
+        goal->waiters = waiters2;
+    }
+    speculativeSubstitutions.clear();
+}
+
+
 /* At least one of the output paths could not be
    produced using a substitute.  So we have to build instead. */
 void DerivationGoal::gaveUpOnSubstitution()
@@ -660,6 +776,7 @@ void DerivationGoal::tryToBuild()
                    EOF from the hook. */
                 actLock.reset();
                 result.startTime = time(0); // inexact
+                buildStart = std::chrono::steady_clock::now();
                 state = &DerivationGoal::buildDone;
                 started();
                 return;
@@ -823,6 +940,12 @@ void DerivationGoal::buildDone()
 
     result.timesBuilt++;
     result.stopTime = time(0);
+    buildDuration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - buildStart);
+
+#if __linux__
+    destroyCgroup();
+#endif
 
     /* So the child is gone now. */
     worker.childTerminated(this);
@@ -910,6 +1033,9 @@ void DerivationGoal::buildDone()
            being valid. */
         registerOutputs();
 
+        if (buildMode == bmNormal)
+            worker.recordBuildTime(*drv, buildDuration);
+
         if (settings.postBuildHook != "") {
             Activity act(*logger, lvlInfo, actPostBuildHook,
                 fmt("running post-build-hook '%s'", settings.postBuildHook),
@@ -1205,6 +1331,132 @@ void linkOrCopy(const Path & from, const Path & to)
 }
 
 
+#if __linux__
+
+/* A file in the chroot that doesn't depend on the derivation being
+   built: a directory, a regular file with the given contents, or a
+   symlink to the given target. */
+struct ChrootEntry
+{
+    enum { tDirectory, tRegular, tSymlink } type;
+    std::string contents;
+};
+
+/* Ordered so that directories come before their contents. */
+typedef std::map<Path, ChrootEntry> ChrootEntries;
+
+
+static void createChrootEntries(const Path & root, const ChrootEntries & entries)
+{
+    for (auto & [path, entry] : entries)
+        switch (entry.type) {
+        case ChrootEntry::tDirectory:
+            if (mkdir((root + path).c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", root + path);
+            break;
+        case ChrootEntry::tRegular:
+            writeFile(root + path, entry.contents, 0444);
+            break;
+        case ChrootEntry::tSymlink:
+            createSymlink(entry.contents, root + path);
+            break;
+        }
+}
+
+
+/* Create the directory holding the chroot templates, and make sure
+   that only we can write to it. Build users can write to the Nix
+   store, so a non-sandboxed build may have created it first; in that
+   case, move it out of the way. Returns false if that doesn't work
+   (e.g. because the build user keeps recreating it). */
+static bool makeChrootTemplatesDir(const Path & templatesDir)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (mkdir(templatesDir.c_str(), 0755) == -1 && errno != EEXIST)
+            throw SysError("creating directory '%s'", templatesDir);
+
+        auto st = lstat(templatesDir);
+        if (S_ISDIR(st.st_mode) && st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)))
+            return true;
+
+        warn("removing '%s', which is writable by others", templatesDir);
+        Path aside = fmt("%s.bad-%d", templatesDir, getpid());
+        if (rename(templatesDir.c_str(), aside.c_str()) == -1) {
+            debug("cannot rename '%s': %s", templatesDir, strerror(errno));
+            return false;
+        }
+        /* If this fails, the garbage collector removes it later. */
+        try {
+            deletePath(aside);
+        } catch (Error & e) {
+            debug("cannot delete '%s': %s", aside, e.msg());
+        }
+    }
+
+    return false;
+}
+
+
+/* Return a directory containing 'entries', creating it if it doesn't
+   exist yet, or nothing if the templates directory can't be trusted.
+   Templates are keyed by their contents and never change once
+   created, so concurrent builds can share them. */
+static std::optional<Path> getChrootTemplate(const Path & templatesDir, const ChrootEntries & entries)
+{
+    std::string s;
+    for (auto & [path, entry] : entries)
+        s += fmt("%s %d %d %s\n", path, entry.type, entry.contents.size(), entry.contents);
+
+    if (!makeChrootTemplatesDir(templatesDir)) return std::nullopt;
+
+    Path dir = templatesDir + "/" + hashString(htSHA256, s).to_string(Base32, false);
+    if (pathExists(dir)) return dir;
+
+    Path tmpDir = fmt("%s.tmp-%d", dir, getpid());
+    deletePath(tmpDir);
+    if (mkdir(tmpDir.c_str(), 0755) == -1)
+        throw SysError("creating directory '%s'", tmpDir);
+    createChrootEntries(tmpDir, entries);
+
+    /* Another process may have created the same template in the
+       meantime, in which case we use that one. */
+    if (rename(tmpDir.c_str(), dir.c_str()) == -1) {
+        if (errno != EEXIST && errno != ENOTEMPTY)
+            throw SysError("renaming '%s' to '%s'", tmpDir, dir);
+        deletePath(tmpDir);
+    }
+
+    return dir;
+}
+
+
+/* Create 'entries' in 'root' by hard-linking the files from a
+   template. This replaces writing every file with a single link(). */
+static void linkChrootEntries(const Path & templateDir, const Path & root, const ChrootEntries & entries)
+{
+    for (auto & [path, entry] : entries)
+        if (entry.type == ChrootEntry::tDirectory) {
+            if (mkdir((root + path).c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", root + path);
+        } else
+            linkOrCopy(templateDir + path, root + path);
+}
+
+
+/* The host devices that are bind-mounted into the sandbox's nearly
+   empty /dev. */
+static Strings sandboxDevices(Store & store)
+{
+    Strings ss{"/dev/full"};
+    if (store.systemFeatures.get().count("kvm") && pathExists("/dev/kvm"))
+        ss.push_back("/dev/kvm");
+    ss.insert(ss.end(), {"/dev/null", "/dev/random", "/dev/tty", "/dev/urandom", "/dev/zero"});
+    return ss;
+}
+
+#endif
+
+
 void DerivationGoal::startBuilder()
 {
     /* Right platform? */
@@ -1444,21 +1696,50 @@ void DerivationGoal::startBuilder()
         createDirs(chrootTmpDir);
         chmod_(chrootTmpDir, 01777);
 
-        /* Create a /etc/passwd with entries for the build user and the
-           nobody account.  The latter is kind of a hack to support
-           Samba-in-QEMU. */
-        createDirs(chrootRootDir + "/etc");
+        /* The rest of the skeleton of the chroot is the same for most
+           builds. */
+        ChrootEntries entries;
+
+        /* /etc/passwd is created once we know the sandbox uid. */
+        entries["/etc"] = {ChrootEntry::tDirectory};
 
         /* Declare the build user's group so that programs get a consistent
            view of the system (e.g., "id -gn"). */
-        writeFile(chrootRootDir + "/etc/group",
+        entries["/etc/group"] = {ChrootEntry::tRegular,
             fmt("root:x:0:\n"
                 "nixbld:!:%1%:\n"
-                "nogroup:x:65534:\n", sandboxGid()));
+                "nogroup:x:65534:\n", sandboxGid())};
 
         /* Create /etc/hosts with localhost entry. */
         if (!(derivationIsImpure(derivationType)))
-            writeFile(chrootRootDir + "/etc/hosts", "127.0.0.1 localhost\n::1 localhost\n");
+            entries["/etc/hosts"] = {ChrootEntry::tRegular, "127.0.0.1 localhost\n::1 localhost\n"};
+
+        /* Set up a nearly empty /dev, unless the user asked to
+           bind-mount the host /dev. The child bind-mounts the devices
+           onto the empty files. */
+        if (dirsInChroot.find("/dev") == dirsInChroot.end()) {
+            entries["/dev"] = {ChrootEntry::tDirectory};
+            entries["/dev/shm"] = {ChrootEntry::tDirectory};
+            entries["/dev/pts"] = {ChrootEntry::tDirectory};
+            for (auto & i : sandboxDevices(worker.store))
+                entries[i] = {ChrootEntry::tRegular};
+            entries["/dev/fd"] = {ChrootEntry::tSymlink, "/proc/self/fd"};
+            entries["/dev/stdin"] = {ChrootEntry::tSymlink, "/proc/self/fd/0"};
+            entries["/dev/stdout"] = {ChrootEntry::tSymlink, "/proc/self/fd/1"};
+            entries["/dev/stderr"] = {ChrootEntry::tSymlink, "/proc/self/fd/2"};
+        }
+
+        /* Hard-link the skeleton from a template that is created once
+           and shared by all builds. This is only safe if the builder
+           runs as a build user, since otherwise it would own the
+           template's files and could modify them for later builds. */
+        std::optional<Path> templateDir;
+        if (auto localStore = dynamic_cast<LocalStore *>(&worker.store); buildUser && localStore)
+            templateDir = getChrootTemplate(localStore->chrootTemplatesDir, entries);
+        if (templateDir)
+            linkChrootEntries(*templateDir, chrootRootDir, entries);
+        else
+            createChrootEntries(chrootRootDir, entries);
 
         /* Make the closure of the inputs available in the chroot,
            rather than the whole Nix store.  This prevents any access
@@ -1474,12 +1755,17 @@ void DerivationGoal::startBuilder()
         if (buildUser && chown(chrootStoreDir.c_str(), 0, buildUser->getGID()) == -1)
             throw SysError("cannot change ownership of '%1%'", chrootStoreDir);
 
+        inputDirsInChroot.clear();
+
         for (auto & i : inputPaths) {
             auto p = worker.store.printStorePath(i);
             Path r = worker.store.toRealPath(p);
-            if (S_ISDIR(lstat(r).st_mode))
-                dirsInChroot.insert_or_assign(p, r);
-            else
+            if (S_ISDIR(lstat(r).st_mode)) {
+                dirsInChroot.erase(p);
+                inputDirsInChroot.insert_or_assign(p, r);
+                if (mkdir((chrootRootDir + p).c_str(), 0755) == -1)
+                    throw SysError("creating mount point '%s'", chrootRootDir + p);
+            } else
                 linkOrCopy(r, chrootRootDir + p);
         }
 
@@ -1494,8 +1780,12 @@ void DerivationGoal::startBuilder()
                should be fresh.  Freshness means it is impossible that the path
                is already in the sandbox, so we don't need to worry about
                removing it.  */
-            if (i.second.second)
-                dirsInChroot.erase(worker.store.printStorePath(*i.second.second));
+            if (i.second.second) {
+                auto p = worker.store.printStorePath(*i.second.second);
+                dirsInChroot.erase(p);
+                if (inputDirsInChroot.erase(p))
+                    rmdir((chrootRootDir + p).c_str());
+            }
         }
 
 #elif __APPLE__
@@ -1604,6 +1894,11 @@ void DerivationGoal::startBuilder()
         throw SysError("putting pseudoterminal into raw mode");
 
     result.startTime = time(0);
+    buildStart = std::chrono::steady_clock::now();
+
+#if __linux__
+    if (settings.useCgroups) setupCgroup();
+#endif
 
     /* Fork a child to build the package. */
     ProcessOptions options;
@@ -1731,6 +2026,12 @@ void DerivationGoal::startBuilder()
         usingUserNamespace = ss[0] == "1";
         pid = string2Int<pid_t>(ss[1]).value();
 
+        /* Move the builder into its cgroup before it can start any
+           processes. It can't do this itself since it's not root in
+           the parent user namespace. */
+        if (cgroup)
+            writeFile(*cgroup + "/cgroup.procs", fmt("%d", (pid_t) pid));
+
         if (usingUserNamespace) {
             /* Set the UID/GID mapping of the builder's user namespace
                such that the sandbox user maps to the build user, or to
@@ -1883,6 +2184,11 @@ void DerivationGoal::initEnv()
     /* The maximum number of cores to utilize for parallel building. */
     env["NIX_BUILD_CORES"] = (format("%d") % settings.buildCores).str();
 
+    /* Let make share the worker's CPU budget with other builds. This
+       can be overridden by the derivation. */
+    if (worker.jobserver)
+        env["MAKEFLAGS"] = worker.jobserver->makeFlags();
+
     initTmpDir();
 
     /* Compatibility hack with Nix <= 0.7: if this is a fixed-output
@@ -2434,6 +2740,12 @@ void DerivationGoal::runChild()
 
     try { /* child */
 
+#if __linux__
+        /* In a sandbox, the parent does this for us. */
+        if (cgroup && !useChroot)
+            writeFile(*cgroup + "/cgroup.procs", "0");
+#endif
+
         commonChildInit(builderOut);
 
         try {
@@ -2515,25 +2827,11 @@ void DerivationGoal::runChild()
             if (mount(0, chrootStoreDir.c_str(), 0, MS_SHARED, 0) == -1)
                 throw SysError("unable to make '%s' shared", chrootStoreDir);
 
-            /* Set up a nearly empty /dev, unless the user asked to
-               bind-mount the host /dev. */
+            /* Populate the nearly empty /dev created by the parent,
+               unless the user asked to bind-mount the host /dev. */
             Strings ss;
-            if (dirsInChroot.find("/dev") == dirsInChroot.end()) {
-                createDirs(chrootRootDir + "/dev/shm");
-                createDirs(chrootRootDir + "/dev/pts");
-                ss.push_back("/dev/full");
-                if (worker.store.systemFeatures.get().count("kvm") && pathExists("/dev/kvm"))
-                    ss.push_back("/dev/kvm");
-                ss.push_back("/dev/null");
-                ss.push_back("/dev/random");
-                ss.push_back("/dev/tty");
-                ss.push_back("/dev/urandom");
-                ss.push_back("/dev/zero");
-                createSymlink("/proc/self/fd", chrootRootDir + "/dev/fd");
-                createSymlink("/proc/self/fd/0", chrootRootDir + "/dev/stdin");
-                createSymlink("/proc/self/fd/1", chrootRootDir + "/dev/stdout");
-                createSymlink("/proc/self/fd/2", chrootRootDir + "/dev/stderr");
-            }
+            if (dirsInChroot.find("/dev") == dirsInChroot.end())
+                ss = sandboxDevices(worker.store);
 
             /* Fixed-output derivations typically need to access the
                network, so give them access to /etc/resolv.conf and so
@@ -2569,7 +2867,9 @@ void DerivationGoal::runChild()
                 }
                 if (S_ISDIR(st.st_mode))
                     createDirs(target);
-                else {
+                else if (!pathExists(target)) {
+                    /* Don't truncate files linked from the chroot
+                       template. */
                     createDirs(dirOf(target));
                     writeFile(target, "");
                 }
@@ -2582,6 +2882,13 @@ void DerivationGoal::runChild()
                 doBind(i.second.source, chrootRootDir + i.first, i.second.optional);
             }
 
+            /* Store paths don't contain mount points, so a
+               non-recursive bind mount suffices. This is the bulk of
+               the mounts for most builds. */
+            for (auto & [target, source] : inputDirsInChroot)
+                if (mount(source.c_str(), (chrootRootDir + target).c_str(), "", MS_BIND, 0) == -1)
+                    throw SysError("bind mount from '%1%' to '%2%' failed", source, chrootRootDir + target);
+
             /* Bind a new instance of procfs on /proc. */
             createDirs(chrootRootDir + "/proc");
             if (mount("none", (chrootRootDir + "/proc").c_str(), "proc", 0, 0) == -1)
@@ -2663,8 +2970,17 @@ void DerivationGoal::runChild()
         if (chdir(tmpDirInSandbox.c_str()) == -1)
             throw SysError("changing into '%1%'", tmpDir);
 
-        /* Close all other file descriptors. */
-        closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+        /* Close all other file descriptors, except the jobserver
+           pipe if the builder is going to use it. */
+        set<int> keepFDs{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        if (worker.jobserver && drv->env.count("MAKEFLAGS") == 0) {
+            for (int fd : {worker.jobserver->pipe.readSide.get(), worker.jobserver->pipe.writeSide.get()}) {
+                if (fcntl(fd, F_SETFD, 0) == -1)
+                    throw SysError("clearing close-on-exec flag on jobserver pipe");
+                keepFDs.insert(fd);
+            }
+        }
+        closeMostFDs(keepFDs);
 
 #if __linux__
         /* Change the personality to 32-bit if we're doing an
@@ -3655,14 +3971,18 @@ Path DerivationGoal::openLogFile()
     createDirs(dir);
 
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        settings.indexLog ? ".xz" : settings.compressLog ? ".bz2" : "");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
 
-    logFileSink = std::make_shared<FdSink>(fdLogFile.get());
+    auto fdSink = std::make_shared<FdSink>(fdLogFile.get());
+    logFileSink = fdSink;
 
-    if (settings.compressLog)
+    if (settings.indexLog)
+        logSink = std::shared_ptr<IndexedLogSink>(makeIndexedLogSink(*fdSink,
+                fmt("%s/%s.idx", dir, string(baseName, 2))));
+    else if (settings.compressLog)
         logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
     else
         logSink = logFileSink;
@@ -3671,6 +3991,68 @@ Path DerivationGoal::openLogFile()
 }
 
 
+#if __linux__
+void DerivationGoal::setupCgroup()
+{
+    cgroup = createChildCgroup(fmt("nix-build-%s", drvPath.hashPart()));
+
+    uint64_t memoryMax = settings.buildMemoryMax;
+    if (auto s = parsedDrv->getStringAttr("memoryMax")) {
+        auto n = string2Int<uint64_t>(*s);
+        if (!n)
+            throw Error("derivation '%s' has an invalid 'memoryMax' attribute", worker.store.printStorePath(drvPath));
+        memoryMax = memoryMax ? std::min(memoryMax, *n) : *n;
+    }
+    if (memoryMax)
+        writeFile(*cgroup + "/memory.max", fmt("%d", memoryMax));
+
+    if (settings.buildCpuMax) {
+        const uint64_t period = 100000;
+        writeFile(*cgroup + "/cpu.max", fmt("%d %d", settings.buildCpuMax * period, period));
+    }
+}
+
+
+void DerivationGoal::destroyCgroup()
+{
+    if (!cgroup) return;
+
+    try {
+        auto stats = nix::destroyCgroup(*cgroup);
+
+        result.cpuUser = stats.cpuUser;
+        result.cpuSystem = stats.cpuSystem;
+        result.memoryPeak = stats.memoryPeak;
+        result.ioRead = stats.ioRead;
+        result.ioWritten = stats.ioWritten;
+
+        auto usecs = [](const std::optional<std::chrono::microseconds> & t) -> uint64_t {
+            return t ? t->count() : 0;
+        };
+
+        if (act)
+            act->result(resBuildMetrics,
+                usecs(stats.cpuUser), usecs(stats.cpuSystem),
+                stats.memoryPeak.value_or(0),
+                stats.ioRead.value_or(0), stats.ioWritten.value_or(0),
+                usecs(stats.cpuPressure), usecs(stats.memoryPressure), usecs(stats.ioPressure));
+
+        /* Make the numbers available through 'nix log'. */
+        if (logSink)
+            (*logSink)(fmt("\nbuild resource usage: cpu user %.3fs, cpu system %.3fs, peak memory %s, io read %s, io written %s\n",
+                usecs(stats.cpuUser) / 1e6, usecs(stats.cpuSystem) / 1e6,
+                stats.memoryPeak ? std::to_string(*stats.memoryPeak) : "unknown",
+                stats.ioRead ? std::to_string(*stats.ioRead) : "unknown",
+                stats.ioWritten ? std::to_string(*stats.ioWritten) : "unknown"));
+    } catch (Error & e) {
+        printError("cannot destroy cgroup of '%s': %s", worker.store.printStorePath(drvPath), e.msg());
+    }
+
+    cgroup.reset();
+}
+#endif
+
+
 void DerivationGoal::closeLogFile()
 {
     auto logSink2 = std::dynamic_pointer_cast<CompressionSink>(logSink);
@@ -3681,6 +4063,13 @@ void DerivationGoal::closeLogFile()
 }
 
 
+void DerivationGoal::flushLog()
+{
+    if (auto logSink2 = std::dynamic_pointer_cast<IndexedLogSink>(logSink))
+        logSink2->flushFrame();
+}
+
+
 void DerivationGoal::deleteTmpDir(bool force)
 {
     if (tmpDir != "") {
@@ -3723,7 +4112,14 @@ void DerivationGoal::handleChildOutput(int fd, const string & data)
                 currentLogLine[currentLogLinePos++] = c;
             }
 
-        if (logSink) (*logSink)(data);
+        if (logSink) {
+            (*logSink)(data);
+            /* Indexed logs only become visible frame by frame, so
+               make sure that the current frame is closed even if the
+               builder doesn't write anything else for a while. */
+            if (settings.indexLog)
+                worker.flushLogLater(*this, std::chrono::seconds(logFrameInterval));
+        }
     }
 
     if (hook && fd == hook->fromHook.readSide.get()) {
@@ -3827,6 +4223,8 @@ StorePath DerivationGoal::makeFallbackPath(const StorePath & path)
 
 void DerivationGoal::done(BuildResult::Status status, std::optional<Error> ex)
 {
+    dropSpeculativeSubstitutions();
+
     result.status = status;
     if (ex)
         result.errorMsg = ex->what();
@@ -59,6 +59,17 @@ struct DerivationGoal : public Goal
        inputs. */
     bool retrySubstitution;
 
+    /* Substitution goals for the outputs that run alongside the
+       build rather than before it (see `speculative-build-max-time'). */
+    Goals speculativeSubstitutions;
+
+    /* Whether one of the speculative substitutions failed. */
+    bool speculationFailed = false;
+
+    /* Whether all speculative substitutions succeeded, so the build
+       can be abandoned if it hasn't started yet. */
+    bool substitutedSpeculatively = false;
+
     /* The derivation stored at drvPath. */
     std::unique_ptr<BasicDerivation> drv;
 
@@ -122,6 +133,18 @@ struct DerivationGoal : public Goal
     /* Whether we're currently doing a chroot build. */
     bool useChroot = false;
 
+#if __linux__
+    /* The cgroup of the builder, if `use-cgroups' is enabled. */
+    std::optional<Path> cgroup;
+
+    /* Create `cgroup' and apply the configured limits to it. */
+    void setupCgroup();
+
+    /* Destroy `cgroup', killing any processes that are left in it,
+       and record its resource usage in `result'. */
+    void destroyCgroup();
+#endif
+
     Path chrootRootDir;
 
     /* RAII object to delete the chroot directory. */
@@ -147,6 +170,13 @@ struct DerivationGoal : public Goal
     typedef map<Path, ChrootPath> DirsInChroot; // maps target path to source path
     DirsInChroot dirsInChroot;
 
+    /* Input directories to bind-mount into the chroot, mapping
+       target path to source path. Unlike `dirsInChroot', these are
+       known to be directories and their mount points are created by
+       the parent, so the child only has to call mount() for each of
+       them. */
+    map<Path, Path> inputDirsInChroot;
+
     typedef map<string, string> Environment;
     Environment env;
 
@@ -194,6 +224,11 @@ struct DerivationGoal : public Goal
 
     BuildResult result;
 
+    /* When the builder was started, and how long it ran. Unlike
+       'result.startTime', this has sub-second precision. */
+    std::chrono::steady_clock::time_point buildStart;
+    std::chrono::milliseconds buildDuration{0};
+
     /* The current round, if we're building multiple times. */
     size_t curRound = 1;
 
@@ -262,6 +297,8 @@ struct DerivationGoal : public Goal
 
     void work() override;
 
+    void waiteeDone(GoalPtr waitee, ExitCode result) override;
+
     /* Add wanted outputs to an already existing derivation goal. */
     void addWantedOutputs(const StringSet & outputs);
 
@@ -281,6 +318,15 @@ struct DerivationGoal : public Goal
 
     void resolvedFinished();
 
+    /* Whether to build while the outputs are being substituted. */
+    bool shouldSpeculate();
+
+    /* Finish the goal if the speculative substitutions produced the
+       outputs before the build started. */
+    void speculationFinished();
+
+    void dropSpeculativeSubstitutions();
+
     /* Is the build hook willing to perform the build? */
     HookReply tryBuildHook();
 
@@ -331,6 +377,7 @@ struct DerivationGoal : public Goal
     /* Callback used by the worker to write to the log. */
     void handleChildOutput(int fd, const string & data) override;
     void handleEOF(int fd) override;
+    void flushLog() override;
     void flushLine();
 
     /* Wrappers around the corresponding Store methods that first consult the
@@ -85,6 +85,10 @@ struct Goal : public std::enable_shared_from_this<Goal>
         abort();
     }
 
+    /* Make buffered log output visible to readers of the log (see
+       Worker::flushLogLater()). */
+    virtual void flushLog() { }
+
     void trace(const FormatOrString & fs);
 
     string getName()
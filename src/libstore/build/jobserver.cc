@@ -0,0 +1,47 @@
+#include "jobserver.hh"
+
+#include <poll.h>
+
+namespace nix {
+
+Jobserver::Jobserver(unsigned int tokens)
+    : tokens(tokens)
+{
+    pipe.create();
+    refill();
+}
+
+
+void Jobserver::refill()
+{
+    /* Drain the pipe without blocking. We can't make the pipe itself
+       non-blocking since the file description is shared with the
+       builders, and GNU make expects blocking reads. */
+    char buf[4096];
+    while (true) {
+        struct pollfd pfd = { .fd = pipe.readSide.get(), .events = POLLIN };
+        auto res = poll(&pfd, 1, 0);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("polling jobserver pipe");
+        }
+        if (res == 0 || !(pfd.revents & POLLIN)) break;
+        if (read(pipe.readSide.get(), buf, sizeof(buf)) == -1 && errno != EINTR)
+            throw SysError("draining jobserver pipe");
+    }
+
+    /* GNU make puts '+' in the pipe; some tools care about the token
+       value, so we do the same. */
+    writeFull(pipe.writeSide.get(), std::string(tokens, '+'));
+}
+
+
+std::string Jobserver::makeFlags() const
+{
+    /* `--jobserver-auth' is understood by GNU make >= 4.2,
+       `--jobserver-fds' by older versions. */
+    return fmt(" -j --jobserver-auth=%1%,%2% --jobserver-fds=%1%,%2%",
+        pipe.readSide.get(), pipe.writeSide.get());
+}
+
+}
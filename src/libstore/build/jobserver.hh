@@ -0,0 +1,32 @@
+#pragma once
+
+#include "util.hh"
+
+namespace nix {
+
+/* A GNU make-compatible jobserver: a pipe holding one byte per CPU
+   that builders may use in addition to the one they implicitly own.
+   The worker passes the pipe to every local build, so that
+   concurrent builds share a single CPU budget instead of each using
+   `cores' jobs. */
+struct Jobserver
+{
+    Pipe pipe;
+
+    /* The number of tokens in the pipe when no build is running. */
+    const unsigned int tokens;
+
+    Jobserver(unsigned int tokens);
+
+    /* Discard whatever is left in the pipe and put `tokens' tokens
+       back. Builders that are killed while holding tokens never
+       return them, so this must be called when no build is using the
+       pipe. */
+    void refill();
+
+    /* The value of MAKEFLAGS that tells GNU make (and compatible
+       tools) to use the jobserver. */
+    std::string makeFlags() const;
+};
+
+}
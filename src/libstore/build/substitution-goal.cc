@@ -22,8 +22,13 @@ SubstitutionGoal::~SubstitutionGoal()
 {
     try {
         if (thr.joinable()) {
-            // FIXME: signal worker thread to quit.
-            thr.join();
+            /* Nobody wants the path anymore (e.g. because a
+               speculative build produced it first). Don't wait for
+               the substitution here, since that would stall the
+               worker loop; cancel it and let the worker join the
+               thread. */
+            threadState->cancelled = true;
+            worker.abandonThread(std::move(thr));
             worker.childTerminated(this);
         }
     } catch (...) {
@@ -195,27 +200,47 @@ void SubstitutionGoal::tryToRun()
         return;
     }
 
+    /* The path may have been built in the meantime by a derivation
+       goal that didn't wait for us (see
+       DerivationGoal::shouldSpeculate()). */
+    if (!repair && worker.store.isValidPath(storePath)) {
+        amDone(ecSuccess);
+        return;
+    }
+
     maintainRunningSubstitutions = std::make_unique<MaintainCount<uint64_t>>(worker.runningSubstitutions);
     worker.updateProgress();
 
     outPipe.create();
 
-    promise = std::promise<void>();
-
-    thr = std::thread([this]() {
+    threadState = std::make_shared<ThreadState>();
+
+    /* The thread must not refer to the goal, which may be destroyed
+       before the thread finishes. */
+    thr = std::thread([
+        threadState(threadState),
+        writeSide(std::move(outPipe.writeSide)),
+        srcStore(ref<Store>(sub)),
+        dstStore(ref<Store>(worker.store.shared_from_this())),
+        printedPath(worker.store.printStorePath(storePath)),
+        path(subPath ? *subPath : storePath),
+        repair(repair)]() mutable
+    {
         try {
             /* Wake up the worker loop when we're done. */
-            Finally updateStats([this]() { outPipe.writeSide = -1; });
+            Finally updateStats([&]() { writeSide = -1; });
+
+            interruptCheck = [threadState]() { return (bool) threadState->cancelled; };
 
-            Activity act(*logger, actSubstitute, Logger::Fields{worker.store.printStorePath(storePath), sub->getUri()});
+            Activity act(*logger, actSubstitute, Logger::Fields{printedPath, srcStore->getUri()});
             PushActivity pact(act.id);
 
-            copyStorePath(ref<Store>(sub), ref<Store>(worker.store.shared_from_this()),
-                subPath ? *subPath : storePath, repair, sub->isTrusted ? NoCheckSigs : CheckSigs);
+            copyStorePath(srcStore, dstStore,
+                path, repair, srcStore->isTrusted ? NoCheckSigs : CheckSigs);
 
-            promise.set_value();
+            threadState->promise.set_value();
         } catch (...) {
-            promise.set_exception(std::current_exception());
+            threadState->promise.set_exception(std::current_exception());
         }
     });
 
@@ -233,7 +258,7 @@ void SubstitutionGoal::finished()
     worker.childTerminated(this);
 
     try {
-        promise.get_future().get();
+        threadState->promise.get_future().get();
     } catch (std::exception & e) {
         printError(e.what());
 
@@ -35,7 +35,19 @@ struct SubstitutionGoal : public Goal
     /* The substituter thread. */
     std::thread thr;
 
-    std::promise<void> promise;
+    /* State shared with the substituter thread, which outlives this
+       goal if the goal is dropped while substituting (see
+       ~SubstitutionGoal()). */
+    struct ThreadState
+    {
+        std::promise<void> promise;
+
+        /* Makes the substituter thread stop at the next interrupt
+           check. */
+        std::atomic<bool> cancelled{false};
+    };
+
+    std::shared_ptr<ThreadState> threadState;
 
     /* Whether to try to repair a valid path. */
     RepairFlag repair;
@@ -3,9 +3,15 @@
 #include "substitution-goal.hh"
 #include "derivation-goal.hh"
 #include "hook-instance.hh"
+#include "build-times.hh"
+#include "jobserver.hh"
 
 #include <poll.h>
 
+#if __linux__
+#include <sys/epoll.h>
+#endif
+
 namespace nix {
 
 Worker::Worker(Store & store)
@@ -21,6 +27,18 @@ Worker::Worker(Store & store)
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+
+#if __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFd)
+        throw SysError("creating epoll instance");
+#endif
+
+    if (settings.jobserverCores)
+        /* Every builder owns one implicit token, and the pipe can't
+           hold more than a page or so without blocking us. */
+        jobserver = std::make_unique<Jobserver>(
+            std::min(settings.jobserverCores.get(), 4096U) - 1);
 }
 
 
@@ -32,6 +50,9 @@ Worker::~Worker()
        their destructors). */
     topGoals.clear();
 
+    for (auto & thr : abandonedThreads)
+        thr.join();
+
     assert(expectedSubstitutions == 0);
     assert(expectedDownloadSize == 0);
     assert(expectedNarSize == 0);
@@ -150,20 +171,78 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.timeStarted = child.lastOutput = steady_time_point::clock::now();
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
-    children.emplace_back(child);
+    auto i = children.insert(children.end(), child);
+    childrenByGoal.insert_or_assign(goal.get(), i);
+
+    for (auto fd : fds) {
+        childrenByFd.insert_or_assign(fd, i);
+#if __linux__
+        struct epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+        if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+            if (errno != EEXIST || epoll_ctl(epollFd.get(), EPOLL_CTL_MOD, fd, &event) == -1)
+                throw SysError("watching file descriptor %d", fd);
+        }
+#endif
+    }
+
+    if (auto deadline = getDeadline(child))
+        timeouts.emplace(*deadline, goal.get());
+
     if (inBuildSlot) nrLocalBuilds++;
 }
 
 
+void Worker::flushLogLater(Goal & goal, std::chrono::seconds delay)
+{
+    auto i = childrenByGoal.find(&goal);
+    if (i == childrenByGoal.end() || i->second->logFlushPending) return;
+    i->second->logFlushPending = true;
+    logFlushes.emplace(steady_time_point::clock::now() + delay, &goal);
+}
+
+
+std::optional<steady_time_point> Worker::getDeadline(const Child & child)
+{
+    if (!child.respectTimeouts) return std::nullopt;
+    std::optional<steady_time_point> deadline;
+    if (0 != settings.maxSilentTime)
+        deadline = child.lastOutput + std::chrono::seconds(settings.maxSilentTime);
+    if (0 != settings.buildTimeout) {
+        auto deadline2 = child.timeStarted + std::chrono::seconds(settings.buildTimeout);
+        deadline = deadline ? std::min(*deadline, deadline2) : deadline2;
+    }
+    return deadline;
+}
+
+
+void Worker::unwatchFd(int fd)
+{
+    childrenByFd.erase(fd);
+#if __linux__
+    /* This fails if the goal already closed the file descriptor,
+       but then the kernel has already forgotten about it. */
+    epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+
+
 void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 {
-    auto i = std::find_if(children.begin(), children.end(),
-        [&](const Child & child) { return child.goal2 == goal; });
-    if (i == children.end()) return;
+    auto j = childrenByGoal.find(goal);
+    if (j == childrenByGoal.end()) return;
+    auto i = j->second;
+    childrenByGoal.erase(j);
+
+    for (auto fd : i->fds)
+        unwatchFd(fd);
 
     if (i->inBuildSlot) {
         assert(nrLocalBuilds > 0);
         nrLocalBuilds--;
+        /* Recover tokens lost by builders that didn't return them
+           (e.g. because they were killed). */
+        if (jobserver && nrLocalBuilds == 0)
+            jobserver->refill();
     }
 
     children.erase(i);
@@ -181,6 +260,12 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 }
 
 
+void Worker::abandonThread(std::thread && thr)
+{
+    abandonedThreads.push_back(std::move(thr));
+}
+
+
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
@@ -223,6 +308,17 @@ void Worker::run(const Goals & _topGoals)
     uint64_t downloadSize, narSize;
     store.queryMissing(topPaths, willBuild, willSubstitute, unknown, downloadSize, narSize);
 
+    /* This is only an optimisation, so don't let a broken build
+       times database fail the build. */
+    if (settings.criticalPathScheduling && willBuild.size() > 1) {
+        try {
+            computeBuildPriorities(willBuild);
+        } catch (Error & e) {
+            debug("not scheduling by critical path: %s", e.msg());
+            buildPriorities.clear();
+        }
+    }
+
     debug("entered goal loop");
 
     while (1) {
@@ -234,14 +330,27 @@ void Worker::run(const Goals & _topGoals)
             localStore->autoGC(false);
 
         /* Call every wake goal (in the ordering established by
-           CompareGoalPtrs). */
+           CompareGoalPtrs, or by priority if we know the build
+           graph). Since goals waiting for a build slot are woken up
+           together, this determines which of them gets the slot. */
         while (!awake.empty() && !topGoals.empty()) {
-            Goals awake2;
+            Goals awake3;
             for (auto & i : awake) {
                 GoalPtr goal = i.lock();
-                if (goal) awake2.insert(goal);
+                if (goal) awake3.insert(goal);
             }
             awake.clear();
+            std::vector<GoalPtr> awake2(awake3.begin(), awake3.end());
+            if (!buildPriorities.empty()) {
+                std::map<Goal *, double> memo;
+                std::vector<std::pair<double, GoalPtr>> prioritised;
+                for (auto & goal : awake2)
+                    prioritised.emplace_back(getPriority(*goal, memo), goal);
+                std::stable_sort(prioritised.begin(), prioritised.end(),
+                    [](const auto & a, const auto & b) { return a.first > b.first; });
+                for (size_t n = 0; n < prioritised.size(); ++n)
+                    awake2[n] = prioritised[n].second;
+            }
             for (auto & goal : awake2) {
                 checkInterrupt();
                 goal->work();
@@ -279,6 +388,90 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || children.empty());
 }
 
+void Worker::computeBuildPriorities(const StorePathSet & willBuild)
+{
+    auto buildTimes = getBuildTimes();
+
+    std::map<StorePath, StorePathSet> graph;
+    std::map<StorePath, std::optional<double>> estimates;
+    double total = 0;
+    size_t known = 0;
+
+    for (auto & drvPath : willBuild) {
+        std::optional<Derivation> drv;
+        try {
+            drv = store.readDerivation(drvPath);
+        } catch (Error & e) {
+            debug("not scheduling '%s' by critical path: %s", store.printStorePath(drvPath), e.msg());
+            continue;
+        }
+        auto & deps = graph[drvPath];
+        for (auto & i : drv->inputDrvs)
+            if (willBuild.count(i.first))
+                deps.insert(i.first);
+        auto estimate = buildTimes->lookup(drv->name);
+        if (estimate) {
+            total += *estimate;
+            known++;
+        }
+        estimates.insert_or_assign(drvPath, estimate);
+    }
+
+    /* Derivations that were never built before are assumed to take
+       as long as the average known build, or one unit if we know
+       nothing at all (giving the longest chain in number of
+       builds). */
+    double defaultEstimate = known ? total / known : 1.0;
+
+    buildPriorities = computeCriticalPaths(graph, [&](const StorePath & drvPath) {
+        auto i = estimates.find(drvPath);
+        return i != estimates.end() && i->second ? *i->second : defaultEstimate;
+    });
+
+    debug("computed critical paths for %d derivations (%d with known build times)",
+        buildPriorities.size(), known);
+}
+
+
+double Worker::getPriority(Goal & goal, std::map<Goal *, double> & memo)
+{
+    auto i = memo.find(&goal);
+    if (i != memo.end()) return i->second;
+
+    /* Guard against cycles in the waiters graph. */
+    memo.insert_or_assign(&goal, 0);
+
+    double priority = 0;
+    std::optional<double> own;
+
+    if (auto drvGoal = dynamic_cast<DerivationGoal *>(&goal)) {
+        auto j = buildPriorities.find(drvGoal->drvPath);
+        if (j != buildPriorities.end()) own = j->second;
+    }
+
+    if (own)
+        priority = *own;
+    else
+        for (auto & waiter : goal.waiters)
+            if (auto goal2 = waiter.lock())
+                priority = std::max(priority, getPriority(*goal2, memo));
+
+    memo.insert_or_assign(&goal, priority);
+    return priority;
+}
+
+
+void Worker::recordBuildTime(const BasicDerivation & drv, std::chrono::milliseconds duration)
+{
+    if (!settings.criticalPathScheduling && !settings.speculativeBuildMaxTime) return;
+    try {
+        getBuildTimes()->record(drv.name, duration.count() / 1000.0);
+    } catch (Error & e) {
+        debug("cannot record build time of '%s': %s", drv.name, e.msg());
+    }
+}
+
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -289,8 +482,6 @@ void Worker::waitForInput()
        the logger pipe of a build, we assume that the builder has
        terminated. */
 
-    bool useTimeout = false;
-    long timeout = 0;
     auto before = steady_time_point::clock::now();
 
     /* If we're monitoring for silence on stdout/stderr, or if there
@@ -300,105 +491,140 @@ void Worker::waitForInput()
     if (settings.minFree.get() != 0)
         // Periodicallty wake up to see if we need to run the garbage collector.
         nearest = before + std::chrono::seconds(10);
-    for (auto & i : children) {
-        if (!i.respectTimeouts) continue;
-        if (0 != settings.maxSilentTime)
-            nearest = std::min(nearest, i.lastOutput + std::chrono::seconds(settings.maxSilentTime));
-        if (0 != settings.buildTimeout)
-            nearest = std::min(nearest, i.timeStarted + std::chrono::seconds(settings.buildTimeout));
-    }
-    if (nearest != steady_time_point::max()) {
-        timeout = std::max(1L, (long) std::chrono::duration_cast<std::chrono::seconds>(nearest - before).count());
-        useTimeout = true;
-    }
+    if (!timeouts.empty())
+        nearest = std::min(nearest, timeouts.top().first);
+    if (!logFlushes.empty())
+        nearest = std::min(nearest, logFlushes.top().first);
 
     /* If we are polling goals that are waiting for a lock, then wake
        up after a few seconds at most. */
     if (!waitingForAWhile.empty()) {
-        useTimeout = true;
         if (lastWokenUp == steady_time_point::min() || lastWokenUp > before) lastWokenUp = before;
-        timeout = std::max(1L,
-            (long) std::chrono::duration_cast<std::chrono::seconds>(
-                lastWokenUp + std::chrono::seconds(settings.pollInterval) - before).count());
+        nearest = std::min(nearest, lastWokenUp + std::chrono::seconds(settings.pollInterval));
     } else lastWokenUp = steady_time_point::min();
 
-    if (useTimeout)
-        vomit("sleeping %d seconds", timeout);
+    int timeout = -1;
+    if (nearest != steady_time_point::max()) {
+        timeout = std::max(0L, (long) std::chrono::duration_cast<std::chrono::milliseconds>(nearest - before).count());
+        vomit("sleeping %d ms", timeout);
+    }
 
-    /* Use select() to wait for the input side of any logger pipe to
-       become `available'.  Note that `available' (i.e., non-blocking)
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
-    std::vector<struct pollfd> pollStatus;
-    std::map <int, int> fdToPollStatus;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            pollStatus.push_back((struct pollfd) { .fd = j, .events = POLLIN });
-            fdToPollStatus[j] = pollStatus.size() - 1;
-        }
+    std::vector<int> readyFds;
+
+#if __linux__
+    std::vector<struct epoll_event> events(std::max((size_t) 1, std::min(childrenByFd.size(), (size_t) 1024)));
+    auto nrEvents = epoll_wait(epollFd.get(), events.data(), events.size(), timeout);
+    if (nrEvents == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
     }
+    for (int n = 0; n < nrEvents; ++n)
+        readyFds.push_back(events[n].data.fd);
+#else
+    std::vector<struct pollfd> pollStatus;
+    for (auto & i : childrenByFd)
+        pollStatus.push_back((struct pollfd) { .fd = i.first, .events = POLLIN });
 
-    if (poll(pollStatus.data(), pollStatus.size(),
-            useTimeout ? timeout * 1000 : -1) == -1) {
+    if (poll(pollStatus.data(), pollStatus.size(), timeout) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
+    for (auto & i : pollStatus)
+        if (i.revents) readyFds.push_back(i.fd);
+#endif
 
     auto after = steady_time_point::clock::now();
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
+    /* Process the available file descriptors. Note that handling
+       output may cause the child to be terminated, so we look it up
+       again for every file descriptor. */
+    if (readBuffer.empty()) readBuffer.resize(65536);
 
+    for (auto k : readyFds) {
         checkInterrupt();
 
-        GoalPtr goal = j->goal.lock();
+        auto i = childrenByFd.find(k);
+        if (i == childrenByFd.end()) continue;
+        auto & child = *i->second;
+
+        GoalPtr goal = child.goal.lock();
         assert(goal);
 
-        set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            if (pollStatus.at(fdToPollStatus.at(k)).revents) {
-                ssize_t rd = ::read(k, buffer.data(), buffer.size());
-                // FIXME: is there a cleaner way to handle pt close
-                // than EIO? Is this even standard?
-                if (rd == 0 || (rd == -1 && errno == EIO)) {
-                    debug("%1%: got EOF", goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError("%s: read failed", goal->getName());
-                } else {
-                    printMsg(lvlVomit, "%1%: read %2% bytes",
-                        goal->getName(), rd);
-                    string data((char *) buffer.data(), rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
-                }
-            }
+        ssize_t rd = ::read(k, readBuffer.data(), readBuffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug("%1%: got EOF", goal->getName());
+            child.fds.erase(k);
+            unwatchFd(k);
+            goal->handleEOF(k);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, "%1%: read %2% bytes",
+                goal->getName(), rd);
+            string data((char *) readBuffer.data(), rd);
+            child.lastOutput = after;
+            goal->handleChildOutput(k, data);
         }
+    }
+
+    /* Check the timeouts that have expired. */
+    while (!timeouts.empty() && timeouts.top().first <= after) {
+        checkInterrupt();
+
+        auto goal2 = timeouts.top().second;
+        timeouts.pop();
+
+        auto i = childrenByGoal.find(goal2);
+        if (i == childrenByGoal.end()) continue;
+        auto & child = *i->second;
+
+        GoalPtr goal = child.goal.lock();
+        assert(goal);
 
-        if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.maxSilentTime &&
-            j->respectTimeouts &&
-            after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
+        if (goal->exitCode != Goal::ecBusy) continue;
+
+        if (0 != settings.maxSilentTime &&
+            after - child.lastOutput >= std::chrono::seconds(settings.maxSilentTime))
         {
             goal->timedOut(Error(
                     "%1% timed out after %2% seconds of silence",
                     goal->getName(), settings.maxSilentTime));
         }
 
-        else if (goal->exitCode == Goal::ecBusy &&
-            0 != settings.buildTimeout &&
-            j->respectTimeouts &&
-            after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
+        else if (0 != settings.buildTimeout &&
+            after - child.timeStarted >= std::chrono::seconds(settings.buildTimeout))
         {
             goal->timedOut(Error(
                     "%1% timed out after %2% seconds",
                     goal->getName(), settings.buildTimeout));
         }
+
+        else if (auto deadline = getDeadline(child))
+            timeouts.emplace(*deadline, goal2);
+    }
+
+    /* Flush the logs of goals that asked for it. */
+    while (!logFlushes.empty() && logFlushes.top().first <= after) {
+        checkInterrupt();
+
+        auto goal2 = logFlushes.top().second;
+        logFlushes.pop();
+
+        auto i = childrenByGoal.find(goal2);
+        if (i == childrenByGoal.end()) continue;
+        auto & child = *i->second;
+        child.logFlushPending = false;
+
+        GoalPtr goal = child.goal.lock();
+        assert(goal);
+
+        goal->flushLog();
     }
 
     if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
@@ -6,6 +6,7 @@
 #include "goal.hh"
 
 #include <future>
+#include <queue>
 #include <thread>
 
 namespace nix {
@@ -40,10 +41,12 @@ struct Child
     bool inBuildSlot;
     steady_time_point lastOutput; /* time we last got output on stdout/stderr */
     steady_time_point timeStarted;
+    bool logFlushPending = false; /* whether the goal is in `logFlushes' */
 };
 
 /* Forward definition. */
 struct HookInstance;
+struct Jobserver;
 
 /* The worker class. */
 class Worker
@@ -65,6 +68,41 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
+    /* Threads of goals that were destroyed while the thread was still
+       running. They are joined when the worker is destroyed. */
+    std::list<std::thread> abandonedThreads;
+
+    /* Indexes into `children' by goal and by file descriptor. */
+    std::map<Goal *, std::list<Child>::iterator> childrenByGoal;
+    std::map<int, std::list<Child>::iterator> childrenByFd;
+
+#if __linux__
+    /* The epoll instance watching the file descriptors of all
+       children. */
+    AutoCloseFD epollFd;
+#endif
+
+    /* Pending silence and build timeouts of children, earliest
+       first. Since a child's silence deadline moves whenever it
+       produces output, an entry may be earlier than the actual
+       deadline; it is requeued when it expires. Entries for
+       children that have terminated are discarded lazily. */
+    typedef std::pair<steady_time_point, Goal *> Timeout;
+    std::priority_queue<Timeout, std::vector<Timeout>, std::greater<Timeout>> timeouts;
+
+    /* Children whose goals want their log flushed, earliest first. */
+    std::priority_queue<Timeout, std::vector<Timeout>, std::greater<Timeout>> logFlushes;
+
+    /* Return the earliest time at which `child' can time out, if
+       ever. */
+    std::optional<steady_time_point> getDeadline(const Child & child);
+
+    /* Stop watching a file descriptor of a child. */
+    void unwatchFd(int fd);
+
+    /* Buffer for reading output from children. */
+    std::vector<unsigned char> readBuffer;
+
     /* Number of build slots occupied.  This includes local builds and
        substitutions but not remote builds via the build hook. */
     unsigned int nrLocalBuilds;
@@ -86,6 +124,20 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<StorePath, bool> pathContentsGoodCache;
 
+    /* For each derivation that we expect to build, the expected
+       duration of the longest chain of builds starting with it. Goals
+       with a higher value are started first. */
+    std::map<StorePath, double> buildPriorities;
+
+    /* Fill in `buildPriorities' from the dependency graph of the
+       derivations in `willBuild'. */
+    void computeBuildPriorities(const StorePathSet & willBuild);
+
+    /* Return the priority of a goal. Goals that aren't builds of
+       derivations in `buildPriorities' inherit the highest priority
+       of the goals waiting for them. */
+    double getPriority(Goal & goal, std::map<Goal *, double> & memo);
+
 public:
 
     const Activity act;
@@ -109,6 +161,9 @@ public:
 
     std::unique_ptr<HookInstance> hook;
 
+    /* The jobserver shared by local builds, if enabled. */
+    std::unique_ptr<Jobserver> jobserver;
+
     uint64_t expectedBuilds = 0;
     uint64_t doneBuilds = 0;
     uint64_t failedBuilds = 0;
@@ -164,12 +219,21 @@ public:
     void childStarted(GoalPtr goal, const set<int> & fds,
         bool inBuildSlot, bool respectTimeouts);
 
+    /* Call flushLog() on the goal of a running child after `delay',
+       unless that is already pending. This lets goals that buffer
+       log output publish it when the child goes quiet. */
+    void flushLogLater(Goal & goal, std::chrono::seconds delay);
+
     /* Unregisters a running child process.  `wakeSleepers' should be
        false if there is no sense in waking up goals that are sleeping
        because they can't run yet (e.g., there is no free build slot,
        or the hook would still say `postpone'). */
     void childTerminated(Goal * goal, bool wakeSleepers = true);
 
+    /* Take over a thread of a goal that is being destroyed. The
+       thread must not refer to the goal. */
+    void abandonThread(std::thread && thr);
+
     /* Put `goal' to sleep until a build slot becomes available (which
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
@@ -198,6 +262,10 @@ public:
 
     void markContentsGood(const StorePath & path);
 
+    /* Remember how long a derivation took to build, for use by
+       future invocations of computeBuildPriorities(). */
+    void recordBuildTime(const BasicDerivation & drv, std::chrono::milliseconds duration);
+
     void updateProgress()
     {
         actDerivations.progress(doneBuilds, expectedBuilds + doneBuilds, runningBuilds, failedBuilds);
@@ -51,9 +51,25 @@ void Store::exportPath(const StorePath & path, Sink & sink)
         << 0;
 }
 
+/* Paths are imported in batches of at most this many paths or NAR
+   bytes, so that the store can unpack and register them together. */
+static const size_t importBatchPaths = 1024;
+static const uint64_t importBatchSize = 256 * 1024 * 1024;
+
 StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
 {
     StorePaths res;
+    PathsSource batch;
+    std::vector<ref<std::string>> nars;
+    uint64_t batchSize = 0;
+
+    auto flush = [&]() {
+        addMultipleToStore(batch, NoRepair, checkSigs);
+        batch.clear();
+        nars.clear();
+        batchSize = 0;
+    };
+
     while (true) {
         auto n = readNum<uint64_t>(source);
         if (n == 0) break;
@@ -87,13 +103,19 @@ StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
         if (readInt(source) == 1)
             readString(source);
 
-        // Can't use underlying source, which would have been exhausted
-        auto source = StringSource { *saved.s };
-        addToStore(info, source, NoRepair, checkSigs);
-
         res.push_back(info.path);
+
+        /* The export format lists paths in topological order, so the
+           references of each batch are valid or in the batch. */
+        batchSize += saved.s->size();
+        nars.push_back(saved.s);
+        batch.emplace_back(std::move(info), std::make_unique<StringSource>(*saved.s));
+        if (batch.size() >= importBatchPaths || batchSize >= importBatchSize)
+            flush();
     }
 
+    if (!batch.empty()) flush();
+
     return res;
 }
 
@@ -41,6 +41,19 @@ std::string resolveUri(const std::string & uri)
         return uri;
 }
 
+/* Return the scheme and authority of a URI (without user info),
+   which identifies the host for the purpose of concurrency limits. */
+static std::string getUriHost(const std::string & uri)
+{
+    auto i = uri.find("://");
+    if (i == std::string::npos) return "";
+    auto end = uri.find('/', i + 3);
+    auto authority = uri.substr(i + 3, end == std::string::npos ? std::string::npos : end - i - 3);
+    auto at = authority.rfind('@');
+    if (at != std::string::npos) authority = authority.substr(at + 1);
+    return uri.substr(0, i + 3) + authority;
+}
+
 struct curlFileTransfer : public FileTransfer
 {
     CURLM * curlm = 0;
@@ -66,6 +79,13 @@ struct curlFileTransfer : public FileTransfer
            has been reached. */
         std::chrono::steady_clock::time_point embargo;
 
+        /* Queue position among transfers of the same priority. */
+        uint64_t seq = 0;
+
+        std::string host;
+
+        std::chrono::steady_clock::time_point startTime;
+
         struct curl_slist * requestHeaders = 0;
 
         std::string encoding;
@@ -95,6 +115,7 @@ struct curlFileTransfer : public FileTransfer
                 fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
                 {request.uri}, request.parentAct)
             , callback(std::move(callback))
+            , host(getUriHost(request.uri))
             , finalSink([this](std::string_view data) {
                 if (this->request.dataCallback) {
                     auto httpStatus = getHTTPStatus();
@@ -337,17 +358,33 @@ struct curlFileTransfer : public FileTransfer
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
+            if (request.range) {
+                assert(request.range->second > 0);
+                curl_easy_setopt(req, CURLOPT_RANGE, fmt("%d-%d",
+                    request.range->first + writtenToSink,
+                    request.range->first + request.range->second - 1).c_str());
+            } else if (writtenToSink)
                 curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
 
             result.data = std::make_shared<std::string>();
             result.bodySize = 0;
+
+            startTime = std::chrono::steady_clock::now();
         }
 
         void finish(CURLcode code)
         {
             auto httpStatus = getHTTPStatus();
 
+            double startTransferTime = 0;
+            curl_easy_getinfo(req, CURLINFO_STARTTRANSFER_TIME, &startTransferTime);
+            double latencyMs = startTransferTime * 1000;
+            uint64_t durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+
+            act.result(resFileTransferMetrics, host, result.bodySize, durationMs,
+                (uint64_t) latencyMs, (uint64_t) attempt, (uint64_t) httpStatus);
+
             char * effectiveUriCStr;
             curl_easy_getinfo(req, CURLINFO_EFFECTIVE_URL, &effectiveUriCStr);
             if (effectiveUriCStr)
@@ -369,8 +406,13 @@ struct curlFileTransfer : public FileTransfer
                 httpStatus = 304;
             }
 
-            if (writeException)
+            if (writeException) {
+                /* The sink gave up (e.g. the consumer stopped reading
+                   or decompression failed). Release the host's slot,
+                   but don't treat this as a sign of congestion. */
+                fileTransfer.transferDone(*this, Misc, false, latencyMs, durationMs);
                 failEx(writeException);
+            }
 
             else if (code == CURLE_OK && successfulStatuses.count(httpStatus))
             {
@@ -383,6 +425,7 @@ struct curlFileTransfer : public FileTransfer
                     result.etag = request.expectedETag;
 
                 act.progress(result.bodySize, result.bodySize);
+                fileTransfer.transferDone(*this, {}, false, latencyMs, durationMs);
                 done = true;
                 callback(std::move(result));
             }
@@ -456,12 +499,15 @@ struct curlFileTransfer : public FileTransfer
                    download after a while. If we're writing to a
                    sink, we can only retry if the server supports
                    ranged requests. */
-                if (err == Transient
+                bool retry = err == Transient
                     && attempt < request.tries
                     && (!this->request.dataCallback
                         || writtenToSink == 0
-                        || (acceptRanges && encoding.empty())))
-                {
+                        || (acceptRanges && encoding.empty()));
+
+                fileTransfer.transferDone(*this, err, retry, latencyMs, durationMs);
+
+                if (retry) {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(fileTransfer.mt19937));
                     if (writtenToSink)
                         warn("%s; retrying from offset %d in %d ms", exc.what(), writtenToSink, ms);
@@ -476,6 +522,12 @@ struct curlFileTransfer : public FileTransfer
         }
     };
 
+    struct HostState
+    {
+        FileTransferHostStats stats;
+        std::chrono::steady_clock::time_point lastDecrease;
+    };
+
     struct State
     {
         struct EmbargoComparator {
@@ -485,6 +537,8 @@ struct curlFileTransfer : public FileTransfer
         };
         bool quit = false;
         std::priority_queue<std::shared_ptr<TransferItem>, std::vector<std::shared_ptr<TransferItem>>, EmbargoComparator> incoming;
+        uint64_t nextSeq = 0;
+        std::map<std::string, HostState> hosts;
     };
 
     Sync<State> state_;
@@ -537,6 +591,77 @@ struct curlFileTransfer : public FileTransfer
         writeFull(wakeupPipe.writeSide.get(), " ", false);
     }
 
+    static size_t maxHostConcurrency()
+    {
+        size_t n = fileTransferSettings.httpConnectionsPerHost;
+        if (!n) n = fileTransferSettings.httpConnections;
+        return n ? n : 1 << 16;
+    }
+
+    HostState & getHostState(State & state, const std::string & host)
+    {
+        auto i = state.hosts.find(host);
+        if (i == state.hosts.end()) {
+            i = state.hosts.emplace(host, HostState()).first;
+            i->second.stats.concurrency = maxHostConcurrency();
+        }
+        return i->second;
+    }
+
+    /* Update the statistics and the concurrency limit of a host
+       after a transfer attempt. The limit follows an AIMD scheme: it
+       grows by one per window of successful transfers, and is halved
+       (at most once per second) on transient errors or when the time
+       to first byte rises well above its running average, which
+       indicates that the host or the path to it is overloaded. */
+    void transferDone(TransferItem & item, std::optional<Error> err, bool retry,
+        double latencyMs, uint64_t durationMs)
+    {
+        auto state(state_.lock());
+        auto & host = getHostState(*state, item.host);
+        auto & stats = host.stats;
+
+        assert(stats.active);
+        stats.active--;
+        stats.transfers++;
+        stats.bytes += item.result.bodySize;
+        if (err) stats.failures++;
+        if (retry) stats.retries++;
+
+        size_t bucket = 0;
+        while (bucket + 1 < stats.durationHistogram.size() && durationMs >= (1ULL << bucket))
+            bucket++;
+        stats.durationHistogram[bucket]++;
+
+        bool congested =
+            err == Transient
+            || (!err && stats.latencyMs > 0 && latencyMs > 100 && latencyMs > 3 * stats.latencyMs);
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (congested) {
+            if (now - host.lastDecrease > std::chrono::seconds(1)) {
+                stats.concurrency = std::max(1.0, stats.concurrency / 2);
+                host.lastDecrease = now;
+                debug("reducing the number of concurrent transfers to '%s' to %d",
+                    item.host, (size_t) stats.concurrency);
+            }
+        } else if (!err)
+            stats.concurrency = std::min((double) maxHostConcurrency(), stats.concurrency + 1 / stats.concurrency);
+
+        if (!err && latencyMs > 0)
+            stats.latencyMs = stats.latencyMs == 0 ? latencyMs : 0.9 * stats.latencyMs + 0.1 * latencyMs;
+    }
+
+    std::map<std::string, FileTransferHostStats> getHostStats() override
+    {
+        std::map<std::string, FileTransferHostStats> res;
+        auto state(state_.lock());
+        for (auto & [name, host] : state->hosts)
+            res.emplace(name, host.stats);
+        return res;
+    }
+
     void workerThreadMain()
     {
         /* Cause this thread to be notified on SIGINT. */
@@ -546,6 +671,10 @@ struct curlFileTransfer : public FileTransfer
 
         std::map<CURL *, std::shared_ptr<TransferItem>> items;
 
+        /* Requests whose embargo has expired but that are waiting for
+           their host's concurrency limit, in order of priority. */
+        std::map<std::pair<FileTransferPriority, uint64_t>, std::shared_ptr<TransferItem>> ready;
+
         bool quit = false;
 
         std::chrono::steady_clock::time_point nextWakeup;
@@ -609,7 +738,7 @@ struct curlFileTransfer : public FileTransfer
                 while (!state->incoming.empty()) {
                     auto item = state->incoming.top();
                     if (item->embargo <= now) {
-                        incoming.push_back(item);
+                        ready.emplace(std::make_pair(item->request.priority, item->seq), item);
                         state->incoming.pop();
                     } else {
                         if (nextWakeup == std::chrono::steady_clock::time_point()
@@ -618,6 +747,20 @@ struct curlFileTransfer : public FileTransfer
                         break;
                     }
                 }
+
+                /* Start the highest-priority requests to hosts that
+                   are below their concurrency limit. */
+                for (auto i = ready.begin(); i != ready.end(); ) {
+                    auto & stats = getHostState(*state, i->second->host).stats;
+                    if (stats.active >= (size_t) stats.concurrency) {
+                        ++i;
+                        continue;
+                    }
+                    stats.active++;
+                    incoming.push_back(i->second);
+                    i = ready.erase(i);
+                }
+
                 quit = state->quit;
             }
 
@@ -660,6 +803,7 @@ struct curlFileTransfer : public FileTransfer
             auto state(state_.lock());
             if (state->quit)
                 throw nix::Error("cannot enqueue download request because the download thread is shutting down");
+            item->seq = state->nextSeq++;
             state->incoming.push(item);
         }
         writeFull(wakeupPipe.writeSide.get(), " ");
@@ -831,7 +975,11 @@ void FileTransfer::download(FileTransferRequest && request, Sink & sink)
                     return;
                 }
 
-                state.wait(state->avail);
+                /* Don't wait indefinitely for a slow server, so that
+                   interrupts (e.g. of a cancelled substitution) are
+                   noticed. */
+                state.wait_for(state->avail, std::chrono::seconds(1));
+                checkInterrupt();
             }
 
             chunk = std::move(state->data);
@@ -4,6 +4,7 @@
 #include "hash.hh"
 #include "config.hh"
 
+#include <array>
 #include <string>
 #include <future>
 
@@ -26,6 +27,17 @@ struct FileTransferSettings : Config
         )",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{
+        this, 0, "http-connections-per-host",
+        R"(
+          The maximum number of concurrent transfers to a single
+          host. Within this limit, Nix adapts the number of concurrent
+          transfers to each host: it is increased gradually while
+          transfers succeed, and halved when a host returns transient
+          errors or its response latency rises sharply. 0 means that
+          only `http-connections` applies.
+        )"};
+
     Setting<unsigned long> connectTimeout{
         this, 0, "connect-timeout",
         R"(
@@ -48,6 +60,11 @@ struct FileTransferSettings : Config
 
 extern FileTransferSettings fileTransferSettings;
 
+/* Transfers with a higher priority are started before queued
+   transfers with a lower priority, e.g. so that .narinfo lookups don't
+   wait behind large NAR downloads. */
+enum struct FileTransferPriority { High = 0, Normal = 1, Low = 2 };
+
 struct FileTransferRequest
 {
     std::string uri;
@@ -59,6 +76,10 @@ struct FileTransferRequest
     unsigned int baseRetryTimeMs = 250;
     ActivityId parentAct;
     bool decompress = true;
+    FileTransferPriority priority = FileTransferPriority::Normal;
+    /* If set, fetch only this byte range (offset and length) of the
+       file. */
+    std::optional<std::pair<uint64_t, uint64_t>> range;
     std::shared_ptr<std::string> data;
     std::string mimeType;
     std::function<void(std::string_view data)> dataCallback;
@@ -81,6 +102,26 @@ struct FileTransferResult
     uint64_t bodySize = 0;
 };
 
+/* Per-host statistics of the transfers done by a FileTransfer
+   object. */
+struct FileTransferHostStats
+{
+    uint64_t transfers = 0, failures = 0, retries = 0, bytes = 0;
+
+    /* Number of transfers currently in progress and the current
+       adaptive limit on that number. */
+    size_t active = 0;
+    double concurrency = 0;
+
+    /* Smoothed time to first byte in milliseconds. */
+    double latencyMs = 0;
+
+    /* Histogram of total transfer durations: bucket i counts
+       transfers that took less than 2^i milliseconds (the last bucket
+       counts everything else). */
+    std::array<uint64_t, 20> durationHistogram{};
+};
+
 class Store;
 
 struct FileTransfer
@@ -105,6 +146,11 @@ struct FileTransfer
        invoked on the thread of the caller. */
     void download(FileTransferRequest && request, Sink & sink);
 
+    /* Return statistics about the transfers done so far, keyed by
+       host. */
+    virtual std::map<std::string, FileTransferHostStats> getHostStats()
+    { return {}; }
+
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
 
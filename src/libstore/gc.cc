@@ -3,6 +3,7 @@
 #include "local-store.hh"
 #include "local-fs-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 #include <functional>
 #include <queue>
@@ -23,6 +24,7 @@ namespace nix {
 
 static string gcLockName = "gc.lock";
 static string gcRootsDir = "gcroots";
+static string gcIncrementalName = "gc-incremental";
 
 
 /* Acquire the global GC lock.  This is used to prevent new Nix
@@ -113,10 +115,14 @@ Path LocalFSStore::addPermRoot(const StorePath & storePath, const Path & _gcRoot
 
 void LocalStore::addTempRoot(const StorePath & path)
 {
-    auto state(_state.lock());
+    auto tempRoots(_tempRoots.lock());
+
+    /* A temporary root lasts until this process exits, so it only
+       has to be registered once. */
+    if (tempRoots->paths.count(path)) return;
 
     /* Create the temporary roots file for this process. */
-    if (!state->fdTempRoots) {
+    if (!tempRoots->fd) {
 
         while (1) {
             AutoCloseFD fdGCLock = openGCLock(ltRead);
@@ -126,17 +132,17 @@ void LocalStore::addTempRoot(const StorePath & path)
                    processes with the same pid. */
                 unlink(fnTempRoots.c_str());
 
-            state->fdTempRoots = openLockFile(fnTempRoots, true);
+            tempRoots->fd = openLockFile(fnTempRoots, true);
 
             fdGCLock = -1;
 
             debug(format("acquiring read lock on '%1%'") % fnTempRoots);
-            lockFile(state->fdTempRoots.get(), ltRead, true);
+            lockFile(tempRoots->fd.get(), ltRead, true);
 
             /* Check whether the garbage collector didn't get in our
                way. */
             struct stat st;
-            if (fstat(state->fdTempRoots.get(), &st) == -1)
+            if (fstat(tempRoots->fd.get(), &st) == -1)
                 throw SysError("statting '%1%'", fnTempRoots);
             if (st.st_size == 0) break;
 
@@ -147,17 +153,25 @@ void LocalStore::addTempRoot(const StorePath & path)
 
     }
 
-    /* Upgrade the lock to a write lock.  This will cause us to block
-       if the garbage collector is holding our lock. */
-    debug(format("acquiring write lock on '%1%'") % fnTempRoots);
-    lockFile(state->fdTempRoots.get(), ltWrite, true);
-
     string s = printStorePath(path) + '\0';
-    writeFull(state->fdTempRoots.get(), s);
+    writeFull(tempRoots->fd.get(), s);
+
+    /* If no garbage collector is running, we're done: a collector
+       that starts later will read the root we just wrote. Otherwise
+       the collector may have read our file before we wrote to it, so
+       wait until it's done with it by upgrading to a write lock,
+       which blocks while the collector holds its read lock. The
+       counter must be checked after writing the root. */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (generations->gcEpoch % 2) {
+        debug(format("acquiring write lock on '%1%'") % fnTempRoots);
+        lockFile(tempRoots->fd.get(), ltWrite, true);
+
+        debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
+        lockFile(tempRoots->fd.get(), ltRead, true);
+    }
 
-    /* Downgrade to a read lock. */
-    debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
-    lockFile(state->fdTempRoots.get(), ltRead, true);
+    tempRoots->paths.insert(path);
 }
 
 
@@ -312,7 +326,7 @@ Roots LocalStore::findRoots(bool censor)
 
 typedef std::unordered_map<Path, std::unordered_set<std::string>> UncheckedRoots;
 
-static void readProcLink(const string & file, UncheckedRoots & roots)
+static std::optional<Path> readProcLink(const string & file)
 {
     /* 64 is the starting buffer size gnu readlink uses... */
     auto bufsiz = ssize_t{64};
@@ -321,7 +335,7 @@ try_again:
     auto res = readlink(file.c_str(), buf, bufsiz);
     if (res == -1) {
         if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-            return;
+            return std::nullopt;
         throw SysError("reading symlink");
     }
     if (res == bufsiz) {
@@ -331,14 +345,14 @@ try_again:
         goto try_again;
     }
     if (res > 0 && buf[0] == '/')
-        roots[std::string(static_cast<char *>(buf), res)]
-            .emplace(file);
+        return std::string(static_cast<char *>(buf), res);
+    return std::nullopt;
 }
 
-static string quoteRegexChars(const string & raw)
+static void readProcLink(const string & file, UncheckedRoots & roots)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    if (auto target = readProcLink(file))
+        roots[*target].emplace(file);
 }
 
 static void readFileRoots(const char * path, UncheckedRoots & roots)
@@ -351,64 +365,255 @@ static void readFileRoots(const char * path, UncheckedRoots & roots)
     }
 }
 
+/* Return the store paths in 's', i.e. the matches of the regular
+   expression 'storeDir/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*'. */
+static std::vector<std::string> findStorePathsIn(std::string_view s, std::string_view storeDir)
+{
+    std::vector<std::string> res;
+
+    auto isPathChar = [](char c) {
+        return isalnum((unsigned char) c) || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    size_t pos = 0;
+    while ((pos = s.find(storeDir, pos)) != std::string_view::npos) {
+        auto start = pos;
+        pos += storeDir.size();
+        if (pos + 1 >= s.size() || s[pos] != '/') continue;
+        auto c = s[pos + 1];
+        if (!(isdigit((unsigned char) c) || islower((unsigned char) c))) continue;
+        auto end = pos + 2;
+        while (end < s.size() && isPathChar(s[end])) end++;
+        res.emplace_back(s.substr(start, end - start));
+        pos = end;
+    }
+
+    return res;
+}
+
+/* Return the path of a file mapping in a line of /proc/<pid>/maps,
+   i.e. the sixth field if it's an absolute path. */
+static std::optional<std::string_view> parseMapsLine(std::string_view line)
+{
+    auto skipSpace = [&](size_t i) {
+        while (i < line.size() && isspace((unsigned char) line[i])) i++;
+        return i;
+    };
+
+    size_t i = 0;
+    for (int field = 0; field < 5; ++field) {
+        i = skipSpace(i);
+        if (i == line.size()) return std::nullopt;
+        while (i < line.size() && !isspace((unsigned char) line[i])) i++;
+    }
+
+    i = skipSpace(i);
+    if (i == line.size() || line[i] != '/') return std::nullopt;
+
+    auto end = i + 1;
+    while (end < line.size() && !isspace((unsigned char) line[end])) end++;
+    if (end == i + 1 || skipSpace(end) != line.size()) return std::nullopt;
+
+    return line.substr(i, end - i);
+}
+
+/* Return the start time of a process (in clock ticks since boot),
+   which together with its pid identifies it. */
+static std::optional<std::string> getProcessStartTime(const std::string & pid)
+{
+    try {
+        auto stat = readFile(fmt("/proc/%s/stat", pid));
+        /* The command name may contain spaces and parentheses. */
+        auto i = stat.rfind(')');
+        if (i == std::string::npos) return std::nullopt;
+        auto fields = tokenizeString<std::vector<std::string>>(stat.substr(i + 1), " ");
+        /* 'starttime' is field 22; fields[0] is field 3. */
+        if (fields.size() < 20) return std::nullopt;
+        return fields[19];
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT || e.errNo == EACCES || e.errNo == ESRCH)
+            return std::nullopt;
+        throw;
+    }
+}
+
+/* The store paths found in the environment of a process. A process's
+   environment can only change by exec()ing, so these are reused for
+   processes with the same pid, start time and executable. */
+struct EnvRoots
+{
+    std::string startTime;
+    Path exe;
+    std::vector<std::string> roots;
+};
+
+typedef std::map<std::string, EnvRoots> EnvRootsCache;
+
+static EnvRootsCache readEnvRootsCache(const Path & path)
+{
+    EnvRootsCache cache;
+
+    try {
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(path), "\n")) {
+            auto fields = tokenizeString<std::vector<std::string>>(line, "\t");
+            if (fields.size() < 3) continue;
+            auto & entry = cache[fields[0]];
+            entry.startTime = fields[1];
+            entry.exe = fields[2];
+            entry.roots.assign(fields.begin() + 3, fields.end());
+        }
+    } catch (SysError & e) {
+        if (e.errNo != ENOENT) throw;
+    }
+
+    return cache;
+}
+
+static void writeEnvRootsCache(const Path & path, const EnvRootsCache & cache)
+{
+    std::string s;
+
+    for (auto & [pid, entry] : cache) {
+        auto line = pid + "\t" + entry.startTime + "\t" + entry.exe;
+        for (auto & root : entry.roots) line += "\t" + root;
+        if (line.find('\n') == std::string::npos
+            && std::count(line.begin(), line.end(), '\t') == 2 + (ssize_t) entry.roots.size())
+            s += line + "\n";
+    }
+
+    /* This reveals what other users are running, which findRoots()
+       censors for unprivileged clients, so only its owner may read
+       it. */
+    auto tmpPath = fmt("%s.tmp-%d", path, getpid());
+    unlink(tmpPath.c_str());
+    writeFile(tmpPath, s, 0600);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+/* Find the files used by process 'pid'. */
+static void scanProcess(const std::string & pid, const Path & storeDir,
+    UncheckedRoots & unchecked, const EnvRootsCache * oldCache, EnvRootsCache * newCache)
+{
+    auto exe = readProcLink(fmt("/proc/%s/exe", pid));
+    if (exe) unchecked[*exe].emplace(fmt("/proc/%s/exe", pid));
+    readProcLink(fmt("/proc/%s/cwd", pid), unchecked);
+
+    auto fdStr = fmt("/proc/%s/fd", pid);
+    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+    if (!fdDir) {
+        if (errno == ENOENT || errno == EACCES)
+            return;
+        throw SysError("opening %1%", fdStr);
+    }
+    struct dirent * fd_ent;
+    while (errno = 0, fd_ent = readdir(fdDir.get())) {
+        if (fd_ent->d_name[0] != '.')
+            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
+    }
+    if (errno) {
+        if (errno == ESRCH)
+            return;
+        throw SysError("iterating /proc/%1%/fd", pid);
+    }
+    fdDir.reset();
+
+    try {
+        auto mapFile = fmt("/proc/%s/maps", pid);
+        auto maps = readFile(mapFile);
+        for (auto line : tokenizeString<std::vector<string>>(maps, "\n"))
+            if (auto path = parseMapsLine(line))
+                unchecked[std::string(*path)].emplace(mapFile);
+
+        auto envFile = fmt("/proc/%s/environ", pid);
+
+        std::optional<std::string> startTime;
+        if (newCache && exe) startTime = getProcessStartTime(pid);
+
+        const EnvRoots * cached = nullptr;
+        if (oldCache && startTime) {
+            auto i = oldCache->find(pid);
+            if (i != oldCache->end() && i->second.startTime == *startTime && i->second.exe == *exe)
+                cached = &i->second;
+        }
+
+        auto envRoots = cached
+            ? cached->roots
+            : findStorePathsIn(readFile(envFile), storeDir);
+
+        for (auto & root : envRoots)
+            unchecked[root].emplace(envFile);
+
+        if (startTime)
+            newCache->insert_or_assign(pid, EnvRoots{*startTime, *exe, std::move(envRoots)});
+    } catch (SysError & e) {
+        if (errno == ENOENT || errno == EACCES || errno == ESRCH)
+            return;
+        throw;
+    }
+}
+
 void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 {
     UncheckedRoots unchecked;
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
+        std::vector<std::string> pids;
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw SysError("opening %1%", fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw SysError("iterating /proc/%1%/fd", ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
-
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
-                }
-            }
+            std::string_view name = ent->d_name;
+            if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return isdigit((unsigned char) c); }))
+                pids.emplace_back(name);
         }
         if (errno)
             throw SysError("iterating /proc");
+        procDir.reset();
+
+        Path cachePath = stateDir + "/gc-runtime-roots";
+        bool reuse = settings.gcReuseRuntimeRoots;
+        std::optional<EnvRootsCache> oldCache;
+        if (reuse) oldCache = readEnvRootsCache(cachePath);
+
+        /* Reading /proc is mostly waiting for the kernel to format
+           the files of each process, so scan processes in
+           parallel. */
+        struct State
+        {
+            UncheckedRoots unchecked;
+            EnvRootsCache newCache;
+        };
+
+        Sync<State> state_;
+
+        ThreadPool pool;
+
+        for (auto & pid : pids)
+            pool.enqueue([&, pid]() {
+                UncheckedRoots unchecked;
+                EnvRootsCache cache;
+                scanProcess(pid, storeDir, unchecked,
+                    oldCache ? &*oldCache : nullptr,
+                    reuse ? &cache : nullptr);
+                auto state(state_.lock());
+                for (auto & [target, links] : unchecked)
+                    state->unchecked[target].insert(links.begin(), links.end());
+                state->newCache.merge(cache);
+            });
+
+        pool.process();
+
+        auto state(state_.lock());
+        unchecked = std::move(state->unchecked);
+
+        if (reuse) {
+            try {
+                writeEnvRootsCache(cachePath, state->newCache);
+            } catch (SysError & e) {
+                debug("cannot write '%s': %s", cachePath, e.msg());
+            }
+        }
     }
 
 #if !defined(__linux__)
@@ -468,11 +673,167 @@ struct LocalStore::GCState
     uint64_t bytesInvalidated;
     bool moveToTrash = true;
     bool shouldDelete;
+
+    /* In incremental mode, the valid paths that may have become
+       garbage since the previous collection. Other valid paths are
+       known to be alive. */
+    std::optional<StorePathSet> candidates;
+
+    /* The number of paths we invalidated. */
+    uint64_t nrInvalidated = 0;
+
     GCState(const GCOptions & options, GCResults & results)
         : options(options), results(results), bytesInvalidated(0) { }
 };
 
 
+/* What the previous collection knew at its end: every valid path
+   registered up to 'lastId' was reachable from 'roots', except for
+   those in 'pending'. This only holds if no other process has
+   invalidated a path since, i.e. if the invalidation counter in the
+   database is still 'invalidations'. */
+struct IncrementalGCState
+{
+    uint64_t lastId = 0;
+    uint64_t invalidations = 0;
+    bool gcKeepOutputs = false;
+    bool gcKeepDerivations = false;
+    StorePathSet roots;
+    StorePathSet pending;
+};
+
+
+static std::optional<IncrementalGCState> readIncrementalGCState(
+    const Store & store, const Path & path)
+{
+    std::string s;
+    try {
+        s = readFile(path);
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT) return std::nullopt;
+        throw;
+    }
+
+    auto lines = tokenizeString<std::vector<std::string>>(s, "\n");
+    if (lines.empty() || lines[0] != "nix-gc-state 1") return std::nullopt;
+
+    IncrementalGCState state;
+    bool complete = false;
+
+    for (auto & line : lines) {
+        auto space = line.find(' ');
+        if (space == std::string::npos) {
+            if (line == "end") complete = true;
+            continue;
+        }
+        auto key = line.substr(0, space), value = line.substr(space + 1);
+        if (key == "last-id")
+            state.lastId = string2Int<uint64_t>(value).value_or(0);
+        else if (key == "invalidations")
+            state.invalidations = string2Int<uint64_t>(value).value_or(0);
+        else if (key == "keep-outputs")
+            state.gcKeepOutputs = value == "1";
+        else if (key == "keep-derivations")
+            state.gcKeepDerivations = value == "1";
+        else if (key == "root") {
+            if (auto p = store.maybeParseStorePath(value)) state.roots.insert(*p);
+        } else if (key == "pending") {
+            if (auto p = store.maybeParseStorePath(value)) state.pending.insert(*p);
+        }
+    }
+
+    /* Ignore a truncated file. */
+    if (!complete) return std::nullopt;
+
+    return state;
+}
+
+
+static void writeIncrementalGCState(const Store & store, const Path & path,
+    const IncrementalGCState & state)
+{
+    std::string s = "nix-gc-state 1\n";
+    s += fmt("last-id %d\n", state.lastId);
+    s += fmt("invalidations %d\n", state.invalidations);
+    s += fmt("keep-outputs %d\n", state.gcKeepOutputs ? 1 : 0);
+    s += fmt("keep-derivations %d\n", state.gcKeepDerivations ? 1 : 0);
+    for (auto & p : state.roots)
+        s += "root " + store.printStorePath(p) + "\n";
+    for (auto & p : state.pending)
+        s += "pending " + store.printStorePath(p) + "\n";
+    s += "end\n";
+
+    auto tmpPath = fmt("%s.tmp-%d", path, getpid());
+    writeFile(tmpPath, s);
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+
+uint64_t LocalStore::queryLastValidPathId()
+{
+    return retrySQLite<uint64_t>([&]() {
+        auto conn(getReadConnection());
+        SQLiteStmt stmt(conn->db, "select max(id) from ValidPaths;");
+        auto use(stmt.use());
+        return use.next() && !use.isNull(0) ? use.getInt(0) : 0;
+    });
+}
+
+
+StorePathSet LocalStore::queryValidPathsSince(uint64_t id)
+{
+    return retrySQLite<StorePathSet>([&]() {
+        auto conn(getReadConnection());
+        SQLiteStmt stmt(conn->db, "select path from ValidPaths where id > ?;");
+        auto use(stmt.use()(id));
+        StorePathSet res;
+        while (use.next())
+            res.insert(parseStorePath(use.getStr(0)));
+        return res;
+    });
+}
+
+
+std::optional<StorePathSet> LocalStore::findGCCandidates(const GCState & state,
+    const IncrementalGCState & prev)
+{
+    if (prev.gcKeepOutputs != state.gcKeepOutputs
+        || prev.gcKeepDerivations != state.gcKeepDerivations)
+    {
+        debug("not collecting incrementally because the GC settings changed");
+        return std::nullopt;
+    }
+
+    if (prev.invalidations != queryGenerations().invalidations) {
+        debug("not collecting incrementally because paths were invalidated since the last collection");
+        return std::nullopt;
+    }
+
+    /* Paths that were reachable only from roots that have since
+       disappeared. Following derivers and outputs as well covers
+       'keep-outputs' and 'keep-derivations'. */
+    StorePathSet removedRoots;
+    for (auto & root : prev.roots)
+        if (!state.roots.count(root) && isValidPath(root))
+            removedRoots.insert(root);
+
+    StorePathSet candidates;
+    computeFSClosure(removedRoots, candidates, false,
+        state.gcKeepOutputs, state.gcKeepDerivations);
+
+    auto added = queryValidPathsSince(prev.lastId);
+
+    debug("%d paths from %d removed roots, %d new paths and %d leftover paths may be garbage",
+        candidates.size(), removedRoots.size(), added.size(), prev.pending.size());
+
+    candidates.insert(added.begin(), added.end());
+    candidates.insert(prev.pending.begin(), prev.pending.end());
+
+    return candidates;
+}
+
+
 bool LocalStore::isActiveTempFile(const GCState & state,
     const Path & path, const string & suffix)
 {
@@ -502,7 +863,8 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
         for (auto & i : referrers)
             if (printStorePath(i) != path) deletePathRecursive(state, printStorePath(i));
         size = queryPathInfo(*storePath)->narSize;
-        invalidatePathChecked(*storePath);
+        if (invalidatePathChecked(*storePath))
+            state.nrInvalidated++;
     }
 
     Path realPath = realStoreDir + "/" + std::string(baseNameOf(path));
@@ -567,6 +929,12 @@ bool LocalStore::canReachRoot(GCState & state, StorePathSet & visited, const Sto
 
     if (!isValidPath(path)) return false;
 
+    if (state.candidates && !state.candidates->count(path)) {
+        debug("cannot delete '%1%' because it was alive in the previous collection", printStorePath(path));
+        state.alive.insert(path);
+        return true;
+    }
+
     StorePathSet incoming;
 
     /* Don't delete this path if any of its referrers are alive. */
@@ -607,7 +975,11 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
     checkInterrupt();
 
     auto realPath = realStoreDir + "/" + std::string(baseNameOf(path));
-    if (realPath == linksDir || realPath == trashDir) return;
+    if (realPath == linksDir || realPath == trashDir || realPath == chrootTemplatesDir) return;
+
+    /* Deleting the lock table would let other processes acquire
+       locks that are currently held. */
+    if (baseNameOf(realPath) == pathLockTableName) return;
 
     //Activity act(*logger, lvlDebug, format("considering whether to delete '%1%'") % path);
 
@@ -715,6 +1087,21 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        b) Processes from creating new temporary root files. */
     AutoCloseFD fdGCLock = openGCLock(ltWrite);
 
+    /* Paths registered after this point are new to the next
+       incremental collection. Invalidations committed after this
+       point may not be reflected in what we find to be alive, so if
+       there are any besides our own, the next collection must not
+       rely on our results. */
+    bool incremental = settings.gcIncremental
+        && !options.ignoreLiveness
+        && (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcReturnDead);
+    Path incrementalStatePath = stateDir + "/" + gcIncrementalName;
+    uint64_t lastId = 0, invalidations = 0;
+    if (incremental) {
+        invalidations = queryGenerations().invalidations;
+        lastId = queryLastValidPathId();
+    }
+
     /* Find the roots.  Since we've grabbed the GC lock, the set of
        permanent roots cannot increase now. */
     printInfo("finding garbage collector roots...");
@@ -724,6 +1111,11 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     for (auto & i : rootMap) state.roots.insert(i.first);
 
+    /* Tell addTempRoot() that it must wait for us until we're done
+       (see there). */
+    generations->gcEpoch++;
+    Finally updateEpoch([&]() { generations->gcEpoch++; });
+
     /* Read the temporary roots.  This acquires read locks on all
        per-process temporary root files.  So after this point no paths
        can be added to the set of temporary roots. */
@@ -739,6 +1131,16 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        increase, since we hold locks on everything.  So everything
        that is not reachable from `roots' is garbage. */
 
+    if (incremental)
+        if (auto prev = readIncrementalGCState(*this, incrementalStatePath)) {
+            state.candidates = findGCCandidates(state, *prev);
+            if (state.candidates)
+                printInfo("collecting incrementally, considering %d paths", state.candidates->size());
+        }
+
+    /* The valid paths we didn't get to because of --max-freed. */
+    StorePathSet pending;
+
     if (state.shouldDelete) {
         if (pathExists(trashDir)) deleteGarbage(state, trashDir);
         try {
@@ -792,9 +1194,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 if (name == "." || name == "..") continue;
                 Path path = storeDir + "/" + name;
                 auto storePath = maybeParseStorePath(path);
-                if (storePath && isValidPath(*storePath))
-                    entries.push_back(path);
-                else
+                if (storePath && isValidPath(*storePath)) {
+                    if (!state.candidates || state.candidates->count(*storePath))
+                        entries.push_back(path);
+                } else
                     tryToDelete(state, path);
             }
 
@@ -809,13 +1212,39 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             std::mt19937 gen(1);
             std::shuffle(entries_.begin(), entries_.end(), gen);
 
-            for (auto & i : entries_)
-                tryToDelete(state, i);
+            for (size_t i = 0; i < entries_.size(); ++i) {
+                try {
+                    tryToDelete(state, entries_[i]);
+                } catch (GCLimitReached & e) {
+                    for (; i < entries_.size(); ++i)
+                        pending.insert(parseStorePath(entries_[i]));
+                    throw;
+                }
+            }
 
         } catch (GCLimitReached & e) {
         }
     }
 
+    /* Record what we know for the next incremental collection: every
+       valid path registered before we started is now reachable from
+       the current roots, unless it's pending. That doesn't hold if
+       someone else invalidated paths in the meantime. */
+    if (incremental && options.action == GCOptions::gcDeleteDead && options.maxFreed > 0) {
+        IncrementalGCState next;
+        next.lastId = lastId;
+        next.invalidations = queryGenerations().invalidations;
+        next.gcKeepOutputs = state.gcKeepOutputs;
+        next.gcKeepDerivations = state.gcKeepDerivations;
+        next.roots = state.roots;
+        for (auto & p : pending)
+            if (isValidPath(p)) next.pending.insert(p);
+        if (next.invalidations == invalidations + state.nrInvalidated)
+            writeIncrementalGCState(*this, incrementalStatePath, next);
+        else
+            deletePath(incrementalStatePath);
+    }
+
     if (state.options.action == GCOptions::gcReturnLive) {
         for (auto & i : state.alive)
             state.results.paths.insert(printStorePath(i));
@@ -865,7 +1294,7 @@ void LocalStore::autoGC(bool sync)
     std::shared_future<void> future;
 
     {
-        auto state(_state.lock());
+        auto state(lockState());
 
         if (state->gcRunning) {
             future = state->gcFuture;
@@ -896,7 +1325,7 @@ void LocalStore::autoGC(bool sync)
 
                 /* Wake up any threads waiting for the auto-GC to finish. */
                 Finally wakeup([&]() {
-                    auto state(_state.lock());
+                    auto state(lockState());
                     state->gcRunning = false;
                     state->lastGCCheck = std::chrono::steady_clock::now();
                     promise.set_value();
@@ -911,7 +1340,7 @@ void LocalStore::autoGC(bool sync)
 
                 collectGarbage(options, results);
 
-                _state.lock()->availAfterGC = getAvail();
+                lockState()->availAfterGC = getAvail();
 
             } catch (...) {
                 // FIXME: we could propagate the exception to the
@@ -111,6 +111,28 @@ public:
         )",
         {"build-max-jobs"}};
 
+    Setting<bool> criticalPathScheduling{
+        this, true, "critical-path-scheduling",
+        R"(
+          If set to `true`, Nix will start builds that have the longest chain
+          of dependent builds behind them first when there are more builds
+          ready than `max-jobs` allows. The length of a chain is estimated
+          from the durations of previous builds of derivations with the same
+          name.
+        )"};
+
+    Setting<unsigned int> speculativeBuildMaxTime{
+        this, 0, "speculative-build-max-time",
+        R"(
+          If set to a non-zero value, derivations whose previous builds
+          took at most this many seconds are built right away, while
+          their outputs are substituted in parallel, instead of only
+          after substitution failed. Whichever finishes first provides
+          the outputs; if the substitutes arrive before the build has
+          started, the build is abandoned. Build durations are recorded
+          in the same database as for `critical-path-scheduling`.
+        )"};
+
     Setting<unsigned int> buildCores{
         this, getDefaultCores(), "cores",
         R"(
@@ -125,6 +147,20 @@ public:
         )",
         {"build-cores"}};
 
+    Setting<unsigned int> jobserverCores{
+        this, 0, "jobserver-cores",
+        R"(
+          If set to a non-zero value, Nix runs a GNU make-compatible
+          jobserver with this many tokens, shared by all local builds started
+          by one Nix invocation, and passes it to builders through the
+          `MAKEFLAGS` environment variable (unless the derivation sets
+          `MAKEFLAGS` itself). Tools that support the jobserver protocol then
+          draw from a common CPU budget instead of each using `cores` jobs.
+
+          Note that builders can use the jobserver to communicate with each
+          other, so this weakens the isolation between concurrent builds.
+        )"};
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode = false;
@@ -194,6 +230,31 @@ public:
           this computer and the remote build host is slow.
         )"};
 
+    Setting<uint64_t> buildersSubstituteMinSize{
+        this, 0, "builders-substitute-min-size",
+        R"(
+          If set to a non-zero value and `builders-use-substitutes` is
+          `false`, Nix asks remote build machines to substitute those missing
+          inputs that are available from this machine's substituters and
+          whose NAR is at least this many bytes, and uploads only the rest.
+          Small paths are cheaper to upload than to fetch from a binary
+          cache. This assumes that the remote machines use the same
+          substituters as this machine; paths they fail to substitute are
+          uploaded as usual.
+        )"};
+
+    Setting<unsigned int> buildersConnectionPersist{
+        this, 0, "builders-connection-persist",
+        R"(
+          If non-zero, the number of seconds that an SSH connection to a
+          remote build machine is kept open after the last build that
+          used it. The connection is shared by all builds on that
+          machine, so that they don't each pay for setting up a new SSH
+          session. Note that this leaves an `ssh` process running in the
+          background for that long after the build. The default `0`
+          disables connection sharing.
+        )"};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -209,8 +270,22 @@ public:
     Setting<bool> useSQLiteWAL{this, !isWSL1(), "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
 
+    Setting<bool> pathLockTable{
+        this, false, "path-lock-table",
+        R"(
+          If set to `true`, store paths (and other paths locked by Nix,
+          such as profiles) are locked using byte-range locks in a
+          single file `.path-locks` in their parent directory, keyed by
+          a hash of the path, instead of by creating, locking and
+          deleting a `.lock` file for each path. This requires far
+          fewer file system operations. It requires open file
+          description locks (Linux 3.15 or later) and must be enabled
+          for every Nix process using the same store, since the two
+          kinds of locks don't exclude each other.
+        )"};
+
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
-        "Whether to call `sync()` before registering a path as valid."};
+        "Whether to flush the file system containing the store to disk (using `syncfs()` where available) before registering paths as valid."};
 
     Setting<bool> useSubstitutes{
         this, true, "substitute",
@@ -278,6 +353,18 @@ public:
         )",
         {"build-compress-log"}};
 
+    Setting<bool> indexLog{
+        this, false, "index-build-log",
+        R"(
+          If set to `true`, build logs are written as a sequence of
+          independently xz-compressed frames together with an index
+          of frame offsets, line counts and timestamps. This allows
+          `nix log --tail` to read the end of a large log without
+          decompressing all of it, and `nix log --follow` to show the
+          log of a build that is still running. This setting takes
+          precedence over `compress-build-log`.
+        )"};
+
     Setting<unsigned long> maxLogSize{
         this, 0, "max-build-log-size",
         R"(
@@ -311,6 +398,34 @@ public:
         )",
         {"gc-keep-outputs"}};
 
+    Setting<bool> gcIncremental{
+        this, false, "incremental-gc",
+        R"(
+          If `true`, the garbage collector records the roots it found
+          and the paths it didn't get to (in
+          `/nix/var/nix/gc-incremental`). The next collection then only
+          considers paths that may have become garbage since: the
+          closures of roots that have disappeared, paths registered
+          since, and the paths left over. Other paths are known to be
+          reachable from a root that still exists. The collector falls
+          back to examining every path if paths were deleted or changed
+          by anything else in the meantime, or if `keep-outputs` or
+          `keep-derivations` changed.
+        )"};
+
+    Setting<bool> gcReuseRuntimeRoots{
+        this, false, "gc-reuse-runtime-roots",
+        R"(
+          If `true`, the garbage collector remembers the store paths it
+          found in the environment of each process (in
+          `/nix/var/nix/gc-runtime-roots`) and reuses them for
+          processes with the same pid, start time and executable,
+          instead of reading their environment again. This speeds up
+          finding runtime roots on machines with many processes, but
+          misses store paths in the environment of a process that has
+          exec()ed the same executable with a different environment.
+        )"};
+
     Setting<bool> gcKeepDerivations{
         this, true, "keep-derivations",
         R"(
@@ -440,6 +555,37 @@ public:
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<bool> useCgroups{
+        this, false, "use-cgroups",
+        R"(
+          If set to `true`, Nix runs each local build in its own cgroup
+          (cgroups v2 only), kills any processes left in it when the build
+          finishes, and reports the build's resource usage: CPU time, peak
+          memory, I/O and pressure stall times. This requires Nix to be
+          allowed to create cgroups below its own cgroup (e.g. via systemd's
+          `Delegate=yes`). Peak memory and I/O are only available if the
+          `memory` and `io` controllers can be enabled for the build's
+          cgroup. To make this possible, the daemon moves itself into a
+          child cgroup named `supervisor`, and builds get cgroups next to
+          it.
+        )"};
+
+    Setting<uint64_t> buildMemoryMax{
+        this, 0, "build-memory-max",
+        R"(
+          If non-zero and `use-cgroups` is enabled, the maximum amount of
+          memory in bytes that the processes of a build may use together.
+          A derivation can set a lower limit through the `memoryMax`
+          attribute.
+        )"};
+
+    Setting<unsigned int> buildCpuMax{
+        this, 0, "build-cpu-max",
+        R"(
+          If non-zero and `use-cgroups` is enabled, the maximum number of
+          CPUs' worth of time that the processes of a build may use.
+        )"};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
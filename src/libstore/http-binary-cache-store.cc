@@ -137,11 +137,18 @@ protected:
 
     FileTransferRequest makeRequest(const std::string & path)
     {
-        return FileTransferRequest(
+        FileTransferRequest request(
             hasPrefix(path, "https://") || hasPrefix(path, "http://") || hasPrefix(path, "file://")
             ? path
             : cacheUri + "/" + path);
 
+        /* Don't let metadata lookups queue behind NAR downloads. */
+        if (hasSuffix(path, ".narinfo") || path == "nix-cache-info")
+            request.priority = FileTransferPriority::High;
+        else if (hasPrefix(path, "nar/"))
+            request.priority = FileTransferPriority::Low;
+
+        return request;
     }
 
     void getFile(const std::string & path, Sink & sink) override
@@ -158,6 +165,32 @@ protected:
         }
     }
 
+    void getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length, Sink & sink) override
+    {
+        checkEnabled();
+        if (length == 0) return;
+        auto request(makeRequest(path));
+        request.range = {offset, length};
+        try {
+            auto data = getFileTransfer()->download(request).data;
+            /* Servers that don't support ranged requests send the
+               entire file. */
+            if (data->size() > length) {
+                if (offset + length > data->size())
+                    throw Error("byte range %d-%d is outside of file '%s' in binary cache '%s'",
+                        offset, offset + length, path, getUri());
+                sink({data->data() + offset, length});
+            } else
+                sink(*data);
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::shared_ptr<std::string>> callback) noexcept override
     {
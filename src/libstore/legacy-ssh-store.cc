@@ -16,6 +16,8 @@ struct LegacySSHStoreConfig : virtual StoreConfig
     const Setting<int> maxConnections{(StoreConfig*) this, 1, "max-connections", "maximum number of concurrent SSH connections"};
     const Setting<Path> sshKey{(StoreConfig*) this, "", "ssh-key", "path to an SSH private key"};
     const Setting<bool> compress{(StoreConfig*) this, false, "compress", "whether to compress the connection"};
+    const Setting<Path> sshControlPath{(StoreConfig*) this, "", "ssh-control-path", "path of an SSH control socket for a master connection shared with other processes"};
+    const Setting<unsigned int> sshControlPersist{(StoreConfig*) this, 600, "ssh-control-persist", "number of seconds that a shared SSH master connection stays up after its last use"};
     const Setting<Path> remoteProgram{(StoreConfig*) this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{(StoreConfig*) this, "", "remote-store", "URI of the store on the remote system"};
 
@@ -62,7 +64,9 @@ struct LegacySSHStore : public virtual LegacySSHStoreConfig, public virtual Stor
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
             compress,
-            logFD)
+            logFD,
+            sshControlPath,
+            sshControlPersist)
     {
     }
 
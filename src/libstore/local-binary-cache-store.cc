@@ -59,6 +59,51 @@ protected:
         del.cancel();
     }
 
+    /* Write the file directly into the binary cache under a
+       temporary name, and rename it into place once its final name
+       is known. */
+    struct LocalUpload : PendingUpload
+    {
+        AutoCloseFD fd;
+        Path tmp;
+        AutoDelete del;
+        FdSink fileSink;
+
+        LocalUpload(const Path & dir)
+        {
+            tmp = dir + "/.upload.XXXXXX";
+            fd = mkstemp((char *) tmp.c_str());
+            if (!fd)
+                throw SysError("creating temporary file '%s'", tmp);
+            del.reset(tmp, false);
+            /* mkstemp() creates the file with mode 0600, but the
+               binary cache may be served by another user. */
+            if (fchmod(fd.get(), 0644) == -1)
+                throw SysError("setting permissions of '%s'", tmp);
+            fileSink.fd = fd.get();
+        }
+
+        Sink & sink() override
+        {
+            return fileSink;
+        }
+
+        void commit(const std::string & path, const std::string & mimeType) override
+        {
+            fileSink.flush();
+            fd = -1;
+            auto path2 = dirOf(tmp) + "/" + path;
+            if (rename(tmp.c_str(), path2.c_str()))
+                throw SysError("renaming '%1%' to '%2%'", tmp, path2);
+            del.cancel();
+        }
+    };
+
+    std::unique_ptr<PendingUpload> startUpload() override
+    {
+        return std::make_unique<LocalUpload>(binaryCacheDir);
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         try {
@@ -69,6 +114,32 @@ protected:
         }
     }
 
+    void getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length, Sink & sink) override
+    {
+        AutoCloseFD fd = open((binaryCacheDir + "/" + path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw SysError("opening file '%s' in binary cache", path);
+        }
+
+        std::vector<char> buf(std::min(length, (uint64_t) 65536));
+        while (length) {
+            checkInterrupt();
+            auto n = pread(fd.get(), buf.data(), std::min(length, (uint64_t) buf.size()), offset);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading file '%s' in binary cache", path);
+            }
+            if (n == 0)
+                throw EndOfFile("unexpected end of file '%s' in binary cache", path);
+            sink({buf.data(), (size_t) n});
+            offset += n;
+            length -= n;
+        }
+    }
+
     StorePathSet queryAllValidPaths() override
     {
         StorePathSet paths;
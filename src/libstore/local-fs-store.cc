@@ -5,6 +5,7 @@
 #include "globals.hh"
 #include "compression.hh"
 #include "derivations.hh"
+#include "build-log.hh"
 
 namespace nix {
 
@@ -89,21 +90,39 @@ const string LocalFSStore::drvsLogDir = "drvs";
 
 
 
-std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
+std::optional<StorePath> LocalFSStore::getLogDrvPath(const StorePath & path)
 {
-    auto path = path_;
-
-    if (!path.isDerivation()) {
-        try {
-            auto info = queryPathInfo(path);
-            if (!info->deriver) return nullptr;
-            path = *info->deriver;
-        } catch (InvalidPath &) {
-            return nullptr;
-        }
+    if (path.isDerivation()) return path;
+
+    try {
+        return queryPathInfo(path)->deriver;
+    } catch (InvalidPath &) {
+        return std::nullopt;
     }
+}
+
+
+std::optional<Path> LocalFSStore::getIndexedBuildLogPath(const StorePath & path)
+{
+    auto drvPath = getLogDrvPath(path);
+    if (!drvPath) return std::nullopt;
+
+    auto baseName = std::string(baseNameOf(printStorePath(*drvPath)));
+
+    Path logPath = fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2));
 
-    auto baseName = std::string(baseNameOf(printStorePath(path)));
+    if (!pathExists(logPath + ".idx")) return std::nullopt;
+
+    return logPath;
+}
+
+
+std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
+{
+    auto path = getLogDrvPath(path_);
+    if (!path) return nullptr;
+
+    auto baseName = std::string(baseNameOf(printStorePath(*path)));
 
     for (int j = 0; j < 2; j++) {
 
@@ -116,6 +135,14 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const StorePath & path_)
         if (pathExists(logPath))
             return std::make_shared<std::string>(readFile(logPath));
 
+        else if (pathExists(logPath + ".idx")) {
+            /* Only read the frames listed in the index, since the
+               last frame may still be in progress. */
+            auto index = readLogIndex(logPath + ".idx");
+            return std::make_shared<std::string>(
+                readIndexedLog(logPath + ".xz", index, 0, index.checkpoints.size() - 1));
+        }
+
         else if (pathExists(logBz2Path)) {
             try {
                 return decompress("bzip2", readFile(logBz2Path));
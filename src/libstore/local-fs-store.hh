@@ -43,6 +43,14 @@ public:
     }
 
     std::shared_ptr<std::string> getBuildLog(const StorePath & path) override;
+
+    /* Return the path (without extension) of the indexed build log
+       of 'path' or its deriver, if one exists. See build-log.hh. */
+    std::optional<Path> getIndexedBuildLogPath(const StorePath & path);
+
+private:
+
+    std::optional<StorePath> getLogDrvPath(const StorePath & path);
 };
 
 }
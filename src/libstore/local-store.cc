@@ -8,10 +8,12 @@
 #include "references.hh"
 #include "callback.hh"
 #include "topo-sort.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -42,25 +44,51 @@
 
 namespace nix {
 
-struct LocalStore::State::Stmts {
+struct LocalStore::ReadStmts {
+    SQLiteStmt QueryPathInfo;
+    SQLiteStmt QueryReferences;
+    SQLiteStmt QueryReferrers;
+    SQLiteStmt QueryValidDerivers;
+    SQLiteStmt QueryDerivationOutputs;
+    SQLiteStmt QueryPathFromHashPart;
+    SQLiteStmt QueryValidPaths;
+
+    void create(SQLite & db)
+    {
+        QueryPathInfo.create(db,
+            "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+        QueryReferences.create(db,
+            "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+        QueryReferrers.create(db,
+            "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+        QueryValidDerivers.create(db,
+            "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+        QueryDerivationOutputs.create(db,
+            "select id, path from DerivationOutputs where drv = ?;");
+        // Use "path >= ?" with limit 1 rather than "path like '?%'" to
+        // ensure efficient lookup.
+        QueryPathFromHashPart.create(db,
+            "select path from ValidPaths where path >= ? limit 1;");
+        QueryValidPaths.create(db, "select path from ValidPaths");
+    }
+};
+
+struct LocalStore::State::Stmts : LocalStore::ReadStmts {
     /* Some precompiled SQLite statements. */
     SQLiteStmt RegisterValidPath;
     SQLiteStmt UpdatePathInfo;
     SQLiteStmt AddReference;
-    SQLiteStmt QueryPathInfo;
-    SQLiteStmt QueryReferences;
-    SQLiteStmt QueryReferrers;
     SQLiteStmt InvalidatePath;
     SQLiteStmt AddDerivationOutput;
     SQLiteStmt RegisterRealisedOutput;
-    SQLiteStmt QueryValidDerivers;
-    SQLiteStmt QueryDerivationOutputs;
     SQLiteStmt QueryRealisedOutput;
     SQLiteStmt QueryAllRealisedOutputs;
-    SQLiteStmt QueryPathFromHashPart;
-    SQLiteStmt QueryValidPaths;
 };
 
+LocalStore::ReadConnection::~ReadConnection()
+{
+}
+
 int getSchema(Path schemaPath)
 {
     int curSchema = 0;
@@ -100,12 +128,51 @@ void migrateCASchema(SQLite& db, Path schemaPath, AutoCloseFD& lockFd)
     }
 }
 
+/* Since schema version 11, NAR hashes are stored as raw digests
+   rather than as "<type>:<base16>" text, which halves the size of the
+   column and saves parsing them on every lookup. The hash type is
+   implied by the length of the digest (see narHashFromBlob()). */
+static void upgradeNarHashes(SQLite & db)
+{
+    printInfo("upgrading Nix store to store NAR hashes in binary form...");
+
+    SQLiteTxn txn(db);
+
+    std::vector<std::pair<int64_t, Hash>> hashes;
+    {
+        SQLiteStmt query(db, "select id, path, hash from ValidPaths where typeof(hash) = 'text';");
+        auto use(query.use());
+        while (use.next()) {
+            try {
+                hashes.emplace_back(use.getInt(0), Hash::parseAnyPrefixed(use.getStr(2)));
+            } catch (BadHash & e) {
+                warn("invalid-path entry for '%s': %s", use.getStr(1), e.what());
+            }
+        }
+    }
+
+    SQLiteStmt update(db, "update ValidPaths set hash = ? where id = ?;");
+    for (auto & [id, hash] : hashes)
+        update.use()(hash.hash, hash.hashSize)(id).exec();
+
+    txn.commit();
+}
+
+
+static const char schema[] =
+#include "schema.sql.gen.hh"
+    ;
+
+
 LocalStore::LocalStore(const Params & params)
     : StoreConfig(params)
     , LocalFSStoreConfig(params)
     , LocalStoreConfig(params)
     , Store(params)
     , LocalFSStore(params)
+    , readPool(
+        std::max(1U, std::thread::hardware_concurrency()),
+        [this]() { return openReadConnection(); })
     , realStoreDir_{this, false, rootDir != "" ? rootDir + "/nix/store" : storeDir, "real",
         "physical path to the Nix store"}
     , realStoreDir(realStoreDir_)
@@ -115,10 +182,11 @@ LocalStore::LocalStore(const Params & params)
     , schemaPath(dbDir + "/schema")
     , trashDir(realStoreDir + "/trash")
     , tempRootsDir(stateDir + "/temproots")
+    , chrootTemplatesDir(realStoreDir + "/.chroot-templates")
     , fnTempRoots(fmt("%s/%d", tempRootsDir, getpid()))
     , locksHeld(tokenizeString<PathSet>(getEnv("NIX_HELD_LOCKS").value_or("")))
 {
-    auto state(_state.lock());
+    auto state(lockState());
     state->stmts = std::make_unique<State::Stmts>();
 
     /* Create missing state directories if they don't already exist. */
@@ -270,6 +338,19 @@ LocalStore::LocalStore(const Params & params)
             txn.commit();
         }
 
+        if (curSchema < 11)
+            upgradeNarHashes(state->db);
+
+        if (curSchema < 12) {
+            /* This adds the 'Generations' table and its triggers;
+               everything else already exists. */
+            SQLiteTxn txn(state->db);
+            state->db.exec(schema);
+            txn.commit();
+            /* The published counters may be ahead of the new table. */
+            unlink((dbDir + "/generations").c_str());
+        }
+
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
@@ -288,25 +369,11 @@ LocalStore::LocalStore(const Params & params)
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state->stmts->AddReference.create(state->db,
         "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmts->QueryPathInfo.create(state->db,
-        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmts->QueryReferences.create(state->db,
-        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmts->QueryReferrers.create(state->db,
-        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
     state->stmts->InvalidatePath.create(state->db,
         "delete from ValidPaths where path = ?;");
     state->stmts->AddDerivationOutput.create(state->db,
         "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
-    state->stmts->QueryValidDerivers.create(state->db,
-        "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
-    state->stmts->QueryDerivationOutputs.create(state->db,
-        "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
-    state->stmts->QueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
-    state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmts->ReadStmts::create(state->db);
     if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -329,6 +396,21 @@ LocalStore::LocalStore(const Params & params)
                     ;
             )");
     }
+
+    generations = &openStoreGenerations(dbDir + "/generations");
+
+    /* Catch up with changes by a process that died between committing
+       and publishing them. */
+    publishGenerations();
+
+    if (pathInfoSnapshot) {
+        lastSnapshotRefresh = time(0);
+        try {
+            refreshSnapshot();
+        } catch (Error & e) {
+            warn("cannot use the path info snapshot: %s", e.msg());
+        }
+    }
 }
 
 
@@ -337,7 +419,7 @@ LocalStore::~LocalStore()
     std::shared_future<void> future;
 
     {
-        auto state(_state.lock());
+        auto state(lockState());
         if (state->gcRunning)
             future = state->gcFuture;
     }
@@ -348,9 +430,9 @@ LocalStore::~LocalStore()
     }
 
     try {
-        auto state(_state.lock());
-        if (state->fdTempRoots) {
-            state->fdTempRoots = -1;
+        auto tempRoots(_tempRoots.lock());
+        if (tempRoots->fd) {
+            tempRoots->fd = -1;
             unlink(fnTempRoots.c_str());
         }
     } catch (...) {
@@ -368,6 +450,114 @@ std::string LocalStore::getUri()
 int LocalStore::getSchema()
 { return nix::getSchema(schemaPath); }
 
+
+ref<LocalStore::ReadConnection> LocalStore::openReadConnection()
+{
+    auto conn = make_ref<ReadConnection>();
+    conn->db = SQLite(dbDir + "/db.sqlite", false);
+    conn->db.exec("pragma query_only = 1");
+    conn->stmts = std::make_unique<ReadStmts>();
+    conn->stmts->create(conn->db);
+    return conn;
+}
+
+
+/* How often a process tries to replace a stale snapshot. This keeps
+   processes from rebuilding it continuously while paths are being
+   deleted. */
+static const time_t snapshotRefreshInterval = 60;
+
+
+std::shared_ptr<PathInfoSnapshot> LocalStore::getSnapshot(bool needReferrers)
+{
+    if (!pathInfoSnapshot) return nullptr;
+
+    auto isCurrent = [&](const std::shared_ptr<PathInfoSnapshot> & s) {
+        if (!s) return false;
+        auto generation = s->generation();
+        return generation.invalidations == generations->invalidations
+            && (!needReferrers || generation.registrations == generations->registrations);
+    };
+
+    auto s = std::atomic_load(&snapshot);
+    if (isCurrent(s)) return s;
+
+    auto now = time(0);
+    auto last = lastSnapshotRefresh.load();
+    if (now - last >= snapshotRefreshInterval && lastSnapshotRefresh.compare_exchange_strong(last, now)) {
+        try {
+            refreshSnapshot();
+        } catch (Error & e) {
+            debug("cannot refresh the path info snapshot: %s", e.msg());
+        }
+        s = std::atomic_load(&snapshot);
+        if (isCurrent(s)) return s;
+    }
+
+    return nullptr;
+}
+
+
+void LocalStore::refreshSnapshot()
+{
+    Path path = dbDir + "/snapshot";
+
+    /* Registrations don't make a snapshot stale for path info
+       lookups, so they don't warrant a rebuild. */
+    auto isCurrent = [&](const std::shared_ptr<PathInfoSnapshot> & s) {
+        return s && s->generation().invalidations == generations->invalidations;
+    };
+
+    auto s = PathInfoSnapshot::open(path);
+
+    if (!isCurrent(s)) {
+        /* Only one process rebuilds the snapshot; the others use the
+           database in the meantime. */
+        AutoCloseFD fdLock = openLockFile(path + ".lock", true);
+        if (!lockFile(fdLock.get(), ltWrite, false)) return;
+
+        s = PathInfoSnapshot::open(path);
+        if (!isCurrent(s)) {
+            debug("rebuilding the path info snapshot");
+            auto conn(getReadConnection());
+            auto generation = retrySQLite<PathInfoSnapshot::Generation>([&]() {
+                return PathInfoSnapshot::write(conn->db, *this, path);
+            });
+            /* The snapshot may have seen commits that aren't
+               published yet. */
+            nix::publishGenerations(*generations, generation);
+            s = PathInfoSnapshot::open(path);
+        }
+    }
+
+    std::atomic_store(&snapshot, s);
+}
+
+
+PathInfoSnapshot::Generation LocalStore::queryGenerations()
+{
+    return retrySQLite<PathInfoSnapshot::Generation>([&]() {
+        auto conn(getReadConnection());
+        return nix::queryGenerations(conn->db);
+    });
+}
+
+
+void LocalStore::publishGenerations()
+{
+    nix::publishGenerations(*generations, queryGenerations());
+}
+
+
+Pool<LocalStore::ReadConnection>::Handle LocalStore::getReadConnection()
+{
+    auto before = std::chrono::steady_clock::now();
+    auto conn(readPool.get());
+    stats.dbReadConnectionWaitTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - before).count();
+    return conn;
+}
+
 void LocalStore::openDB(State & state, bool create)
 {
     if (access(dbDir.c_str(), R_OK | W_OK))
@@ -420,12 +610,8 @@ void LocalStore::openDB(State & state, bool create)
         throwSQLiteError(db, "setting autocheckpoint interval");
 
     /* Initialise the database schema, if necessary. */
-    if (create) {
-        static const char schema[] =
-#include "schema.sql.gen.hh"
-            ;
+    if (create)
         db.exec(schema);
-    }
 }
 
 
@@ -655,7 +841,7 @@ void LocalStore::checkDerivationOutputs(const StorePath & drvPath, const Derivat
 
 void LocalStore::registerDrvOutput(const Realisation & info)
 {
-    auto state(_state.lock());
+    auto state(lockState());
     retrySQLite<void>([&]() {
         state->stmts->RegisterRealisedOutput.use()
             (info.id.strHash())
@@ -687,7 +873,7 @@ uint64_t LocalStore::addValidPath(State & state,
 
     state.stmts->RegisterValidPath.use()
         (printStorePath(info.path))
-        (info.narHash.to_string(Base16, true))
+        (info.narHash.hash, info.narHash.hashSize)
         (info.registrationTime == 0 ? time(0) : info.registrationTime)
         (info.deriver ? printStorePath(*info.deriver) : "", (bool) info.deriver)
         (info.narSize, info.narSize != 0)
@@ -733,19 +919,23 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
     try {
+        if (auto snapshot = getSnapshot())
+            if (auto info = snapshot->lookup(*this, path))
+                return callback(std::move(info));
+
         callback(retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-            return queryPathInfoInternal(*state, path);
+            auto conn(getReadConnection());
+            return queryPathInfoInternal(*conn->stmts, path);
         }));
 
     } catch (...) { callback.rethrow(); }
 }
 
 
-std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & state, const StorePath & path)
+std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(ReadStmts & stmts, const StorePath & path)
 {
     /* Get the path info. */
-    auto useQueryPathInfo(state.stmts->QueryPathInfo.use()(printStorePath(path)));
+    auto useQueryPathInfo(stmts.QueryPathInfo.use()(printStorePath(path)));
 
     if (!useQueryPathInfo.next())
         return std::shared_ptr<ValidPathInfo>();
@@ -754,7 +944,11 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     auto narHash = Hash::dummy;
     try {
-        narHash = Hash::parseAnyPrefixed(useQueryPathInfo.getStr(1));
+        narHash = sqlite3_column_type(stmts.QueryPathInfo, 1) == SQLITE_BLOB
+            ? narHashFromBlob(
+                sqlite3_column_blob(stmts.QueryPathInfo, 1),
+                sqlite3_column_bytes(stmts.QueryPathInfo, 1))
+            : Hash::parseAnyPrefixed(useQueryPathInfo.getStr(1));
     } catch (BadHash & e) {
         throw Error("invalid-path entry for '%s': %s", printStorePath(path), e.what());
     }
@@ -765,7 +959,7 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     info->registrationTime = useQueryPathInfo.getInt(2);
 
-    auto s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 3);
+    auto s = (const char *) sqlite3_column_text(stmts.QueryPathInfo, 3);
     if (s) info->deriver = parseStorePath(s);
 
     /* Note that narSize = NULL yields 0. */
@@ -773,14 +967,14 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     info->ultimate = useQueryPathInfo.getInt(5) == 1;
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 6);
+    s = (const char *) sqlite3_column_text(stmts.QueryPathInfo, 6);
     if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 7);
+    s = (const char *) sqlite3_column_text(stmts.QueryPathInfo, 7);
     if (s) info->ca = parseContentAddressOpt(s);
 
     /* Get the references. */
-    auto useQueryReferences(state.stmts->QueryReferences.use()(info->id));
+    auto useQueryReferences(stmts.QueryReferences.use()(info->id));
 
     while (useQueryReferences.next())
         info->references.insert(parseStorePath(useQueryReferences.getStr(0)));
@@ -794,7 +988,7 @@ void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
     state.stmts->UpdatePathInfo.use()
         (info.narSize, info.narSize != 0)
-        (info.narHash.to_string(Base16, true))
+        (info.narHash.hash, info.narHash.hashSize)
         (info.ultimate ? 1 : 0, info.ultimate)
         (concatStringsSep(" ", info.sigs), !info.sigs.empty())
         (renderContentAddress(info.ca), (bool) info.ca)
@@ -803,26 +997,29 @@ void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 }
 
 
-uint64_t LocalStore::queryValidPathId(State & state, const StorePath & path)
+uint64_t LocalStore::queryValidPathId(ReadStmts & stmts, const StorePath & path)
 {
-    auto use(state.stmts->QueryPathInfo.use()(printStorePath(path)));
+    auto use(stmts.QueryPathInfo.use()(printStorePath(path)));
     if (!use.next())
         throw InvalidPath("path '%s' is not valid", printStorePath(path));
     return use.getInt(0);
 }
 
 
-bool LocalStore::isValidPath_(State & state, const StorePath & path)
+bool LocalStore::isValidPath_(ReadStmts & stmts, const StorePath & path)
 {
-    return state.stmts->QueryPathInfo.use()(printStorePath(path)).next();
+    return stmts.QueryPathInfo.use()(printStorePath(path)).next();
 }
 
 
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
+    if (auto snapshot = getSnapshot())
+        if (snapshot->contains(path)) return true;
+
     return retrySQLite<bool>([&]() {
-        auto state(_state.lock());
-        return isValidPath_(*state, path);
+        auto conn(getReadConnection());
+        return isValidPath_(*conn->stmts, path);
     });
 }
 
@@ -839,8 +1036,8 @@ StorePathSet LocalStore::queryValidPaths(const StorePathSet & paths, SubstituteF
 StorePathSet LocalStore::queryAllValidPaths()
 {
     return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
-        auto use(state->stmts->QueryValidPaths.use());
+        auto conn(getReadConnection());
+        auto use(conn->stmts->QueryValidPaths.use());
         StorePathSet res;
         while (use.next()) res.insert(parseStorePath(use.getStr(0)));
         return res;
@@ -848,9 +1045,9 @@ StorePathSet LocalStore::queryAllValidPaths()
 }
 
 
-void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
+void LocalStore::queryReferrers(ReadStmts & stmts, const StorePath & path, StorePathSet & referrers)
 {
-    auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
+    auto useQueryReferrers(stmts.QueryReferrers.use()(printStorePath(path)));
 
     while (useQueryReferrers.next())
         referrers.insert(parseStorePath(useQueryReferrers.getStr(0)));
@@ -859,9 +1056,15 @@ void LocalStore::queryReferrers(State & state, const StorePath & path, StorePath
 
 void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers)
 {
+    if (auto snapshot = getSnapshot(true))
+        if (auto res = snapshot->queryReferrers(path)) {
+            referrers.insert(res->begin(), res->end());
+            return;
+        }
+
     return retrySQLite<void>([&]() {
-        auto state(_state.lock());
-        queryReferrers(*state, path, referrers);
+        auto conn(getReadConnection());
+        queryReferrers(*conn->stmts, path, referrers);
     });
 }
 
@@ -869,9 +1072,9 @@ void LocalStore::queryReferrers(const StorePath & path, StorePathSet & referrers
 StorePathSet LocalStore::queryValidDerivers(const StorePath & path)
 {
     return retrySQLite<StorePathSet>([&]() {
-        auto state(_state.lock());
+        auto conn(getReadConnection());
 
-        auto useQueryValidDerivers(state->stmts->QueryValidDerivers.use()(printStorePath(path)));
+        auto useQueryValidDerivers(conn->stmts->QueryValidDerivers.use()(printStorePath(path)));
 
         StorePathSet derivers;
         while (useQueryValidDerivers.next())
@@ -887,11 +1090,11 @@ LocalStore::queryDerivationOutputMapNoResolve(const StorePath& path_)
 {
     auto path = path_;
     auto outputs = retrySQLite<std::map<std::string, std::optional<StorePath>>>([&]() {
-        auto state(_state.lock());
+        auto conn(getReadConnection());
         std::map<std::string, std::optional<StorePath>> outputs;
         uint64_t drvId;
-        drvId = queryValidPathId(*state, path);
-        auto use(state->stmts->QueryDerivationOutputs.use()(drvId));
+        drvId = queryValidPathId(*conn->stmts, path);
+        auto use(conn->stmts->QueryDerivationOutputs.use()(drvId));
         while (use.next())
             outputs.insert_or_assign(
                 use.getStr(0), parseStorePath(use.getStr(1)));
@@ -922,13 +1125,13 @@ std::optional<StorePath> LocalStore::queryPathFromHashPart(const std::string & h
     Path prefix = storeDir + "/" + hashPart;
 
     return retrySQLite<std::optional<StorePath>>([&]() -> std::optional<StorePath> {
-        auto state(_state.lock());
+        auto conn(getReadConnection());
 
-        auto useQueryPathFromHashPart(state->stmts->QueryPathFromHashPart.use()(prefix));
+        auto useQueryPathFromHashPart(conn->stmts->QueryPathFromHashPart.use()(prefix));
 
         if (!useQueryPathFromHashPart.next()) return {};
 
-        const char * s = (const char *) sqlite3_column_text(state->stmts->QueryPathFromHashPart, 0);
+        const char * s = (const char *) sqlite3_column_text(conn->stmts->QueryPathFromHashPart, 0);
         if (s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0)
             return parseStorePath(s);
         return {};
@@ -1010,6 +1213,17 @@ void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, Subst
 }
 
 
+/* Flush the file system containing the store to disk. */
+void LocalStore::syncStore()
+{
+#if __linux__
+    AutoCloseFD fd = open(realStoreDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd && syncfs(fd.get()) == 0) return;
+#endif
+    sync();
+}
+
+
 void LocalStore::registerValidPath(const ValidPathInfo & info)
 {
     registerValidPaths({{info.path, info}});
@@ -1022,37 +1236,98 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
        registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+    if (settings.syncBeforeRegistering) syncStore();
+
+    PendingRegistration pending{infos};
+
+    _groupCommit.lock()->queue.push_back(&pending);
+
+    while (true) {
+        std::vector<PendingRegistration *> batch;
+
+        {
+            auto groupCommit(_groupCommit.lock());
+            while (!pending.done && groupCommit->committing)
+                groupCommit.wait(groupCommitDone);
+            if (pending.done) break;
+
+            /* We're the leader: commit everything that is queued. */
+            batch = std::move(groupCommit->queue);
+            groupCommit->queue.clear();
+            groupCommit->committing = true;
+        }
+
+        /* If the batch fails, commit each registration on its own, so
+           that one caller's error (such as a reference cycle) doesn't
+           fail the others. */
+        try {
+            registerValidPaths_(batch);
+        } catch (...) {
+            if (batch.size() == 1)
+                batch[0]->exc = std::current_exception();
+            else
+                for (auto p : batch) {
+                    try {
+                        registerValidPaths_({p});
+                    } catch (...) {
+                        p->exc = std::current_exception();
+                    }
+                }
+        }
+
+        {
+            auto groupCommit(_groupCommit.lock());
+            for (auto p : batch) p->done = true;
+            groupCommit->committing = false;
+        }
+
+        groupCommitDone.notify_all();
+    }
+
+    if (pending.exc) std::rethrow_exception(pending.exc);
+}
+
+
+void LocalStore::registerValidPaths_(const std::vector<PendingRegistration *> & batch)
+{
+    if (batch.size() > 1)
+        debug("registering %d groups of valid paths in one transaction", batch.size());
+
+    /* Later registrations of the same path take precedence. */
+    std::map<StorePath, const ValidPathInfo *> infos;
+    for (auto p : batch)
+        for (auto & [path, info] : p->infos)
+            infos.insert_or_assign(path, &info);
 
     return retrySQLite<void>([&]() {
-        auto state(_state.lock());
+        auto state(lockState());
 
         SQLiteTxn txn(state->db);
         StorePathSet paths;
 
         for (auto & [_, i] : infos) {
-            assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
-                updatePathInfo(*state, i);
+            assert(i->narHash.type == htSHA256);
+            if (isValidPath_(*state->stmts, i->path))
+                updatePathInfo(*state, *i);
             else
-                addValidPath(*state, i, false);
-            paths.insert(i.path);
+                addValidPath(*state, *i, false);
+            paths.insert(i->path);
         }
 
         for (auto & [_, i] : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
-            for (auto & j : i.references)
-                state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+            auto referrer = queryValidPathId(*state->stmts, i->path);
+            for (auto & j : i->references)
+                state->stmts->AddReference.use()(referrer)(queryValidPathId(*state->stmts, j)).exec();
         }
 
         /* Check that the derivation outputs are correct.  We can't do
            this in addValidPath() above, because the references might
            not be valid yet. */
         for (auto & [_, i] : infos)
-            if (i.path.isDerivation()) {
+            if (i->path.isDerivation()) {
                 // FIXME: inefficient; we already loaded the derivation in addValidPath().
-                checkDerivationOutputs(i.path,
-                    readInvalidDerivation(i.path));
+                checkDerivationOutputs(i->path,
+                    readInvalidDerivation(i->path));
             }
 
         /* Do a topological sort of the paths.  This will throw an
@@ -1062,7 +1337,7 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         topoSort(paths,
             {[&](const StorePath & path) {
                 auto i = infos.find(path);
-                return i == infos.end() ? StorePathSet() : i->second.references;
+                return i == infos.end() ? StorePathSet() : i->second->references;
             }},
             {[&](const StorePath & path, const StorePath & parent) {
                 return BuildError(
@@ -1073,6 +1348,8 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 
         txn.commit();
     });
+
+    publishGenerations();
 }
 
 
@@ -1095,7 +1372,7 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
 
 const PublicKeys & LocalStore::getPublicKeys()
 {
-    auto state(_state.lock());
+    auto state(lockState());
     if (!state->publicKeys)
         state->publicKeys = std::make_unique<PublicKeys>(getDefaultPublicKeys());
     return *state->publicKeys;
@@ -1127,47 +1404,146 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
             outputLock.lockPaths({realPath});
 
         if (repair || !isValidPath(info.path)) {
+            restorePathFromNar(info, source);
+            registerValidPath(info);
+        }
 
-            deletePath(realPath);
+        outputLock.setDeletion(true);
+    }
+}
 
-            // text hashing has long been allowed to have non-self-references because it is used for drv files.
-            bool refersToSelf = info.references.count(info.path) > 0;
-            if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
-                settings.requireExperimentalFeature("ca-references");
 
-            /* While restoring the path from the NAR, compute the hash
-               of the NAR. */
-            std::unique_ptr<AbstractHashSink> hashSink;
-            if (!info.ca.has_value() || !info.references.count(info.path))
-                hashSink = std::make_unique<HashSink>(htSHA256);
-            else
-                hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
+void LocalStore::addMultipleToStore(PathsSource & paths,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    std::vector<std::pair<ValidPathInfo, std::unique_ptr<Source>> *> todo;
+    PathSet lockPaths;
+
+    for (auto & p : paths) {
+        auto & info = p.first;
+
+        if (checkSigs && pathInfoIsTrusted(info))
+            throw Error("cannot add path '%s' because it lacks a valid signature", printStorePath(info.path));
+
+        addTempRoot(info.path);
 
-            TeeSource wrapperSource { source, *hashSink };
+        if (repair || !isValidPath(info.path)) {
+            todo.push_back(&p);
+            if (!locksHeld.count(printStorePath(info.path)))
+                lockPaths.insert(Store::toRealPath(info.path));
+        }
+    }
 
-            restorePath(realPath, wrapperSource);
+    if (todo.empty()) return;
 
-            auto hashResult = hashSink->finish();
+    PathLocks outputLocks(lockPaths);
 
-            if (hashResult.first != info.narHash)
-                throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
-                    printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
+    /* Unpacking is mostly waiting for the file system, so do it in
+       parallel. Another process may have added some of the paths
+       while we were waiting for the locks. */
+    Sync<ValidPathInfos> infos_;
 
-            if (hashResult.second != info.narSize)
-                throw Error("size mismatch importing path '%s';\n  specified: %s\n  got:       %s",
-                    printStorePath(info.path), info.narSize, hashResult.second);
+    ThreadPool pool;
 
-            autoGC();
+    for (auto p : todo)
+        pool.enqueue([&, p]() {
+            auto & [info, source] = *p;
+            if (!repair && isValidPath(info.path)) return;
+            restorePathFromNar(info, *source);
+            infos_.lock()->insert_or_assign(info.path, info);
+        });
 
-            canonicalisePathMetaData(realPath, -1);
+    pool.process();
+
+    auto infos(infos_.lock());
+    if (!infos->empty()) {
+        debug("registering %d imported paths", infos->size());
+        registerValidPaths(*infos);
+    }
+
+    outputLocks.setDeletion(true);
+}
+
+
+bool LocalStore::addToStoreFromLocalPath(const ValidPathInfo & info, const Path & srcPath,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    if (checkSigs && pathInfoIsTrusted(info))
+        throw Error("cannot add path '%s' because it lacks a valid signature", printStorePath(info.path));
+
+    addTempRoot(info.path);
+
+    if (repair || !isValidPath(info.path)) {
+
+        PathLocks outputLock;
 
-            optimisePath(realPath); // FIXME: combine with hashPath()
+        auto realPath = Store::toRealPath(info.path);
+
+        if (!locksHeld.count(printStorePath(info.path)))
+            outputLock.lockPaths({realPath});
 
+        if (repair || !isValidPath(info.path)) {
+            /* The NAR hash is checked by serialising the copy, which
+               only reads the (possibly shared) data. */
+            restorePathChecked(info, [&](const Path & realPath, Sink & narSink) {
+                copyPath(srcPath, realPath);
+                dumpPath(realPath, narSink);
+            });
             registerValidPath(info);
         }
 
         outputLock.setDeletion(true);
     }
+
+    return true;
+}
+
+
+void LocalStore::restorePathFromNar(const ValidPathInfo & info, Source & source)
+{
+    restorePathChecked(info, [&](const Path & realPath, Sink & narSink) {
+        TeeSource wrapperSource { source, narSink };
+        restorePath(realPath, wrapperSource);
+    });
+}
+
+
+void LocalStore::restorePathChecked(const ValidPathInfo & info,
+    std::function<void(const Path & realPath, Sink & narSink)> restore)
+{
+    auto realPath = Store::toRealPath(info.path);
+
+    deletePath(realPath);
+
+    // text hashing has long been allowed to have non-self-references because it is used for drv files.
+    bool refersToSelf = info.references.count(info.path) > 0;
+    if (info.ca.has_value() && !info.references.empty() && !(std::holds_alternative<TextHash>(*info.ca) && !refersToSelf))
+        settings.requireExperimentalFeature("ca-references");
+
+    /* While restoring the path, compute the hash of the NAR. */
+    std::unique_ptr<AbstractHashSink> hashSink;
+    if (!info.ca.has_value() || !info.references.count(info.path))
+        hashSink = std::make_unique<HashSink>(htSHA256);
+    else
+        hashSink = std::make_unique<HashModuloSink>(htSHA256, std::string(info.path.hashPart()));
+
+    restore(realPath, *hashSink);
+
+    auto hashResult = hashSink->finish();
+
+    if (hashResult.first != info.narHash)
+        throw Error("hash mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+            printStorePath(info.path), info.narHash.to_string(Base32, true), hashResult.first.to_string(Base32, true));
+
+    if (hashResult.second != info.narSize)
+        throw Error("size mismatch importing path '%s';\n  specified: %s\n  got:       %s",
+            printStorePath(info.path), info.narSize, hashResult.second);
+
+    autoGC();
+
+    canonicalisePathMetaData(realPath, -1);
+
+    optimisePath(realPath); // FIXME: combine with hashPath()
 }
 
 
@@ -1346,24 +1722,29 @@ Path LocalStore::createTempDirInStore()
 }
 
 
-void LocalStore::invalidatePathChecked(const StorePath & path)
+bool LocalStore::invalidatePathChecked(const StorePath & path)
 {
-    retrySQLite<void>([&]() {
-        auto state(_state.lock());
+    auto invalidated = retrySQLite<bool>([&]() {
+        auto state(lockState());
 
         SQLiteTxn txn(state->db);
 
-        if (isValidPath_(*state, path)) {
-            StorePathSet referrers; queryReferrers(*state, path, referrers);
-            referrers.erase(path); /* ignore self-references */
-            if (!referrers.empty())
-                throw PathInUse("cannot delete path '%s' because it is in use by %s",
-                    printStorePath(path), showPaths(referrers));
-            invalidatePath(*state, path);
-        }
+        if (!isValidPath_(*state->stmts, path)) return false;
+
+        StorePathSet referrers; queryReferrers(*state->stmts, path, referrers);
+        referrers.erase(path); /* ignore self-references */
+        if (!referrers.empty())
+            throw PathInUse("cannot delete path '%s' because it is in use by %s",
+                printStorePath(path), showPaths(referrers));
+        invalidatePath(*state, path);
 
         txn.commit();
+        return true;
     });
+
+    if (invalidated) publishGenerations();
+
+    return invalidated;
 }
 
 
@@ -1457,8 +1838,11 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                     }
 
                     if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
+                        {
+                            auto state(lockState());
+                            updatePathInfo(*state, *info);
+                        }
+                        publishGenerations();
                     }
 
                 }
@@ -1507,8 +1891,11 @@ void LocalStore::verifyPath(const Path & pathS, const StringSet & store,
 
         if (canInvalidate) {
             printInfo("path '%s' disappeared, removing from database...", pathS);
-            auto state(_state.lock());
-            invalidatePath(*state, path);
+            {
+                auto state(lockState());
+                invalidatePath(*state, path);
+            }
+            publishGenerations();
         } else {
             printError("path '%s' disappeared, but it still has valid referrers!", pathS);
             if (repair)
@@ -1588,7 +1975,7 @@ void LocalStore::upgradeStore7()
 
 void LocalStore::vacuumDB()
 {
-    auto state(_state.lock());
+    auto state(lockState());
     state->db.exec("vacuum");
 }
 
@@ -1596,11 +1983,11 @@ void LocalStore::vacuumDB()
 void LocalStore::addSignatures(const StorePath & storePath, const StringSet & sigs)
 {
     retrySQLite<void>([&]() {
-        auto state(_state.lock());
+        auto state(lockState());
 
         SQLiteTxn txn(state->db);
 
-        auto info = std::const_pointer_cast<ValidPathInfo>(queryPathInfoInternal(*state, storePath));
+        auto info = std::const_pointer_cast<ValidPathInfo>(queryPathInfoInternal(*state->stmts, storePath));
 
         info->sigs.insert(sigs.begin(), sigs.end());
 
@@ -1608,6 +1995,8 @@ void LocalStore::addSignatures(const StorePath & storePath, const StringSet & si
 
         txn.commit();
     });
+
+    publishGenerations();
 }
 
 
@@ -1642,7 +2031,7 @@ std::optional<const Realisation> LocalStore::queryRealisation(
     const DrvOutput& id) {
     typedef std::optional<const Realisation> Ret;
     return retrySQLite<Ret>([&]() -> Ret {
-        auto state(_state.lock());
+        auto state(lockState());
         auto use(state->stmts->QueryRealisedOutput.use()(id.strHash())(
             id.outputName));
         if (!use.next())
@@ -6,6 +6,8 @@
 #include "store-api.hh"
 #include "local-fs-store.hh"
 #include "sync.hh"
+#include "pool.hh"
+#include "path-info-snapshot.hh"
 #include "util.hh"
 
 #include <chrono>
@@ -20,8 +22,10 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. */
-const int nixSchemaVersion = 10;
+   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. Version 11
+   stores NAR hashes as raw digests. Version 12 counts changes to
+   ValidPaths in the Generations table. */
+const int nixSchemaVersion = 12;
 
 
 struct OptimiseStats
@@ -31,6 +35,9 @@ struct OptimiseStats
     uint64_t blocksFreed = 0;
 };
 
+struct IncrementalGCState;
+
+
 struct LocalStoreConfig : virtual LocalFSStoreConfig
 {
     using LocalFSStoreConfig::LocalFSStoreConfig;
@@ -39,6 +46,9 @@ struct LocalStoreConfig : virtual LocalFSStoreConfig
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<bool> pathInfoSnapshot{(StoreConfig*) this, false, "path-info-snapshot",
+        "whether to answer path info queries from a memory-mapped snapshot of the database, which is rebuilt when it becomes stale"};
+
     const std::string name() override { return "Local Store"; }
 };
 
@@ -50,6 +60,10 @@ private:
     /* Lock file used for upgrading. */
     AutoCloseFD globalLock;
 
+    /* Precompiled statements for queries that don't modify the
+       database. */
+    struct ReadStmts;
+
     struct State
     {
         /* The SQLite database object. */
@@ -58,9 +72,6 @@ private:
         struct Stmts;
         std::unique_ptr<Stmts> stmts;
 
-        /* The file to which we write our temporary roots. */
-        AutoCloseFD fdTempRoots;
-
         /* The last time we checked whether to do an auto-GC, or an
            auto-GC finished. */
         std::chrono::time_point<std::chrono::steady_clock> lastGCCheck;
@@ -81,6 +92,89 @@ private:
 
     Sync<State> _state;
 
+    /* Queries outside of write transactions use a pool of read-only
+       connections, so that concurrent readers don't contend on
+       '_state' (with WAL, they don't block the writer either). */
+    struct ReadConnection
+    {
+        SQLite db;
+        std::unique_ptr<ReadStmts> stmts;
+        ~ReadConnection();
+    };
+
+    Pool<ReadConnection> readPool;
+
+    ref<ReadConnection> openReadConnection();
+
+    Pool<ReadConnection>::Handle getReadConnection();
+
+    /* Lock '_state', accounting the time spent waiting in the store
+       statistics. */
+    Sync<State>::Lock lockState() { return _state.lock(stats.dbLockWaitTimeUs); }
+
+    struct TempRoots
+    {
+        /* The file to which we write our temporary roots. */
+        AutoCloseFD fd;
+
+        /* The temporary roots registered by this process. */
+        StorePathSet paths;
+    };
+
+    Sync<TempRoots> _tempRoots;
+
+    /* Shared counters of committed changes to the database, used to
+       detect stale snapshots. Every LocalStore publishes them, whether
+       or not it uses a snapshot itself. */
+    StoreGenerations * generations = nullptr;
+
+    /* The snapshot of the database, if enabled. Accessed with
+       std::atomic_load() / std::atomic_store(). */
+    std::shared_ptr<PathInfoSnapshot> snapshot;
+
+    /* When we last tried to refresh a stale snapshot. */
+    std::atomic<time_t> lastSnapshotRefresh{0};
+
+    /* Return the snapshot if it reflects the current state of the
+       database. Path infos in the snapshot are current if no path
+       was invalidated since it was made; referrers additionally
+       require that no path was registered. Paths missing from a
+       current snapshot may still have been registered since. */
+    std::shared_ptr<PathInfoSnapshot> getSnapshot(bool needReferrers = false);
+
+    /* Map the snapshot, rebuilding it first if it is stale and no
+       other process is rebuilding it. */
+    void refreshSnapshot();
+
+    /* Read the committed counters from the database. */
+    PathInfoSnapshot::Generation queryGenerations();
+
+    /* Copy the counters in the database to 'generations'. Must be
+       called after committing a change to 'ValidPaths'. */
+    void publishGenerations();
+
+    /* Calls to registerValidPaths() from concurrent threads are
+       committed together in a single transaction ("group commit").
+       The first caller to find no commit in progress becomes the
+       leader and commits everything queued up to that point; the
+       others wait for it. */
+    struct PendingRegistration
+    {
+        const ValidPathInfos & infos;
+        bool done = false;
+        std::exception_ptr exc;
+    };
+
+    struct GroupCommitState
+    {
+        std::vector<PendingRegistration *> queue;
+        bool committing = false;
+    };
+
+    Sync<GroupCommitState> _groupCommit;
+
+    std::condition_variable groupCommitDone;
+
 public:
 
     PathSetting realStoreDir_;
@@ -92,6 +186,7 @@ public:
     const Path schemaPath;
     const Path trashDir;
     const Path tempRootsDir;
+    const Path chrootTemplatesDir;
     const Path fnTempRoots;
 
 private:
@@ -141,6 +236,14 @@ public:
     void addToStore(const ValidPathInfo & info, Source & source,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    /* Unpack the paths in parallel, then flush them to disk and
+       register them in a single transaction. */
+    void addMultipleToStore(PathsSource & paths,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
+    bool addToStoreFromLocalPath(const ValidPathInfo & info, const Path & srcPath,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     StorePath addToStoreFromDump(Source & dump, const string & name,
         FileIngestionMethod method, HashType hashAlgo, RepairFlag repair) override;
 
@@ -214,22 +317,40 @@ private:
 
     void makeStoreWritable();
 
-    uint64_t queryValidPathId(State & state, const StorePath & path);
+    uint64_t queryValidPathId(ReadStmts & stmts, const StorePath & path);
 
     uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
     void invalidatePath(State & state, const StorePath & path);
 
-    /* Delete a path from the Nix store. */
-    void invalidatePathChecked(const StorePath & path);
+    /* Delete a path from the Nix store. Returns false if it wasn't
+       valid. */
+    bool invalidatePathChecked(const StorePath & path);
 
     void verifyPath(const Path & path, const StringSet & store,
         PathSet & done, StorePathSet & validPaths, RepairFlag repair, bool & errors);
 
-    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State & state, const StorePath & path);
+    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(ReadStmts & stmts, const StorePath & path);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
+    /* Register the paths of several registerValidPaths() calls in a
+       single transaction. */
+    void registerValidPaths_(const std::vector<PendingRegistration *> & batch);
+
+    /* Unpack the NAR in 'source' into the store location of
+       'info.path', check it against 'info' and canonicalise it. The
+       caller must hold the lock on the path and register it. */
+    void restorePathFromNar(const ValidPathInfo & info, Source & source);
+
+    /* Create the store location of 'info.path' by calling 'restore'
+       with the real path and a sink for the NAR serialisation of the
+       result, check the result against 'info' and canonicalise it. */
+    void restorePathChecked(const ValidPathInfo & info,
+        std::function<void(const Path & realPath, Sink & narSink)> restore);
+
+    void syncStore();
+
     void upgradeStore6();
     void upgradeStore7();
     PathSet queryValidPathsOld();
@@ -258,6 +379,15 @@ private:
 
     void removeUnusedLinks(const GCState & state);
 
+    /* Support for incremental garbage collection (see
+       'incremental-gc'). */
+    std::optional<StorePathSet> findGCCandidates(const GCState & state,
+        const IncrementalGCState & prev);
+
+    uint64_t queryLastValidPathId();
+
+    StorePathSet queryValidPathsSince(uint64_t id);
+
     Path createTempDirInStore();
 
     void checkDerivationOutputs(const StorePath & drvPath, const Derivation & drv);
@@ -269,8 +399,8 @@ private:
     void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
 
     // Internal versions that are not wrapped in retry_sqlite.
-    bool isValidPath_(State & state, const StorePath & path);
-    void queryReferrers(State & state, const StorePath & path, StorePathSet & referrers);
+    bool isValidPath_(ReadStmts & stmts, const StorePath & path);
+    void queryReferrers(ReadStmts & stmts, const StorePath & path, StorePathSet & referrers);
 
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
@@ -49,7 +49,7 @@ bool Machine::mandatoryMet(const std::set<string> & features) const {
         });
 }
 
-ref<Store> Machine::openStore() const {
+ref<Store> Machine::openStore(const std::map<std::string, std::string> & extraParams) const {
     Store::Params storeParams;
     if (hasPrefix(storeUri, "ssh://")) {
         storeParams["max-connections"] = "1";
@@ -57,6 +57,9 @@ ref<Store> Machine::openStore() const {
         if (sshKey != "")
             storeParams["ssh-key"] = sshKey;
     }
+    if (hasPrefix(storeUri, "ssh://") || hasPrefix(storeUri, "ssh-ng://"))
+        for (auto & [name, value] : extraParams)
+            storeParams[name] = value;
     {
         auto & fs = storeParams["system-features"];
         auto append = [&](auto feats) {
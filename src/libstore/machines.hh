@@ -31,7 +31,9 @@ struct Machine {
         decltype(mandatoryFeatures) mandatoryFeatures,
         decltype(sshPublicHostKey) sshPublicHostKey);
 
-    ref<Store> openStore() const;
+    /* Open a connection to the machine. `extraParams' are added to
+       the store parameters of SSH stores. */
+    ref<Store> openStore(const std::map<std::string, std::string> & extraParams = {}) const;
 };
 
 typedef std::vector<Machine> Machines;
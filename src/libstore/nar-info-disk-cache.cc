@@ -2,9 +2,12 @@
 #include "sync.hh"
 #include "sqlite.hh"
 #include "globals.hh"
+#include "pool.hh"
 
 #include <sqlite3.h>
 
+#include <thread>
+
 namespace nix {
 
 static const char * schema = R"sql(
@@ -60,25 +63,79 @@ public:
         int priority;
     };
 
+    /* The maximum number of entries written in one transaction. */
+    const size_t maxBatchSize = 1000;
+
+    /* How long to wait for more entries before writing a batch. */
+    const std::chrono::milliseconds batchDelay{100};
+
+    /* The connection used for writes. */
     struct State
     {
         SQLite db;
-        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache;
-        std::map<std::string, Cache> caches;
+        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, purgeCache;
     };
 
     Sync<State> _state;
 
+    /* The caches known to this process. This is separate from
+       '_state' so that lookups don't wait for the writer thread,
+       which holds '_state' for the duration of a batch. */
+    Sync<std::map<std::string, Cache>> _caches;
+
+    /* Lookups use a pool of read-only connections so that they don't
+       contend with each other or with the writer. */
+    struct ReadConnection
+    {
+        SQLite db;
+        SQLiteStmt queryNAR;
+    };
+
+    Path dbPath;
+
+    Pool<ReadConnection> readPool;
+
+    /* Results of lookups in binary caches are not written to the
+       database immediately, but queued and written in batches by a
+       background thread. A negative result is represented by a null
+       'info'. */
+    struct PendingNarInfo
+    {
+        std::shared_ptr<const ValidPathInfo> info;
+        time_t timestamp;
+    };
+
+    struct WriteQueue
+    {
+        /* Entries that haven't been written yet, and entries that are
+           being written by the current batch, keyed by cache ID and
+           hash part. */
+        std::map<std::pair<int, std::string>, PendingNarInfo> pending, writing;
+        bool quit = false;
+    };
+
+    Sync<WriteQueue> _writeQueue;
+
+    std::condition_variable writeQueueWakeup;
+
+    std::thread writerThread;
+
     NarInfoDiskCacheImpl()
+        : dbPath(getCacheDir() + "/nix/binary-cache-v6.sqlite")
+        , readPool(
+            std::max(1U, std::thread::hardware_concurrency()),
+            [this]() { return openReadConnection(); })
     {
         auto state(_state.lock());
 
-        Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite";
         createDirs(dirOf(dbPath));
 
         state->db = SQLite(dbPath);
 
-        state->db.isCache();
+        /* WAL mode allows lookups on the read connections to proceed
+           while a batch is being written. */
+        state->db.exec("pragma synchronous = off");
+        state->db.exec(fmt("pragma main.journal_mode = %s", settings.useSQLiteWAL ? "wal" : "truncate"));
 
         state->db.exec(schema);
 
@@ -95,9 +152,6 @@ public:
         state->insertMissingNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
-        state->queryNAR.create(state->db,
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
-
         /* Periodically purge expired entries from the database. */
         retrySQLite<void>([&]() {
             auto now = time(0);
@@ -122,13 +176,125 @@ public:
                     .use()(now).exec();
             }
         });
+
+        writerThread = std::thread([this]() { writerThreadMain(); });
     }
 
-    Cache & getCache(State & state, const std::string & uri)
+    ~NarInfoDiskCacheImpl()
     {
-        auto i = state.caches.find(uri);
-        if (i == state.caches.end()) abort();
-        return i->second;
+        stop();
+    }
+
+    /* Write the pending entries and stop the writer thread. Entries
+       added after this are still returned by lookups, but no longer
+       written to the database. */
+    void stop()
+    {
+        {
+            auto writeQueue(_writeQueue.lock());
+            writeQueue->quit = true;
+        }
+        writeQueueWakeup.notify_one();
+        if (writerThread.joinable())
+            writerThread.join();
+    }
+
+    ref<ReadConnection> openReadConnection()
+    {
+        auto conn = make_ref<ReadConnection>();
+        conn->db = SQLite(dbPath, false);
+        conn->db.exec("pragma query_only = 1");
+        conn->queryNAR.create(conn->db,
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+        return conn;
+    }
+
+    void writerThreadMain()
+    {
+        while (true) {
+            {
+                auto writeQueue(_writeQueue.lock());
+                while (writeQueue->pending.empty() && !writeQueue->quit)
+                    writeQueue.wait(writeQueueWakeup);
+                if (writeQueue->pending.empty()) return;
+
+                /* Give other threads a chance to add entries to this
+                   batch. */
+                if (!writeQueue->quit && writeQueue->pending.size() < maxBatchSize)
+                    writeQueue.wait_for(writeQueueWakeup, batchDelay);
+
+                writeQueue->writing = std::move(writeQueue->pending);
+                writeQueue->pending.clear();
+            }
+
+            try {
+                writeBatch();
+            } catch (...) {
+                ignoreException();
+            }
+
+            _writeQueue.lock()->writing.clear();
+        }
+    }
+
+    /* Write the entries in 'writing' in a single transaction. Only
+       the writer thread modifies 'writing', so it can be read without
+       holding the lock. */
+    void writeBatch()
+    {
+        auto & batch(_writeQueue.lock()->writing);
+
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            for (auto & [key, entry] : batch) {
+                auto & [cacheId, hashPart] = key;
+                auto & info = entry.info;
+
+                if (info) {
+
+                    auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+
+                    //assert(hashPart == storePathToHash(info->path));
+
+                    state->insertNAR.use()
+                        (cacheId)
+                        (hashPart)
+                        (std::string(info->path.name()))
+                        (narInfo ? narInfo->url : "", narInfo != 0)
+                        (narInfo ? narInfo->compression : "", narInfo != 0)
+                        (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
+                        (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                        (info->narHash.to_string(Base32, true))
+                        (info->narSize)
+                        (concatStringsSep(" ", info->shortRefs()))
+                        (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                        (concatStringsSep(" ", info->sigs))
+                        (renderContentAddress(info->ca))
+                        (entry.timestamp).exec();
+
+                } else {
+                    state->insertMissingNAR.use()
+                        (cacheId)
+                        (hashPart)
+                        (entry.timestamp).exec();
+                }
+            }
+
+            txn.commit();
+        });
+
+        debug("wrote %d entries to the NAR info disk cache", batch.size());
+    }
+
+    int getCacheId(const std::string & uri)
+    {
+        auto caches(_caches.lock());
+        auto i = caches->find(uri);
+        if (i == caches->end()) abort();
+        return i->second.id;
     }
 
     void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority) override
@@ -140,123 +306,168 @@ public:
 
             state->insertCache.use()(uri)(time(0))(storeDir)(wantMassQuery)(priority).exec();
             assert(sqlite3_changes(state->db) == 1);
-            state->caches[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority};
+            (*_caches.lock())[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority};
         });
     }
 
     std::optional<CacheInfo> cacheExists(const std::string & uri) override
     {
+        auto toCacheInfo = [](const Cache & cache) {
+            return CacheInfo {
+                .wantMassQuery = cache.wantMassQuery,
+                .priority = cache.priority
+            };
+        };
+
+        {
+            auto caches(_caches.lock());
+            auto i = caches->find(uri);
+            if (i != caches->end()) return toCacheInfo(i->second);
+        }
+
         return retrySQLite<std::optional<CacheInfo>>([&]() -> std::optional<CacheInfo> {
             auto state(_state.lock());
 
-            auto i = state->caches.find(uri);
-            if (i == state->caches.end()) {
-                auto queryCache(state->queryCache.use()(uri));
-                if (!queryCache.next())
-                    return std::nullopt;
-                state->caches.emplace(uri,
-                    Cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3)});
-            }
+            auto queryCache(state->queryCache.use()(uri));
+            if (!queryCache.next())
+                return std::nullopt;
 
-            auto & cache(getCache(*state, uri));
+            Cache cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3)};
+            _caches.lock()->insert_or_assign(uri, cache);
 
-            return CacheInfo {
-                .wantMassQuery = cache.wantMassQuery,
-                .priority = cache.priority
-            };
+            return toCacheInfo(cache);
         });
     }
 
-    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) override
+    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupPending(
+        const PendingNarInfo & entry)
     {
-        return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
-            [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
-            auto state(_state.lock());
+        if (!entry.info) return {oInvalid, 0};
+        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(entry.info);
+        return {oValid, std::make_shared<NarInfo>(narInfo ? *narInfo : NarInfo(*entry.info))};
+    }
+
+    std::pair<Outcome, std::shared_ptr<NarInfo>> queryNarInfo(
+        ReadConnection & conn, int cacheId, const std::string & hashPart, time_t now)
+    {
+        auto queryNAR(conn.queryNAR.use()
+            (cacheId)
+            (hashPart)
+            (now - settings.ttlNegativeNarInfoCache)
+            (now - settings.ttlPositiveNarInfoCache));
+
+        if (!queryNAR.next())
+            return {oUnknown, 0};
+
+        if (!queryNAR.getInt(0))
+            return {oInvalid, 0};
+
+        auto namePart = queryNAR.getStr(1);
+        auto narInfo = make_ref<NarInfo>(
+            StorePath(hashPart + "-" + namePart),
+            Hash::parseAnyPrefixed(queryNAR.getStr(6)));
+        narInfo->url = queryNAR.getStr(2);
+        narInfo->compression = queryNAR.getStr(3);
+        if (!queryNAR.isNull(4))
+            narInfo->fileHash = Hash::parseAnyPrefixed(queryNAR.getStr(4));
+        narInfo->fileSize = queryNAR.getInt(5);
+        narInfo->narSize = queryNAR.getInt(7);
+        for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
+            narInfo->references.insert(StorePath(r));
+        if (!queryNAR.isNull(9))
+            narInfo->deriver = StorePath(queryNAR.getStr(9));
+        for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
+
+        return {oValid, narInfo};
+    }
 
-            auto & cache(getCache(*state, uri));
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::vector<std::string> & hashParts) override
+    {
+        std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> res;
+
+        auto cacheId = getCacheId(uri);
+
+        /* Entries that haven't been written to the database yet take
+           precedence. */
+        std::vector<std::string> toQuery;
+        {
+            auto writeQueue(_writeQueue.lock());
+            for (auto & hashPart : hashParts) {
+                auto key = std::make_pair(cacheId, hashPart);
+                auto i = writeQueue->pending.find(key);
+                if (i == writeQueue->pending.end()) {
+                    i = writeQueue->writing.find(key);
+                    if (i == writeQueue->writing.end()) {
+                        toQuery.push_back(hashPart);
+                        continue;
+                    }
+                }
+                res.insert_or_assign(hashPart, lookupPending(i->second));
+            }
+        }
+
+        if (toQuery.empty()) return res;
 
+        auto conn(readPool.get());
+
+        retrySQLite<void>([&]() {
             auto now = time(0);
 
-            auto queryNAR(state->queryNAR.use()
-                (cache.id)
-                (hashPart)
-                (now - settings.ttlNegativeNarInfoCache)
-                (now - settings.ttlPositiveNarInfoCache));
-
-            if (!queryNAR.next())
-                return {oUnknown, 0};
-
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
-
-            auto namePart = queryNAR.getStr(1);
-            auto narInfo = make_ref<NarInfo>(
-                StorePath(hashPart + "-" + namePart),
-                Hash::parseAnyPrefixed(queryNAR.getStr(6)));
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash::parseAnyPrefixed(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(StorePath(r));
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = StorePath(queryNAR.getStr(9));
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = parseContentAddressOpt(queryNAR.getStr(11));
-
-            return {oValid, narInfo};
+            /* Use a single read transaction for the whole batch. */
+            SQLiteTxn txn(conn->db);
+
+            for (auto & hashPart : toQuery)
+                res.insert_or_assign(hashPart, queryNarInfo(*conn, cacheId, hashPart, now));
+
+            txn.commit();
         });
+
+        return res;
+    }
+
+    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
+        const std::string & uri, const std::string & hashPart) override
+    {
+        auto res = lookupNarInfos(uri, {hashPart});
+        auto i = res.find(hashPart);
+        assert(i != res.end());
+        return i->second;
     }
 
     void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
+        auto cacheId = getCacheId(uri);
 
-            auto & cache(getCache(*state, uri));
-
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
-
-                //assert(hashPart == storePathToHash(info->path));
-
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
-                    (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
-            }
-        });
+        bool notify;
+        {
+            auto writeQueue(_writeQueue.lock());
+            writeQueue->pending.insert_or_assign(std::make_pair(cacheId, hashPart),
+                PendingNarInfo { .info = info, .timestamp = time(0) });
+            notify = writeQueue->pending.size() == 1 || writeQueue->pending.size() >= maxBatchSize;
+        }
+
+        if (notify) writeQueueWakeup.notify_one();
     }
 };
 
+static Sync<std::shared_ptr<NarInfoDiskCacheImpl>> narInfoDiskCache;
+
 ref<NarInfoDiskCache> getNarInfoDiskCache()
 {
-    static ref<NarInfoDiskCache> cache = make_ref<NarInfoDiskCacheImpl>();
-    return cache;
+    auto cache(narInfoDiskCache.lock());
+    if (!*cache) *cache = std::make_shared<NarInfoDiskCacheImpl>();
+    return ref<NarInfoDiskCache>(*cache);
+}
+
+void shutdownNarInfoDiskCache()
+{
+    std::shared_ptr<NarInfoDiskCacheImpl> cache = *narInfoDiskCache.lock();
+    if (cache) cache->stop();
 }
 
 }
@@ -26,6 +26,14 @@ public:
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) = 0;
 
+    /* Look up many hash parts at once. The result contains an entry
+       for every element of 'hashParts'. */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::vector<std::string> & hashParts) = 0;
+
+    /* Note: the result of a lookup is written to the database
+       asynchronously, but is visible to subsequent lookups
+       immediately. */
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
@@ -35,4 +43,9 @@ public:
    multiple threads. */
 ref<NarInfoDiskCache> getNarInfoDiskCache();
 
+/* Write the entries that haven't been written to the database yet,
+   and stop the background thread that writes them. This must be
+   called before the program exits, since the thread may log. */
+void shutdownNarInfoDiskCache();
+
 }
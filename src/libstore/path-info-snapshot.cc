@@ -0,0 +1,374 @@
+#include "path-info-snapshot.hh"
+#include "store-api.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+static const char snapshotMagic[8] = {'N', 'I', 'X', 'S', 'N', 'A', 'P', '1'};
+
+struct PathInfoSnapshot::Header
+{
+    char magic[8];
+    uint64_t invalidations;
+    uint64_t registrations;
+    uint64_t nrPaths;
+    uint64_t nrRefs;
+    uint64_t stringsSize;
+};
+
+/* The strings of an entry (name, NAR hash, deriver, signatures and
+   content address) are stored consecutively in the string area
+   starting at 'strings'. */
+struct PathInfoSnapshot::Entry
+{
+    char hashPart[StorePath::HashLen];
+    uint64_t id;
+    uint64_t narSize;
+    int64_t registrationTime;
+    uint64_t strings;
+    uint64_t refsStart;
+    uint64_t referrersStart;
+    uint32_t refsCount;
+    uint32_t referrersCount;
+    uint32_t nameLen;
+    uint32_t narHashLen;
+    uint32_t deriverLen;
+    uint32_t sigsLen;
+    uint32_t caLen;
+    uint32_t ultimate;
+};
+
+
+Hash narHashFromBlob(const void * data, size_t size)
+{
+    for (auto type : {htSHA256, htSHA512, htSHA1, htMD5}) {
+        Hash hash(type);
+        if (hash.hashSize != size) continue;
+        memcpy(hash.hash, data, size);
+        return hash;
+    }
+    throw BadHash("NAR hash has invalid length %d", size);
+}
+
+
+StoreGenerations & openStoreGenerations(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (!fd) throw SysError("opening '%s'", path);
+
+    /* Extending the file fills it with zeroes, which are valid
+       initial values. */
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting '%s'", path);
+    if ((size_t) st.st_size < sizeof(StoreGenerations)
+        && ftruncate(fd.get(), sizeof(StoreGenerations)) == -1)
+        throw SysError("resizing '%s'", path);
+
+    auto p = mmap(nullptr, sizeof(StoreGenerations), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping '%s'", path);
+
+    return *(StoreGenerations *) p;
+}
+
+
+PathInfoSnapshot::~PathInfoSnapshot()
+{
+    if (data) munmap(data, size);
+}
+
+
+PathInfoSnapshot::Generation queryGenerations(SQLite & db)
+{
+    SQLiteStmt stmt(db, "select invalidations, registrations from Generations;");
+    auto use(stmt.use());
+    if (!use.next())
+        throw Error("the 'Generations' table of the Nix database is empty");
+    return {(uint64_t) use.getInt(0), (uint64_t) use.getInt(1)};
+}
+
+
+static void raise(std::atomic<uint64_t> & counter, uint64_t value)
+{
+    auto cur = counter.load();
+    while (cur < value && !counter.compare_exchange_weak(cur, value)) ;
+}
+
+
+void publishGenerations(StoreGenerations & generations, PathInfoSnapshot::Generation generation)
+{
+    raise(generations.invalidations, generation.invalidations);
+    raise(generations.registrations, generation.registrations);
+}
+
+
+PathInfoSnapshot::Generation PathInfoSnapshot::write(SQLite & db, const Store & store, const Path & path)
+{
+    Generation generation;
+    std::vector<Entry> entries;
+    std::string strings;
+    std::unordered_map<int64_t, uint32_t> indices;
+    std::vector<std::pair<uint32_t, uint32_t>> refs;
+
+    {
+        SQLiteTxn txn(db);
+
+        generation = queryGenerations(db);
+
+        /* Since all paths have the same prefix, sorting them sorts
+           them by hash part. */
+        SQLiteStmt queryPaths(db,
+            "select id, path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths order by path;");
+        auto use(queryPaths.use());
+
+        while (use.next()) {
+            auto storePath = store.parseStorePath(use.getStr(1));
+
+            Entry e;
+            memset(&e, 0, sizeof(e));
+            memcpy(e.hashPart, storePath.hashPart().data(), StorePath::HashLen);
+            e.id = use.getInt(0);
+            e.registrationTime = use.getInt(3);
+            e.narSize = use.getInt(5);
+            e.ultimate = use.getInt(6) == 1;
+
+            auto add = [&](std::string_view s) {
+                strings.append(s);
+                return (uint32_t) s.size();
+            };
+
+            e.strings = strings.size();
+            e.nameLen = add(storePath.name());
+            if (sqlite3_column_type(queryPaths, 2) == SQLITE_BLOB)
+                e.narHashLen = add(std::string_view(
+                    (const char *) sqlite3_column_blob(queryPaths, 2),
+                    sqlite3_column_bytes(queryPaths, 2)));
+            else {
+                auto narHash = Hash::parseAnyPrefixed(use.getStr(2));
+                e.narHashLen = add(std::string_view((const char *) narHash.hash, narHash.hashSize));
+            }
+            if (!use.isNull(4)) e.deriverLen = add(use.getStr(4));
+            if (!use.isNull(7)) e.sigsLen = add(use.getStr(7));
+            if (!use.isNull(8)) e.caLen = add(use.getStr(8));
+
+            indices.emplace(e.id, entries.size());
+            entries.push_back(e);
+        }
+
+        SQLiteStmt queryRefs(db, "select referrer, reference from Refs;");
+        auto use2(queryRefs.use());
+
+        while (use2.next()) {
+            auto i = indices.find(use2.getInt(0));
+            auto j = indices.find(use2.getInt(1));
+            if (i != indices.end() && j != indices.end())
+                refs.emplace_back(i->second, j->second);
+        }
+    }
+
+    std::vector<uint32_t> references, referrers;
+    references.reserve(refs.size());
+    referrers.reserve(refs.size());
+
+    std::sort(refs.begin(), refs.end());
+    for (auto & [from, to] : refs) {
+        auto & e = entries[from];
+        if (!e.refsCount++) e.refsStart = references.size();
+        references.push_back(to);
+    }
+
+    std::sort(refs.begin(), refs.end(), [](auto & a, auto & b) {
+        return std::tie(a.second, a.first) < std::tie(b.second, b.first);
+    });
+    for (auto & [from, to] : refs) {
+        auto & e = entries[to];
+        if (!e.referrersCount++) e.referrersStart = referrers.size();
+        referrers.push_back(from);
+    }
+
+    Header header;
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.invalidations = generation.invalidations;
+    header.registrations = generation.registrations;
+    header.nrPaths = entries.size();
+    header.nrRefs = refs.size();
+    header.stringsSize = strings.size();
+
+    /* Write to a temporary file and rename it, so that readers
+       never see a partial snapshot. */
+    Path tmpPath = fmt("%s.tmp-%d", path, getpid());
+    AutoCloseFD fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (!fd) throw SysError("creating '%s'", tmpPath);
+
+    try {
+        writeFull(fd.get(), {(const char *) &header, sizeof(header)});
+        writeFull(fd.get(), {(const char *) entries.data(), entries.size() * sizeof(Entry)});
+        writeFull(fd.get(), {(const char *) references.data(), references.size() * sizeof(uint32_t)});
+        writeFull(fd.get(), {(const char *) referrers.data(), referrers.size() * sizeof(uint32_t)});
+        writeFull(fd.get(), strings);
+        fd = -1;
+
+        if (rename(tmpPath.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, path);
+    } catch (...) {
+        unlink(tmpPath.c_str());
+        throw;
+    }
+
+    return generation;
+}
+
+
+std::shared_ptr<PathInfoSnapshot> PathInfoSnapshot::open(const Path & path)
+{
+    AutoCloseFD fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno == ENOENT) return nullptr;
+        throw SysError("opening '%s'", path);
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting '%s'", path);
+    if ((size_t) st.st_size < sizeof(Header)) return nullptr;
+
+    auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping '%s'", path);
+
+    std::shared_ptr<PathInfoSnapshot> snapshot(new PathInfoSnapshot);
+    snapshot->data = p;
+    snapshot->size = st.st_size;
+
+    auto & h = snapshot->header();
+    if (memcmp(h.magic, snapshotMagic, sizeof(snapshotMagic)) != 0
+        || sizeof(Header) + h.nrPaths * sizeof(Entry) + 2 * h.nrRefs * sizeof(uint32_t) + h.stringsSize != snapshot->size)
+        return nullptr;
+
+    return snapshot;
+}
+
+
+const PathInfoSnapshot::Header & PathInfoSnapshot::header() const
+{
+    return *(const Header *) data;
+}
+
+
+const PathInfoSnapshot::Entry * PathInfoSnapshot::entries() const
+{
+    return (const Entry *) ((const char *) data + sizeof(Header));
+}
+
+
+const uint32_t * PathInfoSnapshot::references() const
+{
+    return (const uint32_t *) (entries() + header().nrPaths);
+}
+
+
+const uint32_t * PathInfoSnapshot::referrers() const
+{
+    return references() + header().nrRefs;
+}
+
+
+const char * PathInfoSnapshot::strings() const
+{
+    return (const char *) (referrers() + header().nrRefs);
+}
+
+
+PathInfoSnapshot::Generation PathInfoSnapshot::generation() const
+{
+    return {header().invalidations, header().registrations};
+}
+
+
+std::string_view PathInfoSnapshot::getString(uint64_t offset, uint32_t len) const
+{
+    return {strings() + offset, len};
+}
+
+
+StorePath PathInfoSnapshot::getPath(uint32_t index) const
+{
+    auto & e = entries()[index];
+    return StorePath(
+        std::string(e.hashPart, StorePath::HashLen)
+        + "-"
+        + std::string(getString(e.strings, e.nameLen)));
+}
+
+
+const PathInfoSnapshot::Entry * PathInfoSnapshot::find(const StorePath & path) const
+{
+    auto begin = entries(), end = begin + header().nrPaths;
+    auto hashPart = path.hashPart();
+
+    auto i = std::lower_bound(begin, end, hashPart, [](const Entry & e, std::string_view hashPart) {
+        return memcmp(e.hashPart, hashPart.data(), StorePath::HashLen) < 0;
+    });
+
+    if (i == end
+        || memcmp(i->hashPart, hashPart.data(), StorePath::HashLen) != 0
+        || getString(i->strings, i->nameLen) != path.name())
+        return nullptr;
+
+    return i;
+}
+
+
+std::shared_ptr<const ValidPathInfo> PathInfoSnapshot::lookup(const Store & store, const StorePath & path) const
+{
+    auto e = find(path);
+    if (!e) return nullptr;
+
+    auto offset = e->strings + e->nameLen;
+    auto next = [&](uint32_t len) {
+        auto s = getString(offset, len);
+        offset += len;
+        return s;
+    };
+
+    auto narHash = next(e->narHashLen);
+    auto info = std::make_shared<ValidPathInfo>(path, narHashFromBlob(narHash.data(), narHash.size()));
+
+    info->id = e->id;
+    info->registrationTime = e->registrationTime;
+    info->narSize = e->narSize;
+    info->ultimate = e->ultimate;
+
+    if (e->deriverLen) info->deriver = store.parseStorePath(next(e->deriverLen));
+    if (e->sigsLen) info->sigs = tokenizeString<StringSet>(next(e->sigsLen), " ");
+    if (e->caLen) info->ca = parseContentAddressOpt(next(e->caLen));
+
+    for (uint64_t i = 0; i < e->refsCount; ++i)
+        info->references.insert(getPath(references()[e->refsStart + i]));
+
+    return info;
+}
+
+
+std::optional<StorePathSet> PathInfoSnapshot::queryReferrers(const StorePath & path) const
+{
+    auto e = find(path);
+    if (!e) return std::nullopt;
+
+    StorePathSet res;
+    for (uint64_t i = 0; i < e->referrersCount; ++i)
+        res.insert(getPath(referrers()[e->referrersStart + i]));
+    return res;
+}
+
+}
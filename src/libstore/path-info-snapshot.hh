@@ -0,0 +1,100 @@
+#pragma once
+
+#include "path-info.hh"
+#include "sqlite.hh"
+
+#include <atomic>
+
+namespace nix {
+
+/* A copy of the counters in the 'Generations' table, which triggers
+   increment in the same transaction as every change to 'ValidPaths'.
+   LocalStore publishes them here after committing, so they never run
+   ahead of what readers can see in the database. They live in a small
+   memory-mapped file shared by all processes using the store, so a
+   snapshot can be checked for staleness without a database query. */
+struct StoreGenerations
+{
+    /* Paths were invalidated or their info changed. */
+    std::atomic<uint64_t> invalidations{0};
+
+    /* Paths were registered (which may add referrers to existing
+       paths). */
+    std::atomic<uint64_t> registrations{0};
+
+    /* Odd while the garbage collector holds the temporary roots, see
+       LocalStore::addTempRoot(). */
+    std::atomic<uint64_t> gcEpoch{0};
+};
+
+/* Map the counters in 'path', creating it if necessary. The mapping
+   is never unmapped. */
+StoreGenerations & openStoreGenerations(const Path & path);
+
+/* An immutable, memory-mapped copy of the 'ValidPaths' and 'Refs'
+   tables. Paths are sorted by hash part; references and referrers
+   are stored as arrays of path indices (compressed sparse rows). */
+class PathInfoSnapshot
+{
+public:
+
+    struct Generation
+    {
+        uint64_t invalidations = 0, registrations = 0;
+    };
+
+    ~PathInfoSnapshot();
+
+    /* Write a snapshot of the database 'db' to 'path', replacing it
+       atomically. Returns the generation of the database it was made
+       from, which is read in the same transaction as the paths. */
+    static Generation write(SQLite & db, const Store & store, const Path & path);
+
+    /* Map the snapshot at 'path'. Returns null if it doesn't exist or
+       is in an unsupported format. */
+    static std::shared_ptr<PathInfoSnapshot> open(const Path & path);
+
+    Generation generation() const;
+
+    /* Return the info for 'path' from the snapshot, or null if it
+       isn't in it. */
+    std::shared_ptr<const ValidPathInfo> lookup(const Store & store, const StorePath & path) const;
+
+    bool contains(const StorePath & path) const { return find(path); }
+
+    /* Return the referrers of 'path', if it's in the snapshot. */
+    std::optional<StorePathSet> queryReferrers(const StorePath & path) const;
+
+private:
+
+    struct Header;
+    struct Entry;
+
+    void * data = nullptr;
+    size_t size = 0;
+
+    const Header & header() const;
+    const Entry * entries() const;
+    const uint32_t * references() const;
+    const uint32_t * referrers() const;
+    const char * strings() const;
+
+    std::string_view getString(uint64_t offset, uint32_t len) const;
+    StorePath getPath(uint32_t index) const;
+    const Entry * find(const StorePath & path) const;
+
+    PathInfoSnapshot() { }
+};
+
+/* Read the counters from the 'Generations' table. */
+PathInfoSnapshot::Generation queryGenerations(SQLite & db);
+
+/* Raise the published counters to 'generation', which must have been
+   committed. Counters that are already higher are left alone. */
+void publishGenerations(StoreGenerations & generations, PathInfoSnapshot::Generation generation);
+
+/* Convert a raw NAR hash digest as stored in the database to a
+   Hash. The hash type is implied by the length of the digest. */
+Hash narHashFromBlob(const void * data, size_t size);
+
+}
@@ -1,6 +1,8 @@
 #include "pathlocks.hh"
 #include "util.hh"
 #include "sync.hh"
+#include "globals.hh"
+#include "hash.hh"
 
 #include <cerrno>
 #include <cstdlib>
@@ -85,6 +87,12 @@ bool PathLocks::lockPaths(const PathSet & paths,
     const string & waitMsg, bool wait)
 {
     assert(fds.empty());
+    assert(tables.empty());
+
+#ifdef F_OFD_SETLK
+    if (settings.pathLockTable)
+        return lockTablePaths(paths, waitMsg, wait);
+#endif
 
     /* Note that `fds' is built incrementally so that the destructor
        will only release those locks that we have already acquired. */
@@ -143,6 +151,75 @@ bool PathLocks::lockPaths(const PathSet & paths,
 }
 
 
+#ifdef F_OFD_SETLK
+
+/* Return the offset of the lock of 'path' in the lock table of its
+   parent directory. Locks are one byte each, so collisions are as
+   unlikely as for any other 62-bit hash. */
+static off_t lockTableOffset(const Path & path)
+{
+    auto hash = hashString(htSHA256, path);
+    uint64_t n;
+    memcpy(&n, hash.hash, sizeof(n));
+    return n & (((uint64_t) 1 << 62) - 1);
+}
+
+
+static bool lockTableEntry(int fd, off_t offset, bool wait)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = 1;
+
+    while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == -1) {
+        checkInterrupt();
+        if (!wait && (errno == EAGAIN || errno == EACCES)) return false;
+        if (errno != EINTR)
+            throw SysError("acquiring lock");
+    }
+
+    return true;
+}
+
+
+bool PathLocks::lockTablePaths(const PathSet & paths,
+    const string & waitMsg, bool wait)
+{
+    /* Acquire the locks in order of table and offset, which (like the
+       order of paths for lock files) prevents deadlocks. */
+    std::set<std::pair<Path, off_t>> locks;
+    for (auto & path : paths)
+        locks.emplace(dirOf(path), lockTableOffset(path));
+
+    for (auto & [dir, offset] : locks) {
+        checkInterrupt();
+
+        auto & fd = tables[dir];
+        if (!fd) fd = openLockFile(dir + "/" + pathLockTableName, true);
+
+        if (!lockTableEntry(fd.get(), offset, false)) {
+            if (wait) {
+                if (waitMsg != "") printError(waitMsg);
+                lockTableEntry(fd.get(), offset, true);
+            } else {
+                unlock();
+                return false;
+            }
+        }
+    }
+
+    for (auto & path : paths)
+        debug("lock acquired on '%s'", path);
+
+    return true;
+}
+
+#endif
+
+
 PathLocks::~PathLocks()
 {
     try {
@@ -167,6 +244,8 @@ void PathLocks::unlock()
     }
 
     fds.clear();
+
+    tables.clear();
 }
 
 
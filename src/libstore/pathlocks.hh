@@ -16,6 +16,10 @@ enum LockType { ltRead, ltWrite, ltNone };
 
 bool lockFile(int fd, LockType lockType, bool wait);
 
+/* The name of the file in which the locks of the paths in a directory
+   are kept if 'path-lock-table' is enabled. */
+const std::string pathLockTableName = ".path-locks";
+
 class PathLocks
 {
 private:
@@ -23,6 +27,13 @@ private:
     list<FDPair> fds;
     bool deletePaths;
 
+    /* The lock tables in which we hold locks. Closing a table
+       releases our locks in it. */
+    std::map<Path, AutoCloseFD> tables;
+
+    bool lockTablePaths(const PathSet & paths,
+        const string & waitMsg, bool wait);
+
 public:
     PathLocks();
     PathLocks(const PathSet & paths,
@@ -1,5 +1,6 @@
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
 #include "json.hh"
 
 #include <sys/types.h>
@@ -95,6 +96,16 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
         } catch (SysError &) { }
     }
 
+    /* If the binary cache can serve parts of the NAR, avoid fetching
+       the whole thing. */
+    if (auto binaryCacheStore = store.dynamic_pointer_cast<BinaryCacheStore>()) {
+        if (auto seekableAccessor = binaryCacheStore->getSeekableNarAccessor(storePath)) {
+            auto narAccessor = ref<FSAccessor>(seekableAccessor);
+            nars.emplace(storePath.hashPart(), narAccessor);
+            return {narAccessor, restPath};
+        }
+    }
+
     store->narFromPath(storePath, sink);
     auto narAccessor = makeNarAccessor(sink.s);
     addToCache(storePath.hashPart(), *sink.s, narAccessor);
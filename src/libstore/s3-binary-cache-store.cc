@@ -24,6 +24,9 @@
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/transfer/TransferManager.h>
 
+#include <deque>
+#include <future>
+
 using namespace Aws::Transfer;
 
 namespace nix {
@@ -140,7 +143,8 @@ ref<Aws::Client::ClientConfiguration> S3Helper::makeConfig(const string & region
 }
 
 S3Helper::FileTransferResult S3Helper::getObject(
-    const std::string & bucketName, const std::string & key)
+    const std::string & bucketName, const std::string & key,
+    std::optional<std::pair<uint64_t, uint64_t>> range)
 {
     debug("fetching 's3://%s/%s'...", bucketName, key);
 
@@ -149,6 +153,11 @@ S3Helper::FileTransferResult S3Helper::getObject(
         .WithBucket(bucketName)
         .WithKey(key);
 
+    if (range) {
+        assert(range->second > 0);
+        request.SetRange(fmt("bytes=%d-%d", range->first, range->first + range->second - 1));
+    }
+
     request.SetResponseStreamFactory([&]() {
         return Aws::New<std::stringstream>("STRINGSTREAM");
     });
@@ -195,7 +204,13 @@ struct S3BinaryCacheStoreConfig : virtual BinaryCacheStoreConfig
     const Setting<bool> multipartUpload{
         (StoreConfig*) this, false, "multipart-upload", "whether to use multi-part uploads"};
     const Setting<uint64_t> bufferSize{
-        (StoreConfig*) this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
+        (StoreConfig*) this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads and downloads"};
+    const Setting<bool> multipartDownload{
+        (StoreConfig*) this, false, "multipart-download",
+        "whether to download files larger than 'buffer-size' using parallel ranged requests"};
+    const Setting<unsigned int> multipartConcurrency{
+        (StoreConfig*) this, 4, "multipart-concurrency",
+        "number of parts of a multi-part upload or download to transfer in parallel"};
 
     const std::string name() override { return "S3 Binary Cache Store"; }
 };
@@ -281,6 +296,7 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
         return true;
     }
 
+    std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor> executor;
     std::shared_ptr<TransferManager> transferManager;
     std::once_flag transferManagerCreated;
 
@@ -293,18 +309,20 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
         auto size = istream->tellg();
         istream->seekg(0, istream->beg);
 
-        auto maxThreads = std::thread::hardware_concurrency();
-
-        static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
-            executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
-
         std::call_once(transferManagerCreated, [&]()
         {
             if (multipartUpload) {
+                auto concurrency = std::max(1U, multipartConcurrency.get());
+
+                executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(concurrency);
+
                 TransferManagerConfiguration transferConfig(executor.get());
 
                 transferConfig.s3Client = s3Helper.client;
                 transferConfig.bufferSize = bufferSize;
+                /* The transfer manager uploads as many parts in
+                   parallel as fit in its buffer. */
+                transferConfig.transferBufferMaxHeapSize = bufferSize * concurrency;
 
                 transferConfig.uploadProgressCallback =
                     [](const TransferManager *transferManager,
@@ -398,8 +416,92 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
             uploadFile(path, istream, mimeType, "");
     }
 
+    /* Download a file as a sequence of parts of 'buffer-size' bytes,
+       fetching up to 'multipart-concurrency' parts in parallel and
+       writing them to the sink in order. Return false if the file is
+       not suitable for a multi-part download. */
+    bool getFileMultipart(const std::string & path, Sink & sink)
+    {
+        stats.head++;
+
+        auto res = s3Helper.client->HeadObject(
+            Aws::S3::Model::HeadObjectRequest()
+            .WithBucket(bucketName)
+            .WithKey(path));
+
+        if (!res.IsSuccess()) return false;
+
+        uint64_t size = res.GetResult().GetContentLength();
+        uint64_t partSize = bufferSize;
+
+        /* Ranges of encoded files can't be decoded separately. */
+        if (size <= partSize || !res.GetResult().GetContentEncoding().empty())
+            return false;
+
+        uint64_t parts = (size + partSize - 1) / partSize;
+        uint64_t nextPart = 0;
+
+        auto now1 = std::chrono::steady_clock::now();
+
+        std::deque<std::future<S3Helper::FileTransferResult>> pending;
+
+        while (nextPart < parts || !pending.empty()) {
+            while (nextPart < parts && pending.size() < std::max(1U, multipartConcurrency.get())) {
+                auto offset = nextPart++ * partSize;
+                pending.push_back(std::async(std::launch::async, [this, path, offset, length{std::min(partSize, size - offset)}]() {
+                    return s3Helper.getObject(bucketName, path, std::make_pair(offset, length));
+                }));
+            }
+
+            auto part = pending.front().get();
+            pending.pop_front();
+
+            checkInterrupt();
+
+            if (!part.data)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+
+            stats.get++;
+            stats.getBytes += part.data->size();
+
+            sink(*part.data);
+        }
+
+        auto now2 = std::chrono::steady_clock::now();
+
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+
+        stats.getTimeMs += duration;
+
+        printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d parts in %d ms",
+            bucketName, path, size, parts, duration);
+
+        return true;
+    }
+
+    void getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length, Sink & sink) override
+    {
+        if (length == 0) return;
+
+        stats.get++;
+
+        auto res = s3Helper.getObject(bucketName, path, std::make_pair(offset, length));
+
+        stats.getBytes += res.data ? res.data->size() : 0;
+        stats.getTimeMs += res.durationMs;
+
+        if (!res.data)
+            throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+
+        sink(*res.data);
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
+        if (multipartDownload && getFileMultipart(path, sink))
+            return;
+
         stats.get++;
 
         // FIXME: stream output to sink.
@@ -4,6 +4,8 @@
 
 #include "ref.hh"
 
+#include <optional>
+
 namespace Aws { namespace Client { class ClientConfiguration; } }
 namespace Aws { namespace S3 { class S3Client; } }
 
@@ -24,8 +26,11 @@ struct S3Helper
         unsigned int durationMs;
     };
 
+    /* Fetch an object, or if 'range' is set, only the specified
+       byte range (offset and length) of it. */
     FileTransferResult getObject(
-        const std::string & bucketName, const std::string & key);
+        const std::string & bucketName, const std::string & key,
+        std::optional<std::pair<uint64_t, uint64_t>> range = {});
 };
 
 }
@@ -1,7 +1,7 @@
 create table if not exists ValidPaths (
     id               integer primary key autoincrement not null,
     path             text unique not null,
-    hash             text not null,
+    hash             blob not null, -- raw digest; the type follows from the length
     registrationTime integer not null,
     deriver          text,
     narSize          integer,
@@ -40,3 +40,29 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- Counters for detecting changes to ValidPaths (see
+-- PathInfoSnapshot). They're maintained by triggers so that they are
+-- incremented in the same transaction as the change itself.
+create table if not exists Generations (
+    id            integer primary key check (id = 0),
+    invalidations integer not null, -- paths deleted or their info changed
+    registrations integer not null  -- paths added
+);
+
+insert or ignore into Generations (id, invalidations, registrations) values (0, 0, 0);
+
+create trigger if not exists RegistrationGeneration after insert on ValidPaths
+  begin
+    update Generations set registrations = registrations + 1;
+  end;
+
+create trigger if not exists UpdateGeneration after update on ValidPaths
+  begin
+    update Generations set invalidations = invalidations + 1;
+  end;
+
+create trigger if not exists InvalidationGeneration after delete on ValidPaths
+  begin
+    update Generations set invalidations = invalidations + 1;
+  end;
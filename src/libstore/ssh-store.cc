@@ -14,6 +14,8 @@ struct SSHStoreConfig : virtual RemoteStoreConfig
 
     const Setting<Path> sshKey{(StoreConfig*) this, "", "ssh-key", "path to an SSH private key"};
     const Setting<bool> compress{(StoreConfig*) this, false, "compress", "whether to compress the connection"};
+    const Setting<Path> sshControlPath{(StoreConfig*) this, "", "ssh-control-path", "path of an SSH control socket for a master connection shared with other processes"};
+    const Setting<unsigned int> sshControlPersist{(StoreConfig*) this, 600, "ssh-control-persist", "number of seconds that a shared SSH master connection stays up after its last use"};
     const Setting<Path> remoteProgram{(StoreConfig*) this, "nix-daemon", "remote-program", "path to the nix-daemon executable on the remote system"};
     const Setting<std::string> remoteStore{(StoreConfig*) this, "", "remote-store", "URI of the store on the remote system"};
 
@@ -36,7 +38,10 @@ public:
             sshKey,
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
-            compress)
+            compress,
+            -1,
+            sshControlPath,
+            sshControlPersist)
     {
     }
 
@@ -1,14 +1,20 @@
 #include "ssh.hh"
+#include "pathlocks.hh"
+
+#include <fcntl.h>
 
 namespace nix {
 
-SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD)
+SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD,
+    const Path & controlPath, unsigned int controlPersist)
     : host(host)
     , fakeSSH(host == "localhost")
     , keyFile(keyFile)
-    , useMaster(useMaster && !fakeSSH)
+    , useMaster((useMaster || controlPath != "") && !fakeSSH)
     , compress(compress)
     , logFD(logFD)
+    , controlPath(controlPath)
+    , controlPersist(controlPersist)
 {
     if (host == "" || hasPrefix(host, "-"))
         throw Error("invalid SSH host name '%s'", host);
@@ -83,6 +89,8 @@ Path SSHMaster::startMaster()
 {
     if (!useMaster) return "";
 
+    if (controlPath != "") return startPersistentMaster();
+
     auto state(state_.lock());
 
     if (state->sshMaster != -1) return state->socketPath;
@@ -131,4 +139,60 @@ Path SSHMaster::startMaster()
     return state->socketPath;
 }
 
+bool SSHMaster::isPersistentMasterRunning()
+{
+    auto res = runProgram(RunOptions("ssh", {host, "-O", "check", "-S", controlPath}).killStderr(true));
+    return statusOk(res.first);
+}
+
+Path SSHMaster::startPersistentMaster()
+{
+    auto state(state_.lock());
+
+    if (state->socketPath != "") return state->socketPath;
+
+    /* Serialise the check for a running master with other
+       processes, so that only one of them starts a new one. */
+    AutoCloseFD lock = openLockFile(controlPath + ".lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    if (!isPersistentMasterRunning()) {
+        debug("starting persistent SSH master connection to '%s'", host);
+
+        deletePath(controlPath);
+
+        ProcessOptions options;
+        options.dieWithParent = false;
+
+        /* With -f, ssh forks into the background after
+           authenticating, and the foreground process exits. The
+           background process must not hold on to our stdout/stderr,
+           or readers of those would never see EOF. */
+        Pid pid = startProcess([&]() {
+            restoreSignals();
+
+            AutoCloseFD devNull = open("/dev/null", O_RDWR);
+            if (!devNull) throw SysError("cannot open /dev/null");
+            for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+                if (dup2(devNull.get(), fd) == -1)
+                    throw SysError("duping over fd %d", fd);
+
+            Strings args =
+                { "ssh", host.c_str(), "-f", "-M", "-N", "-S", controlPath
+                , "-o", fmt("ControlPersist=%d", controlPersist)
+                };
+            addCommonSSHOpts(args);
+            execvp(args.begin()->c_str(), stringsToCharPtrs(args).data());
+
+            throw SysError("unable to execute '%s'", args.front());
+        }, options);
+
+        if (!statusOk(pid.wait()))
+            throw Error("failed to start SSH master connection to '%s'", host);
+    }
+
+    state->socketPath = controlPath;
+    return state->socketPath;
+}
+
 }
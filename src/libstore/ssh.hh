@@ -16,6 +16,12 @@ private:
     const bool compress;
     const int logFD;
 
+    /* If set, the path of a control socket for a master connection
+       that is shared with other processes and that stays up for
+       `controlPersist' seconds after it was last used. */
+    const Path controlPath;
+    const unsigned int controlPersist;
+
     struct State
     {
         Pid sshMaster;
@@ -27,9 +33,16 @@ private:
 
     void addCommonSSHOpts(Strings & args);
 
+    /* Return whether a master connection is listening on
+       `controlPath'. */
+    bool isPersistentMasterRunning();
+
+    Path startPersistentMaster();
+
 public:
 
-    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1);
+    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1,
+        const Path & controlPath = "", unsigned int controlPersist = 0);
 
     struct Connection
     {
@@ -8,6 +8,7 @@
 #include "json.hh"
 #include "url.hh"
 #include "archive.hh"
+#include "local-fs-store.hh"
 #include "callback.hh"
 
 #include <regex>
@@ -256,6 +257,14 @@ StorePath Store::addToStore(const string & name, const Path & _srcPath,
 }
 
 
+void Store::addMultipleToStore(PathsSource & paths,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    for (auto & [info, source] : paths)
+        addToStore(info, *source, repair, checkSigs);
+}
+
+
 /*
 The aim of this function is to compute in one pass the correct ValidPathInfo for
 the files that we are trying to add to the store. To accomplish that in one
@@ -578,6 +587,30 @@ StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag m
         std::exception_ptr exc;
     };
 
+    /* Fetch everything the disk cache knows about in one go, rather
+       than doing a lookup per path. */
+    if (diskCache) {
+        std::vector<std::string> hashParts;
+        {
+            auto state_(state.lock());
+            for (auto & path : paths) {
+                auto res = state_->pathInfoCache.get(std::string(path.hashPart()));
+                if (!res || !res->isKnownNow())
+                    hashParts.push_back(std::string(path.hashPart()));
+            }
+        }
+
+        if (!hashParts.empty()) {
+            auto res = diskCache->lookupNarInfos(getUri(), hashParts);
+            auto state_(state.lock());
+            for (auto & [hashPart, r] : res) {
+                if (r.first == NarInfoDiskCache::oUnknown) continue;
+                state_->pathInfoCache.upsert(hashPart,
+                    r.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = r.second });
+            }
+        }
+    }
+
     Sync<State> state_(State{paths.size(), StorePathSet()});
 
     std::condition_variable wakeup;
@@ -781,6 +814,17 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
+    /* If both stores are on the local file system, let the
+       destination copy the files directly, which may allow it to
+       share their data blocks. */
+    if (auto srcFS = dynamic_cast<LocalFSStore *>(&*srcStore)) {
+        auto srcPath = srcFS->toRealPath(srcStore->printStorePath(storePath));
+        if (pathExists(srcPath) && dstStore->addToStoreFromLocalPath(*info, srcPath, repair, checkSigs)) {
+            act.progress(info->narSize, info->narSize);
+            return;
+        }
+    }
+
     auto source = sinkToSource([&](Sink & sink) {
         LambdaSink progressSink([&](std::string_view data) {
             total += data.size();
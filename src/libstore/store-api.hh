@@ -166,6 +166,10 @@ struct BuildResult
        was repeated). */
     time_t startTime = 0, stopTime = 0;
 
+    /* Resource usage of the build, if known (see `use-cgroups'). */
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    std::optional<uint64_t> memoryPeak, ioRead, ioWritten;
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -443,6 +447,22 @@ public:
     virtual void addToStore(const ValidPathInfo & info, Source & narSource,
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs) = 0;
 
+    /* Import several paths into the store. The references of each
+       path must be valid or be among 'paths'. The default
+       implementation calls addToStore() for each path in order. */
+    typedef std::vector<std::pair<ValidPathInfo, std::unique_ptr<Source>>> PathsSource;
+
+    virtual void addMultipleToStore(PathsSource & paths,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
+    /* Import a path from 'srcPath', a copy of its contents in the
+       local file system, without going through a NAR. Returns false
+       if the store doesn't support this, in which case the caller
+       should use addToStore(). */
+    virtual bool addToStoreFromLocalPath(const ValidPathInfo & info, const Path & srcPath,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs)
+    { return false; }
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -694,6 +714,8 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+        std::atomic<uint64_t> dbLockWaitTimeUs{0};
+        std::atomic<uint64_t> dbReadConnectionWaitTimeUs{0};
     };
 
     const Stats & getStats();
@@ -0,0 +1,85 @@
+#include "build-times.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    static StorePath drv(std::string_view name)
+    {
+        return StorePath(std::string("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-") + std::string(name) + ".drv");
+    }
+
+    static double unit(const StorePath &)
+    {
+        return 1;
+    }
+
+    /* ----------------------------------------------------------------------------
+     * computeCriticalPaths
+     * --------------------------------------------------------------------------*/
+
+    TEST(computeCriticalPaths, emptyGraph) {
+        ASSERT_TRUE(computeCriticalPaths({}, unit).empty());
+    }
+
+    TEST(computeCriticalPaths, chain) {
+        // c depends on b, which depends on a.
+        auto res = computeCriticalPaths({
+            {drv("a"), {}},
+            {drv("b"), {drv("a")}},
+            {drv("c"), {drv("b")}},
+        }, unit);
+        ASSERT_EQ(res.at(drv("a")), 3);
+        ASSERT_EQ(res.at(drv("b")), 2);
+        ASSERT_EQ(res.at(drv("c")), 1);
+    }
+
+    TEST(computeCriticalPaths, diamondTakesLongestBranch) {
+        // d depends on b and c, which both depend on a.
+        std::map<std::string, double> costs{{"a", 1}, {"b", 10}, {"c", 2}, {"d", 5}};
+        auto res = computeCriticalPaths({
+            {drv("a"), {}},
+            {drv("b"), {drv("a")}},
+            {drv("c"), {drv("a")}},
+            {drv("d"), {drv("b"), drv("c")}},
+        }, [&](const StorePath & p) {
+            return costs.at(std::string(p.name(), 0, p.name().size() - 4));
+        });
+        ASSERT_EQ(res.at(drv("d")), 5);
+        ASSERT_EQ(res.at(drv("b")), 15);
+        ASSERT_EQ(res.at(drv("c")), 7);
+        ASSERT_EQ(res.at(drv("a")), 16);
+    }
+
+    TEST(computeCriticalPaths, ignoresDependenciesOutsideGraph) {
+        // 'a' was already built, so it isn't part of the graph.
+        auto res = computeCriticalPaths({
+            {drv("b"), {drv("a")}},
+        }, unit);
+        ASSERT_EQ(res.size(), 1);
+        ASSERT_EQ(res.at(drv("b")), 1);
+    }
+
+    TEST(computeCriticalPaths, unknownCosts) {
+        // The caller substitutes a default for unknown build times.
+        std::map<std::string, std::optional<double>> costs{{"a", 4}, {"b", std::nullopt}};
+        auto res = computeCriticalPaths({
+            {drv("a"), {}},
+            {drv("b"), {drv("a")}},
+        }, [&](const StorePath & p) {
+            return costs.at(std::string(p.name(), 0, p.name().size() - 4)).value_or(1);
+        });
+        ASSERT_EQ(res.at(drv("b")), 1);
+        ASSERT_EQ(res.at(drv("a")), 5);
+    }
+
+    TEST(computeCriticalPaths, terminatesOnCycle) {
+        auto res = computeCriticalPaths({
+            {drv("a"), {drv("b")}},
+            {drv("b"), {drv("a")}},
+            {drv("c"), {drv("a")}},
+        }, unit);
+        ASSERT_EQ(res.size(), 3);
+        ASSERT_EQ(res.at(drv("c")), 1);
+    }
+
+}
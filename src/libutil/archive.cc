@@ -11,9 +11,15 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "io-uring.hh"
 
 namespace nix {
 
@@ -29,6 +35,8 @@ struct ArchiveSettings : Config
         "Whether to enable a Darwin-specific hack for dealing with file name collisions."};
     Setting<bool> preallocateContents{this, false, "preallocate-contents",
         "Whether to preallocate files when writing objects with known size."};
+    Setting<bool> useIoUring{this, false, "use-io-uring",
+        "Whether to use io_uring to batch the system calls for small files when serialising and restoring file system objects (Linux only)."};
 };
 
 static ArchiveSettings archiveSettings;
@@ -42,6 +50,43 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
+#if HAVE_LINUX_IO_URING_H
+
+/* Files up to this size are read or written in batches using
+   io_uring. */
+static const size_t smallFileSize = 32 * 1024;
+
+/* Return this thread's io_uring, or null if it is disabled or not
+   supported. */
+static IoUring * getIoUring()
+{
+    if (!archiveSettings.useIoUring) return nullptr;
+
+    thread_local std::unique_ptr<IoUring> ring;
+    thread_local bool unsupported = false;
+
+    if (!ring && !unsupported) {
+        try {
+            ring = std::make_unique<IoUring>(64);
+            for (auto opcode : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE})
+                if (!ring->supports(opcode)) {
+                    debug("not using io_uring: the kernel doesn't support operation %d", opcode);
+                    ring.reset();
+                    unsupported = true;
+                    break;
+                }
+        } catch (SysError & e) {
+            debug("not using io_uring: %s", e.msg());
+            unsupported = true;
+        }
+    }
+
+    return ring.get();
+}
+
+#endif
+
+
 static void dumpContents(const Path & path, size_t size,
     Sink & sink)
 {
@@ -64,6 +109,110 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
+static void dump(const Path & path, Sink & sink, PathFilter & filter);
+
+
+#if HAVE_LINUX_IO_URING_H
+
+/* Dump the entries of a directory, reading small regular files in
+   batches: one batch of statx() calls for the entries, then one
+   batch each of open(), read() and close() calls for the small
+   files. Other entries are dumped as usual. */
+static void dumpEntries(IoUring & ring, const Path & path,
+    const std::vector<std::pair<std::string, std::string>> & entries,
+    Sink & sink, PathFilter & filter)
+{
+    for (size_t start = 0; start < entries.size(); start += ring.capacity()) {
+        checkInterrupt();
+
+        auto end = std::min(entries.size(), start + ring.capacity());
+        auto count = end - start;
+
+        std::vector<Path> paths;
+        for (size_t i = start; i < end; ++i)
+            paths.push_back(path + "/" + entries[i].second);
+
+        std::vector<struct statx> sts(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto & sqe = ring.prepare();
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = (uintptr_t) paths[i].c_str();
+            sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+            sqe.len = STATX_TYPE | STATX_MODE | STATX_SIZE;
+            sqe.off = (uintptr_t) &sts[i];
+        }
+        auto statRes = ring.submit();
+
+        std::vector<size_t> small;
+        for (size_t i = 0; i < count; ++i)
+            if (statRes[i] == 0
+                && S_ISREG(sts[i].stx_mode)
+                && sts[i].stx_size <= smallFileSize)
+                small.push_back(i);
+
+        for (auto i : small) {
+            auto & sqe = ring.prepare();
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = (uintptr_t) paths[i].c_str();
+            sqe.open_flags = O_RDONLY | O_CLOEXEC;
+        }
+        auto fds = ring.submit();
+
+        std::vector<std::string> contents(count);
+        for (size_t j = 0; j < small.size(); ++j) {
+            if (fds[j] < 0) continue;
+            auto i = small[j];
+            contents[i].resize(sts[i].stx_size);
+            auto & sqe = ring.prepare();
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = fds[j];
+            sqe.addr = (uintptr_t) contents[i].data();
+            sqe.len = contents[i].size();
+            sqe.off = 0;
+        }
+        auto readRes = ring.submit();
+
+        for (size_t j = 0; j < small.size(); ++j) {
+            if (fds[j] < 0) continue;
+            auto & sqe = ring.prepare();
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = fds[j];
+        }
+        ring.submit();
+
+        /* Files that couldn't be read in full (e.g. because they
+           changed) are dumped as usual, which reports any errors. */
+        std::vector<bool> prefetched(count);
+        for (size_t j = 0, k = 0; j < small.size(); ++j) {
+            if (fds[j] < 0) continue;
+            auto i = small[j];
+            prefetched[i] = readRes[k++] == (int) contents[i].size();
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            sink << "entry" << "(" << "name" << entries[start + i].first << "node";
+            if (prefetched[i]) {
+                sink << "(" << "type" << "regular";
+                if (sts[i].stx_mode & S_IXUSR)
+                    sink << "executable" << "";
+                sink << "contents" << contents[i].size();
+                sink(contents[i]);
+                writePadding(contents[i].size(), sink);
+                sink << ")";
+                contents[i].clear();
+                contents[i].shrink_to_fit();
+            } else
+                dump(paths[i], sink, filter);
+            sink << ")";
+        }
+    }
+}
+
+#endif
+
+
 static void dump(const Path & path, Sink & sink, PathFilter & filter)
 {
     checkInterrupt();
@@ -101,12 +250,21 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
             } else
                 unhacked[i.name] = i.name;
 
+        std::vector<std::pair<std::string, std::string>> entries;
         for (auto & i : unhacked)
-            if (filter(path + "/" + i.first)) {
-                sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
-                sink << ")";
-            }
+            if (filter(path + "/" + i.first))
+                entries.emplace_back(i.first, i.second);
+
+#if HAVE_LINUX_IO_URING_H
+        if (auto ring = getIoUring())
+            dumpEntries(*ring, path, entries, sink, filter);
+        else
+#endif
+        for (auto & i : entries) {
+            sink << "entry" << "(" << "name" << i.first << "node";
+            dump(path + "/" + i.second, sink, filter);
+            sink << ")";
+        }
     }
 
     else if (S_ISLNK(st.st_mode))
@@ -300,8 +458,104 @@ struct RestoreSink : ParseSink
     Path dstPath;
     AutoCloseFD fd;
 
+#if HAVE_LINUX_IO_URING_H
+    /* With io_uring, small non-executable files are kept in memory
+       and written in batches by flush(). */
+    IoUring * ring = nullptr;
+
+    struct PendingFile
+    {
+        Path path;
+        std::string contents;
+    };
+
+    std::vector<PendingFile> pending;
+    bool deferring = false;
+
+    /* Create the file currently being deferred now. */
+    void createDeferredFile()
+    {
+        assert(deferring);
+        auto file = std::move(pending.back());
+        pending.pop_back();
+        deferring = false;
+        fd = open(file.path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("creating file '%1%'", file.path);
+        writeFull(fd.get(), file.contents);
+    }
+
+    void finishFile()
+    {
+        if (!deferring) return;
+        deferring = false;
+        if (pending.size() >= ring->capacity()) flush();
+    }
+
+    void flush()
+    {
+        deferring = false;
+        if (pending.empty()) return;
+
+        for (auto & file : pending) {
+            auto & sqe = ring->prepare();
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = (uintptr_t) file.path.c_str();
+            sqe.open_flags = O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC;
+            sqe.len = 0666;
+        }
+        auto fds = ring->submit();
+
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (fds[i] < 0 || pending[i].contents.empty()) continue;
+            auto & sqe = ring->prepare();
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = fds[i];
+            sqe.addr = (uintptr_t) pending[i].contents.data();
+            sqe.len = pending[i].contents.size();
+            sqe.off = 0;
+        }
+        auto writeRes = ring->submit();
+
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (fds[i] < 0) continue;
+            auto & sqe = ring->prepare();
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = fds[i];
+        }
+        auto closeRes = ring->submit();
+
+        for (size_t i = 0, j = 0, k = 0; i < pending.size(); ++i) {
+            auto & file = pending[i];
+            if (fds[i] < 0) {
+                errno = -fds[i];
+                throw SysError("creating file '%1%'", file.path);
+            }
+            if (!file.contents.empty()) {
+                auto res = writeRes[j++];
+                if (res < 0) {
+                    errno = -res;
+                    throw SysError("writing to file '%1%'", file.path);
+                }
+                if ((size_t) res != file.contents.size())
+                    throw Error("short write to file '%1%'", file.path);
+            }
+            if (closeRes[k++] < 0) {
+                errno = -closeRes[k - 1];
+                throw SysError("closing file '%1%'", file.path);
+            }
+        }
+
+        pending.clear();
+    }
+#else
+    void finishFile() { }
+    void flush() { }
+#endif
+
     void createDirectory(const Path & path) override
     {
+        finishFile();
         Path p = dstPath + path;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError("creating directory '%1%'", p);
@@ -309,13 +563,25 @@ struct RestoreSink : ParseSink
 
     void createRegularFile(const Path & path) override
     {
+        finishFile();
         Path p = dstPath + path;
+#if HAVE_LINUX_IO_URING_H
+        if (ring) {
+            fd = -1;
+            pending.push_back({p, ""});
+            deferring = true;
+            return;
+        }
+#endif
         fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
         if (!fd) throw SysError("creating file '%1%'", p);
     }
 
     void isExecutable() override
     {
+#if HAVE_LINUX_IO_URING_H
+        if (deferring) createDeferredFile();
+#endif
         struct stat st;
         if (fstat(fd.get(), &st) == -1)
             throw SysError("fstat");
@@ -325,6 +591,16 @@ struct RestoreSink : ParseSink
 
     void preallocateContents(uint64_t len) override
     {
+#if HAVE_LINUX_IO_URING_H
+        if (deferring) {
+            if (len <= smallFileSize) {
+                pending.back().contents.reserve(len);
+                return;
+            }
+            createDeferredFile();
+        }
+#endif
+
         if (!archiveSettings.preallocateContents)
             return;
 
@@ -343,11 +619,18 @@ struct RestoreSink : ParseSink
 
     void receiveContents(std::string_view data) override
     {
+#if HAVE_LINUX_IO_URING_H
+        if (deferring) {
+            pending.back().contents.append(data);
+            return;
+        }
+#endif
         writeFull(fd.get(), data);
     }
 
     void createSymlink(const Path & path, const string & target) override
     {
+        finishFile();
         Path p = dstPath + path;
         nix::createSymlink(target, p);
     }
@@ -358,7 +641,11 @@ void restorePath(const Path & path, Source & source)
 {
     RestoreSink sink;
     sink.dstPath = path;
+#if HAVE_LINUX_IO_URING_H
+    sink.ring = getIoUring();
+#endif
     parseDump(sink, source);
+    sink.flush();
 }
 
 
@@ -375,12 +662,101 @@ void copyNAR(Source & source, Sink & sink)
 }
 
 
+/* Copy 'size' bytes from 'fromFd' to 'toFd'. Where possible, share
+   the data blocks (on file systems that support reflinks) or let the
+   kernel copy them, rather than copying through user space. */
+static void copyContents(int fromFd, int toFd, uint64_t size, const Path & from)
+{
+    if (!size) return;
+
+#ifdef FICLONE
+    if (ioctl(toFd, FICLONE, fromFd) == 0) return;
+#endif
+
+    uint64_t left = size;
+
+#if HAVE_COPY_FILE_RANGE
+    while (left) {
+        checkInterrupt();
+        auto n = copy_file_range(fromFd, nullptr, toFd, nullptr,
+            std::min(left, (uint64_t) 1 << 30), 0);
+        if (n == -1) {
+            /* Fall back to copying through user space if the kernel
+               can't copy between these files. */
+            if (left == size && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                break;
+            throw SysError("copying the contents of '%1%'", from);
+        }
+        if (n == 0) throw EndOfFile("file '%1%' is shorter than expected", from);
+        left -= n;
+    }
+#endif
+
+    std::vector<char> buf(65536);
+
+    while (left) {
+        checkInterrupt();
+        auto n = std::min(left, (uint64_t) buf.size());
+        readFull(fromFd, buf.data(), n);
+        writeFull(toFd, {buf.data(), n});
+        left -= n;
+    }
+}
+
+
+static void copyPath_(const Path & from, const Path & to)
+{
+    checkInterrupt();
+
+    auto st = lstat(from);
+
+    if (S_ISREG(st.st_mode)) {
+        AutoCloseFD fdFrom = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fdFrom) throw SysError("opening file '%1%'", from);
+
+        AutoCloseFD fdTo = open(to.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fdTo) throw SysError("creating file '%1%'", to);
+
+        copyContents(fdFrom.get(), fdTo.get(), st.st_size, from);
+
+        /* Like restorePath(), only preserve the executable bit. */
+        if (st.st_mode & S_IXUSR) {
+            struct stat st2;
+            if (fstat(fdTo.get(), &st2) == -1)
+                throw SysError("fstat");
+            if (fchmod(fdTo.get(), st2.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+                throw SysError("fchmod");
+        }
+    }
+
+    else if (S_ISDIR(st.st_mode)) {
+        if (mkdir(to.c_str(), 0777) == -1)
+            throw SysError("creating directory '%1%'", to);
+        for (auto & i : readDirectory(from))
+            copyPath_(from + "/" + i.name, to + "/" + i.name);
+    }
+
+    else if (S_ISLNK(st.st_mode))
+        createSymlink(readLink(from), to);
+
+    else throw Error("file '%1%' has an unsupported type", from);
+}
+
+
 void copyPath(const Path & from, const Path & to)
 {
-    auto source = sinkToSource([&](Sink & sink) {
-        dumpPath(from, sink);
-    });
-    restorePath(to, *source);
+    /* With the case hack, file names in the NAR differ from those on
+       disk, so go through a NAR to get the same result as
+       restorePath(). */
+    if (archiveSettings.useCaseHack) {
+        auto source = sinkToSource([&](Sink & sink) {
+            dumpPath(from, sink);
+        });
+        restorePath(to, *source);
+        return;
+    }
+
+    copyPath_(from, to);
 }
 
 
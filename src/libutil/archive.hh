@@ -95,6 +95,9 @@ void restorePath(const Path & path, Source & source);
 /* Read a NAR from 'source' and write it to 'sink'. */
 void copyNAR(Source & source, Sink & sink);
 
+/* Copy the file system object 'from' to 'to' with the same result as
+   dumping and restoring it. The contents of regular files are
+   reflinked or copied by the kernel where possible. */
 void copyPath(const Path & from, const Path & to);
 
 
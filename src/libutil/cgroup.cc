@@ -0,0 +1,215 @@
+#if __linux__
+
+#include "cgroup.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <thread>
+
+#include <dirent.h>
+#include <signal.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+namespace nix {
+
+std::optional<Path> getCgroupFS()
+{
+    struct statfs st;
+    if (statfs("/sys/fs/cgroup", &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC)
+        return "/sys/fs/cgroup";
+    return std::nullopt;
+}
+
+std::optional<Path> getOwnCgroup()
+{
+    auto cgroupFS = getCgroupFS();
+    if (!cgroupFS) return std::nullopt;
+
+    /* In the unified hierarchy, the entry is "0::<path>". */
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/self/cgroup"), "\n"))
+        if (hasPrefix(line, "0::"))
+            return canonPath(*cgroupFS + "/" + std::string(line, 3));
+
+    return std::nullopt;
+}
+
+static const std::string supervisorCgroupName = "supervisor";
+
+void enterSupervisorCgroup()
+{
+    auto own = getOwnCgroup();
+    if (!own)
+        throw Error("cgroups v2 are not available");
+
+    if (baseNameOf(*own) == supervisorCgroupName) return;
+
+    Path supervisor = *own + "/" + supervisorCgroupName;
+    if (mkdir(supervisor.c_str(), 0755) == -1 && errno != EEXIST)
+        throw SysError("creating cgroup '%s'", supervisor);
+
+    writeFile(supervisor + "/cgroup.procs", "0");
+}
+
+Path createChildCgroup(const std::string & name)
+{
+    auto parent = getOwnCgroup();
+    if (!parent)
+        throw Error("cgroups v2 are not available");
+
+    /* Builds get siblings of the supervisor cgroup, since the latter
+       contains processes. */
+    if (baseNameOf(*parent) == supervisorCgroupName)
+        parent = dirOf(*parent);
+
+    /* This fails if the parent contains processes (cgroups v2 only
+       allows controllers to be enabled for the children of cgroups
+       without processes), or if the controllers aren't delegated to
+       us. Basic CPU accounting and pressure information are
+       available regardless. */
+    for (auto & controller : {"cpu", "memory", "io"}) {
+        try {
+            writeFile(*parent + "/cgroup.subtree_control", fmt("+%s", controller));
+        } catch (SysError & e) {
+            debug("cannot enable cgroup controller '%s' in '%s': %s", controller, *parent, e.msg());
+        }
+    }
+
+    Path cgroup = *parent + "/" + name;
+
+    /* A leftover from a previous build that was interrupted. */
+    if (pathExists(cgroup)) destroyCgroup(cgroup);
+
+    if (mkdir(cgroup.c_str(), 0755) == -1)
+        throw SysError("creating cgroup '%s'", cgroup);
+
+    return cgroup;
+}
+
+/* Parse a file consisting of "key value" lines. */
+static std::map<std::string, std::string> readKeyValues(const Path & path)
+{
+    std::map<std::string, std::string> res;
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile(path), "\n")) {
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        if (fields.size() == 2) res.emplace(fields[0], fields[1]);
+    }
+    return res;
+}
+
+static std::optional<std::chrono::microseconds> readPressure(const Path & path)
+{
+    /* The first line has the form "some avg10=... avg60=...
+       avg300=... total=<usecs>". */
+    auto line = tokenizeString<std::vector<std::string>>(readFile(path), "\n");
+    if (line.empty() || !hasPrefix(line[0], "some ")) return std::nullopt;
+    for (auto & field : tokenizeString<std::vector<std::string>>(line[0], " "))
+        if (hasPrefix(field, "total="))
+            if (auto n = string2Int<uint64_t>(std::string(field, 6)))
+                return std::chrono::microseconds(*n);
+    return std::nullopt;
+}
+
+CgroupStats getCgroupStats(const Path & cgroup)
+{
+    CgroupStats stats;
+
+    auto tryRead = [&](const std::string & file, auto fun) {
+        try {
+            if (pathExists(cgroup + "/" + file))
+                fun(cgroup + "/" + file);
+        } catch (Error & e) {
+            debug("cannot read '%s' of cgroup '%s': %s", file, cgroup, e.msg());
+        }
+    };
+
+    tryRead("cpu.stat", [&](const Path & path) {
+        auto cpuStat = readKeyValues(path);
+        if (auto n = string2Int<uint64_t>(cpuStat["user_usec"]))
+            stats.cpuUser = std::chrono::microseconds(*n);
+        if (auto n = string2Int<uint64_t>(cpuStat["system_usec"]))
+            stats.cpuSystem = std::chrono::microseconds(*n);
+    });
+
+    tryRead("memory.peak", [&](const Path & path) {
+        stats.memoryPeak = string2Int<uint64_t>(trim(readFile(path)));
+    });
+
+    /* Each line has the form "<major>:<minor> rbytes=... wbytes=...
+       ...". */
+    tryRead("io.stat", [&](const Path & path) {
+        uint64_t read = 0, written = 0;
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(path), "\n"))
+            for (auto & field : tokenizeString<std::vector<std::string>>(line, " ")) {
+                if (hasPrefix(field, "rbytes="))
+                    read += string2Int<uint64_t>(std::string(field, 7)).value_or(0);
+                else if (hasPrefix(field, "wbytes="))
+                    written += string2Int<uint64_t>(std::string(field, 7)).value_or(0);
+            }
+        stats.ioRead = read;
+        stats.ioWritten = written;
+    });
+
+    tryRead("cpu.pressure", [&](const Path & path) { stats.cpuPressure = readPressure(path); });
+    tryRead("memory.pressure", [&](const Path & path) { stats.memoryPressure = readPressure(path); });
+    tryRead("io.pressure", [&](const Path & path) { stats.ioPressure = readPressure(path); });
+
+    return stats;
+}
+
+CgroupStats destroyCgroup(const Path & cgroup)
+{
+    /* Nested cgroups created by the processes in this one have to be
+       removed first. */
+    {
+        AutoCloseDir dir(opendir(cgroup.c_str()));
+        if (!dir) throw SysError("opening cgroup '%s'", cgroup);
+
+        struct dirent * dent;
+        while ((dent = readdir(dir.get()))) {
+            std::string name = dent->d_name;
+            if (name == "." || name == "..") continue;
+            if (dent->d_type == DT_DIR) destroyCgroup(cgroup + "/" + name);
+        }
+    }
+
+    auto stats = getCgroupStats(cgroup);
+
+    /* cgroup.kill (Linux >= 5.14) kills all processes atomically.
+       Otherwise, keep killing the processes in the cgroup until there
+       are none left. */
+    auto killFile = cgroup + "/cgroup.kill";
+    bool haveKill = pathExists(killFile);
+
+    for (int round = 0; ; ++round) {
+        if (haveKill) writeFile(killFile, "1");
+
+        auto pids = tokenizeString<std::vector<std::string>>(readFile(cgroup + "/cgroup.procs"), "\n");
+        if (pids.empty()) break;
+
+        if (round > 1000)
+            throw Error("cannot kill the processes in cgroup '%s'", cgroup);
+
+        if (!haveKill)
+            for (auto & pidS : pids)
+                if (auto pid = string2Int<pid_t>(pidS))
+                    if (kill(*pid, SIGKILL) == -1 && errno != ESRCH)
+                        throw SysError("killing process %d in cgroup '%s'", *pid, cgroup);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    /* The cgroup can only be removed once the kernel has finished
+       cleaning up the killed processes. */
+    for (int round = 0; rmdir(cgroup.c_str()) == -1; ++round) {
+        if (errno != EBUSY || round > 1000)
+            throw SysError("removing cgroup '%s'", cgroup);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return stats;
+}
+
+}
+
+#endif
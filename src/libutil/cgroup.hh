@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.hh"
+
+#include <chrono>
+#include <optional>
+
+namespace nix {
+
+/* Resource usage of the processes in a cgroup. Fields are empty if
+   the kernel doesn't provide them (e.g. because the corresponding
+   controller isn't enabled). Pressure stall times are the total time
+   during which at least one task was stalled on the resource. */
+struct CgroupStats
+{
+    std::optional<std::chrono::microseconds> cpuUser, cpuSystem;
+    std::optional<uint64_t> memoryPeak;
+    std::optional<uint64_t> ioRead, ioWritten;
+    std::optional<std::chrono::microseconds> cpuPressure, memoryPressure, ioPressure;
+};
+
+#if __linux__
+
+/* Return the path of the cgroup v2 hierarchy, if it's mounted. */
+std::optional<Path> getCgroupFS();
+
+/* Return the cgroup v2 of the calling process, as an absolute path in
+   the file system. */
+std::optional<Path> getOwnCgroup();
+
+/* Move the calling process into a child cgroup named "supervisor".
+   cgroups v2 only allows controllers to be enabled for the children
+   of cgroups without processes, so a daemon calls this before
+   creating cgroups for its builds. */
+void enterSupervisorCgroup();
+
+/* Create a child cgroup of the calling process's cgroup (or of its
+   parent, if the calling process is in a supervisor cgroup) and try
+   to enable the cpu, memory and io controllers for it. */
+Path createChildCgroup(const std::string & name);
+
+/* Read the resource usage of the processes in a cgroup. */
+CgroupStats getCgroupStats(const Path & cgroup);
+
+/* Kill all processes in a cgroup and remove it. Returns the resource
+   usage of the cgroup just before it was destroyed. */
+CgroupStats destroyCgroup(const Path & cgroup);
+
+#endif
+
+}
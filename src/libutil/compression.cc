@@ -483,6 +483,80 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
+bool supportsCompressionFrames(const std::string & method)
+{
+    /* The xz decoder is created with LZMA_CONCATENATED, so it accepts
+       a sequence of xz streams. The other decoders stop at the end of
+       the first stream. */
+    return method == "none" || method == "xz";
+}
+
+struct FramedCompressionSink : CompressionSink
+{
+    const std::string method;
+    const uint64_t frameSize;
+    CompressionFrames & frames;
+    const bool parallel;
+
+    LengthSink compressedSize;
+    TeeSink teeSink;
+
+    std::shared_ptr<CompressionSink> frameSink;
+    uint64_t uncompressedSize = 0, frameFill = 0;
+
+    FramedCompressionSink(const std::string & method, Sink & nextSink,
+        uint64_t frameSize, CompressionFrames & frames, bool parallel)
+        : method(method)
+        , frameSize(frameSize)
+        , frames(frames)
+        , parallel(parallel)
+        , teeSink(nextSink, compressedSize)
+    {
+        if (!supportsCompressionFrames(method))
+            throw CompressionError("compression method '%s' does not support independently decompressible frames", method);
+        if (frameSize == 0)
+            throw CompressionError("compression frame size must be positive");
+    }
+
+    void finishFrame()
+    {
+        frameSink->finish();
+        frameSink.reset();
+    }
+
+    void finish() override
+    {
+        flush();
+        if (frameSink) finishFrame();
+        frames.emplace_back(uncompressedSize, compressedSize.length);
+    }
+
+    void write(std::string_view data) override
+    {
+        while (!data.empty()) {
+            if (!frameSink) {
+                frames.emplace_back(uncompressedSize, compressedSize.length);
+                frameSink = makeCompressionSink(method, teeSink, parallel);
+                frameFill = 0;
+            }
+
+            auto n = std::min((uint64_t) data.size(), frameSize - frameFill);
+            (*frameSink)(data.substr(0, n));
+            data.remove_prefix(n);
+            uncompressedSize += n;
+            frameFill += n;
+
+            if (frameFill == frameSize) finishFrame();
+        }
+    }
+};
+
+ref<CompressionSink> makeFramedCompressionSink(const std::string & method, Sink & nextSink,
+    uint64_t frameSize, CompressionFrames & frames, const bool parallel)
+{
+    return make_ref<FramedCompressionSink>(method, nextSink, frameSize, frames, parallel);
+}
+
 ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
 {
     StringSink ssink;
@@ -21,6 +21,24 @@ ref<std::string> compress(const std::string & method, const std::string & in, co
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
 
+/* A list of (uncompressed offset, compressed offset) pairs denoting
+   the start of each frame in a framed compressed stream. The last
+   entry holds the total uncompressed and compressed sizes. */
+typedef std::vector<std::pair<uint64_t, uint64_t>> CompressionFrames;
+
+/* Return true if a stream produced by concatenating independently
+   compressed frames can be decompressed by makeDecompressionSink(). */
+bool supportsCompressionFrames(const std::string & method);
+
+/* Return a sink that compresses its input as a sequence of
+   independently decompressible frames, each containing 'frameSize'
+   bytes of uncompressed data. The frame offsets are appended to
+   'frames' as they are produced; the final entry is added by
+   finish(). This allows a reader to fetch and decompress a byte range
+   of the original data without decompressing everything before it. */
+ref<CompressionSink> makeFramedCompressionSink(const std::string & method, Sink & nextSink,
+    uint64_t frameSize, CompressionFrames & frames, const bool parallel = false);
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
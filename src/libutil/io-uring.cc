@@ -0,0 +1,141 @@
+#if HAVE_LINUX_IO_URING_H
+
+#include "io-uring.hh"
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace nix {
+
+IoUring::IoUring(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (!fd) throw SysError("setting up io_uring");
+
+    this->entries = params.sq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    /* Recent kernels map both rings with a single mmap(). */
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd.get(), IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = nullptr;
+        throw SysError("mapping the io_uring submission queue");
+    }
+
+    if (singleMmap)
+        cqRing = sqRing;
+    else {
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd.get(), IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = nullptr;
+            throw SysError("mapping the io_uring completion queue");
+        }
+    }
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    auto p = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd.get(), IORING_OFF_SQES);
+    if (p == MAP_FAILED)
+        throw SysError("mapping the io_uring submission queue entries");
+    sqes = (io_uring_sqe *) p;
+
+    auto sq = (char *) sqRing, cq = (char *) cqRing;
+    sqTail = (unsigned *) (sq + params.sq_off.tail);
+    sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *) (sq + params.sq_off.array);
+    cqHead = (unsigned *) (cq + params.cq_off.head);
+    cqTail = (unsigned *) (cq + params.cq_off.tail);
+    cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* Find out which operations are supported. Setting up a ring
+       succeeds on older kernels that don't support probing or most
+       operations, which then fail with EINVAL. */
+    const unsigned maxOps = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) + maxOps * sizeof(io_uring_probe_op), 0);
+    auto probe = (io_uring_probe *) buf.data();
+    if (syscall(__NR_io_uring_register, fd.get(), IORING_REGISTER_PROBE, probe, maxOps) == 0) {
+        for (unsigned i = 0; i < probe->ops_len && i < maxOps; ++i)
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+                supported.set(probe->ops[i].op);
+    } else if (errno != EINVAL)
+        throw SysError("probing io_uring operations");
+}
+
+
+IoUring::~IoUring()
+{
+    if (sqes) munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing) munmap(sqRing, sqRingSize);
+}
+
+
+io_uring_sqe & IoUring::prepare()
+{
+    assert(prepared < entries);
+
+    /* We're the only producer, so the tail only changes in
+       submit(). */
+    auto tail = *sqTail + prepared;
+    auto index = tail & *sqMask;
+    sqArray[index] = index;
+
+    auto & sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = prepared++;
+    return sqe;
+}
+
+
+std::vector<int> IoUring::submit()
+{
+    auto n = prepared;
+    prepared = 0;
+
+    std::vector<int> results(n);
+    if (!n) return results;
+
+    __atomic_store_n(sqTail, *sqTail + n, __ATOMIC_RELEASE);
+
+    unsigned toSubmit = n, completed = 0;
+
+    while (completed < n) {
+        auto res = syscall(__NR_io_uring_enter, fd.get(), toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            /* The operations may still be in flight and refer to the
+               caller's buffers, so we can't recover from this. */
+            throw SysError("waiting for io_uring operations");
+        }
+        toSubmit -= std::min(toSubmit, (unsigned) res);
+
+        auto head = *cqHead;
+        auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++completed) {
+            auto & cqe = cqes[head & *cqMask];
+            assert(cqe.user_data < n);
+            results[cqe.user_data] = cqe.res;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return results;
+}
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "util.hh"
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <bitset>
+
+#include <linux/io_uring.h>
+
+namespace nix {
+
+/* A minimal io_uring instance for submitting batches of system calls
+   and waiting for all of them. Operations are prepared with
+   prepare(), which returns a zeroed submission queue entry for the
+   caller to fill in (except for 'user_data'), and run by submit().
+   An instance must only be used by one thread at a time. */
+class IoUring
+{
+public:
+
+    /* Throws SysError if io_uring is not supported by the kernel (or
+       disabled by seccomp or sysctl). */
+    IoUring(unsigned entries);
+
+    ~IoUring();
+
+    /* The maximum number of operations in a batch. */
+    unsigned capacity() const { return entries; }
+
+    /* Whether the kernel supports the operation 'opcode'. Kernels
+       that predate probing (< 5.6) are assumed to support none of
+       the operations on file descriptors and paths. */
+    bool supports(uint8_t opcode) const { return supported.test(opcode); }
+
+    io_uring_sqe & prepare();
+
+    /* Submit the prepared operations and wait for all of them to
+       complete. Returns their results (i.e. the return value of the
+       system call, or minus the error code) in the order in which
+       they were prepared. */
+    std::vector<int> submit();
+
+private:
+
+    AutoCloseFD fd;
+    unsigned entries;
+
+    void * sqRing = nullptr, * cqRing = nullptr;
+    size_t sqRingSize = 0, cqRingSize = 0;
+    io_uring_sqe * sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned * sqTail, * sqMask, * sqArray;
+    unsigned * cqHead, * cqTail, * cqMask;
+    io_uring_cqe * cqes;
+
+    unsigned prepared = 0;
+
+    std::bitset<256> supported;
+};
+
+}
+
+#endif
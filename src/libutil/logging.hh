@@ -31,6 +31,8 @@ typedef enum {
     resProgress = 105,
     resSetExpected = 106,
     resPostBuildLogLine = 107,
+    resFileTransferMetrics = 108,
+    resBuildMetrics = 109,
 } ResultType;
 
 typedef uint64_t ActivityId;
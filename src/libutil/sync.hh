@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstdlib>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <cassert>
@@ -43,6 +45,16 @@ public:
         std::unique_lock<M> lk;
         friend Sync;
         Lock(Sync * s) : s(s), lk(s->mutex) { }
+        Lock(Sync * s, std::atomic<uint64_t> & waitTimeUs)
+            : s(s), lk(s->mutex, std::try_to_lock)
+        {
+            if (!lk.owns_lock()) {
+                auto before = std::chrono::steady_clock::now();
+                lk.lock();
+                waitTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - before).count();
+            }
+        }
     public:
         Lock(Lock && l) : s(l.s) { abort(); }
         Lock(const Lock & l) = delete;
@@ -83,6 +95,10 @@ public:
     };
 
     Lock lock() { return Lock(this); }
+
+    /* Like lock(), but add the time spent waiting for the lock to
+       'waitTimeUs'. */
+    Lock lock(std::atomic<uint64_t> & waitTimeUs) { return Lock(this, waitTimeUs); }
 };
 
 }
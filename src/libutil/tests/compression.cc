@@ -75,4 +75,47 @@ namespace nix {
         ASSERT_STREQ((*strSink.s).c_str(), inputString);
     }
 
+    /* ----------------------------------------------------------------------------
+     * framed compression sinks
+     * --------------------------------------------------------------------------*/
+
+    TEST(makeFramedCompressionSink, unsupportedMethodThrows) {
+        StringSink strSink;
+        CompressionFrames frames;
+        ASSERT_THROW(makeFramedCompressionSink("bzip2", strSink, 16, frames), CompressionError);
+    }
+
+    TEST(makeFramedCompressionSink, concatenatedFramesDecompress) {
+        StringSink strSink;
+        CompressionFrames frames;
+        std::string inputString;
+        for (int i = 0; i < 100; i++)
+            inputString += "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+        auto sink = makeFramedCompressionSink("xz", strSink, 1000, frames);
+        (*sink)(inputString);
+        sink->finish();
+
+        ASSERT_EQ(frames.size(), 7);
+        ASSERT_EQ(frames.back().first, inputString.size());
+        ASSERT_EQ(frames.back().second, strSink.s->size());
+        ASSERT_EQ(*decompress("xz", *strSink.s), inputString);
+    }
+
+    TEST(makeFramedCompressionSink, framesDecompressIndependently) {
+        StringSink strSink;
+        CompressionFrames frames;
+        std::string inputString;
+        for (int i = 0; i < 100; i++)
+            inputString += std::to_string(i) + ";sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;";
+        auto sink = makeFramedCompressionSink("xz", strSink, 512, frames);
+        (*sink)(inputString);
+        sink->finish();
+
+        for (size_t i = 0; i + 1 < frames.size(); i++) {
+            auto frame = strSink.s->substr(frames[i].second, frames[i + 1].second - frames[i].second);
+            ASSERT_EQ(*decompress("xz", frame),
+                inputString.substr(frames[i].first, frames[i + 1].first - frames[i].first));
+        }
+    }
+
 }
@@ -10,6 +10,8 @@
 #include "finally.hh"
 #include "legacy.hh"
 #include "daemon.hh"
+#include "cgroup.hh"
+#include "nar-info-disk-cache.hh"
 
 #include <algorithm>
 #include <climits>
@@ -159,6 +161,17 @@ static void daemonLoop()
     //  Get rid of children automatically; don't let them become zombies.
     setSigChldAction(true);
 
+#if __linux__
+    //  Make room for the controllers of the builds' cgroups.
+    if (settings.useCgroups) {
+        try {
+            enterSupervisorCgroup();
+        } catch (Error & e) {
+            warn("cannot move the daemon into a supervisor cgroup: %s", e.msg());
+        }
+    }
+#endif
+
     AutoCloseFD fdSocket;
 
     //  Handle socket-based activation by systemd.
@@ -251,6 +264,8 @@ static void daemonLoop()
                     store.createUser(user, peer.uid);
                 });
 
+                shutdownNarInfoDiskCache();
+
                 exit(0);
             }, options);
 
@@ -2,12 +2,37 @@
 #include "common-args.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "local-fs-store.hh"
+#include "build-log.hh"
 #include "progress-bar.hh"
 
+#include <thread>
+
 using namespace nix;
 
 struct CmdLog : InstallableCommand
 {
+    uint64_t tail = 0;
+    bool follow = false;
+
+    CmdLog()
+    {
+        addFlag({
+            .longName = "tail",
+            .description = "Only show the last *n* lines of the log.",
+            .labels = {"n"},
+            .handler = {&tail},
+        });
+
+        addFlag({
+            .longName = "follow",
+            .shortName = 'f',
+            .description = "Keep showing new output of a build that is still running. "
+                "This requires the log to be written with the `index-build-log` setting.",
+            .handler = {&follow, true},
+        });
+    }
+
     std::string description() override
     {
         return "show the build log of the specified packages or paths, if available";
@@ -32,25 +57,61 @@ struct CmdLog : InstallableCommand
 
         auto b = installable->toBuildable();
 
-        RunPager pager;
+        auto path = std::visit(overloaded {
+            [&](BuildableOpaque bo) { return bo.path; },
+            [&](BuildableFromDrv bfd) { return bfd.drvPath; },
+        }, b);
+
+        std::optional<RunPager> pager;
+        if (!follow) pager.emplace();
+
         for (auto & sub : subs) {
-            auto log = std::visit(overloaded {
-                [&](BuildableOpaque bo) {
-                    return sub->getBuildLog(bo.path);
-                },
-                [&](BuildableFromDrv bfd) {
-                    return sub->getBuildLog(bfd.drvPath);
-                },
-            }, b);
+            if (auto localFSStore = sub.dynamic_pointer_cast<LocalFSStore>()) {
+                if (auto logPath = localFSStore->getIndexedBuildLogPath(path)) {
+                    stopProgressBar();
+                    printInfo("got build log for '%s' from '%s'", installable->what(), sub->getUri());
+                    showIndexedLog(*logPath);
+                    return;
+                }
+            }
+
+            auto log = sub->getBuildLog(path);
             if (!log) continue;
             stopProgressBar();
             printInfo("got build log for '%s' from '%s'", installable->what(), sub->getUri());
-            std::cout << *log;
+            if (follow)
+                warn("the build log of '%s' is not indexed, so it cannot be followed", installable->what());
+            std::cout << (tail ? tailLines(*log, tail) : *log);
             return;
         }
 
         throw Error("build log of '%s' is not available", installable->what());
     }
+
+    void showIndexedLog(const Path & logPath)
+    {
+        auto index = readLogIndex(logPath + ".idx");
+        auto shown = index.checkpoints.size() - 1;
+
+        std::cout << (tail
+            ? tailIndexedLog(logPath + ".xz", index, tail)
+            : readIndexedLog(logPath + ".xz", index, 0, shown));
+
+        if (!follow) return;
+
+        /* Poll the index for frames written since the last time. */
+        while (!index.complete) {
+            std::cout.flush();
+            checkInterrupt();
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            index = readLogIndex(logPath + ".idx");
+            auto last = index.checkpoints.size() - 1;
+            if (last > shown) {
+                std::cout << readIndexedLog(logPath + ".xz", index, shown, last);
+                shown = last;
+            }
+        }
+    }
 };
 
 static auto rCmdLog = registerCommand<CmdLog>("log");
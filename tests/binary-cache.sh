@@ -185,6 +185,42 @@ clearCacheCache
 nix-store -r $outPath --substituters "file://$cacheDir2 file://$cacheDir" --trusted-public-keys "$publicKey"
 
 
+# Test many concurrent narinfo and NAR fetches from one host with a
+# small per-host limit, some of which fail because the path isn't in
+# the cache. Every transfer must give back its slot, or the ones
+# queued behind it never start.
+clearStore
+manyCacheDir=$TEST_ROOT/binary-cache-many
+rm -rf $manyCacheDir $TEST_ROOT/many
+mkdir $TEST_ROOT/many
+
+present=()
+missing=()
+for i in $(seq 1 40); do
+    echo "file $i" > $TEST_ROOT/many/$i
+    path=$(nix-store --add $TEST_ROOT/many/$i)
+    if (( i <= 30 )); then present+=($path); else missing+=($path); fi
+done
+
+_NIX_FORCE_HTTP= nix copy --to file://$manyCacheDir ${present[@]}
+
+for n in 1 2; do
+    clearStore
+    clearCacheCache
+    timeout 60 nix copy --from file://$manyCacheDir --no-require-sigs \
+        --option http-connections-per-host $n ${present[@]}
+    nix-store --check-validity ${present[@]}
+
+    clearStore
+    clearCacheCache
+    res=0
+    timeout 60 nix-store -r --keep-going --substituters file://$manyCacheDir --no-require-sigs \
+        --option http-connections-per-host $n ${present[@]} ${missing[@]} || res=$?
+    [[ $res != 0 && $res != 124 ]]
+    nix-store --check-validity ${present[@]}
+done
+
+
 unset _NIX_FORCE_HTTP
 
 
@@ -224,6 +260,26 @@ diff -u \
     <(echo '{"version":1,"root":{"type":"directory","entries":{"bar":{"type":"regular","size":4,"narOffset":232},"link":{"type":"symlink","target":"xyzzy"}}}}' | jq -S)
 
 
+# Test reading files from a NAR compressed in independent frames.
+clearCache
+
+outPath=$(nix-build --no-out-link -E '
+  with import ./config.nix;
+  mkDerivation {
+    name = "nar-frames";
+    buildCommand = "mkdir $out; for i in $(seq 1 1000); do echo $i; done > $out/numbers; echo foo > $out/bar";
+  }
+')
+
+nix copy --to "file://$cacheDir?compression=xz&nar-frame-size=1024" $outPath
+
+[[ $(jq '.frames | length' < $cacheDir/$(basename $outPath | cut -c1-32).ls) -gt 2 ]]
+
+[[ $(nix store cat --store file://$cacheDir $outPath/bar) = foo ]]
+[[ $(nix store cat --store file://$cacheDir $outPath/numbers | tail -n1) = 1000 ]]
+nix store verify --store file://$cacheDir --no-trust $outPath
+
+
 # Test debug info index generation.
 clearCache
 
@@ -0,0 +1,20 @@
+source common.sh
+
+clearStore
+
+db=$TEST_HOME/.cache/nix/build-times.sqlite
+
+# Build times are recorded with sub-second precision, so quick builds
+# don't count as taking no time at all.
+nix-build dependencies.nix --no-out-link
+if [[ -z ${NIX_REMOTE:-} && -n $(type -p sqlite3) ]]; then
+    [[ $(sqlite3 $db "select duration from BuildTimes where name = 'dependencies-input-0'") -gt 0 ]]
+fi
+
+# The database is only used for scheduling, so a broken one doesn't
+# fail builds.
+clearStore
+rm -f $db*
+mkdir -p $(dirname $db)
+echo garbage > $db
+nix-build dependencies.nix --no-out-link --option critical-path-scheduling true
@@ -0,0 +1,105 @@
+# Test running builds in their own cgroup (‘use-cgroups’).
+
+{ nixpkgs, system, overlay }:
+
+with import (nixpkgs + "/nixos/lib/testing-python.nix") {
+  inherit system;
+  extraConfigurations = [ { nixpkgs.overlays = [ overlay ]; } ];
+};
+
+let
+
+  # The builds run as root and without a sandbox (see `build` below),
+  # so only the cgroup can clean up after them.
+  expr = pkgs.writeText "cgroups.nix" ''
+    let
+      mkDerivation = args: derivation ({
+        system = "${system}";
+        builder = "/bin/sh";
+        PATH = "/run/current-system/sw/bin";
+      } // args);
+
+      readMemoryMax = "cat /sys/fs/cgroup$(cut -d: -f3 /proc/self/cgroup)/memory.max > $out";
+    in {
+      # Leaves a process behind in a session of its own, out of reach
+      # of the kill of the builder's process group.
+      background = mkDerivation {
+        name = "background";
+        args = [ "-c" "setsid sleep 1000 < /dev/null > /dev/null 2>&1 & echo $! > $out" ];
+      };
+
+      memory = mkDerivation {
+        name = "memory";
+        args = [ "-c" readMemoryMax ];
+      };
+
+      memoryAttr = mkDerivation {
+        name = "memory-attr";
+        memoryMax = "134217728";
+        args = [ "-c" readMemoryMax ];
+      };
+
+      memoryInvalid = mkDerivation {
+        name = "memory-invalid";
+        memoryMax = "lots";
+        args = [ "-c" "touch $out" ];
+      };
+    }
+  '';
+
+in
+
+makeTest {
+  name = "cgroups";
+
+  nodes =
+    { machine =
+        { config, lib, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          nix.binaryCaches = lib.mkForce [ ];
+          nix.extraOptions = ''
+            experimental-features = nix-command
+            use-cgroups = true
+            build-memory-max = 268435456
+          '';
+          systemd.enableUnifiedCgroupHierarchy = true;
+          systemd.services.nix-daemon.serviceConfig.Delegate = true;
+        };
+    };
+
+  testScript = { nodes }: ''
+    # fmt: off
+    start_all()
+    machine.wait_for_unit("multi-user.target")
+
+    def build(attr):
+        return machine.succeed(
+            f"NIX_REMOTE=daemon nix-build ${expr} -A {attr} --no-out-link"
+            " --option sandbox false --option build-users-group \"\""
+        ).strip()
+
+    # A process left behind by the builder is killed when the build
+    # finishes. (It may linger as a zombie until its new parent reaps
+    # it.)
+    out = build("background")
+    pid = machine.succeed(f"cat {out}").strip()
+    machine.fail(f"ps -o stat= -p {pid} | grep -v Z")
+
+    # The daemon leaves its own cgroup to the builds.
+    machine.succeed("grep -qx '0::/system.slice/nix-daemon.service/supervisor' /proc/$(pgrep -o -x nix-daemon)/cgroup")
+
+    # The memory limit is applied, and the derivation can lower it.
+    out = build("memory")
+    machine.succeed(f"grep -qx 268435456 {out}")
+    out = build("memoryAttr")
+    machine.succeed(f"grep -qx 134217728 {out}")
+    machine.succeed(
+        "NIX_REMOTE=daemon nix-build ${expr} -A memoryInvalid --no-out-link"
+        " --option sandbox false --option build-users-group \"\" 2>&1"
+        " | grep -q \"invalid 'memoryMax' attribute\""
+    )
+
+    # The resource usage ends up in the build log.
+    machine.succeed(f"nix log {out} | grep -q 'build resource usage: cpu user'")
+  '';
+}
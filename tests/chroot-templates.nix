@@ -0,0 +1,66 @@
+# Test the templates from which sandboxed builds get /etc and /dev.
+
+{ nixpkgs, system, overlay }:
+
+with import (nixpkgs + "/nixos/lib/testing-python.nix") {
+  inherit system;
+  extraConfigurations = [ { nixpkgs.overlays = [ overlay ]; } ];
+};
+
+let
+
+  # Reports the number of links to the chroot's /etc/group, which is
+  # more than one if it comes from a template.
+  expr = pkgs.writeText "chroot-templates.nix" ''
+    { seed }:
+    let busybox = builtins.storePath ${pkgs.busybox}; in
+    derivation {
+      name = "chroot-templates-''${seed}";
+      system = "${system}";
+      builder = "''${busybox}/bin/sh";
+      args = [ "-c" "''${busybox}/bin/stat -c %h /etc/group > $out" ];
+    }
+  '';
+
+in
+
+makeTest {
+  name = "chroot-templates";
+
+  nodes =
+    { machine =
+        { config, lib, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          virtualisation.pathsInNixDB = [ pkgs.busybox ];
+          nix.useSandbox = true;
+          nix.binaryCaches = lib.mkForce [ ];
+        };
+    };
+
+  testScript = { nodes }: ''
+    # fmt: off
+    start_all()
+    machine.wait_for_unit("multi-user.target")
+
+    def build(seed):
+        out = machine.succeed(f"nix-build ${expr} --argstr seed {seed} --no-out-link").strip()
+        return int(machine.succeed(f"cat {out}"))
+
+    # The store is writable by build users, so a non-sandboxed build
+    # could create the templates directory before the daemon does.
+    # That must not break sandboxed builds.
+    machine.succeed("mkdir /nix/store/.chroot-templates")
+    machine.succeed("chown nixbld1 /nix/store/.chroot-templates")
+    build(1)
+    machine.succeed("[ $(stat -c %U /nix/store/.chroot-templates) = root ]")
+
+    # Builds hard-link their skeleton from the template.
+    assert build(2) >= 2
+
+    # The same goes for a directory that others can write to.
+    machine.succeed("rm -rf /nix/store/.chroot-templates")
+    machine.succeed("mkdir -m 0777 /nix/store/.chroot-templates")
+    assert build(3) >= 2
+    machine.succeed("[ $(stat -c %a /nix/store/.chroot-templates) = 755 ]")
+  '';
+}
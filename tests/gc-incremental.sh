@@ -0,0 +1,75 @@
+source common.sh
+
+export NIX_CONFIG="incremental-gc = true"
+
+clearStore
+
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+
+rm -f "$NIX_STATE_DIR"/gcroots/foo
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+
+# The first collection examines every path and records its roots.
+nix-collect-garbage
+test -e "$NIX_STATE_DIR"/gc-incremental
+grep "root $outPath" "$NIX_STATE_DIR"/gc-incremental
+
+cat $outPath/foobar
+cat $outPath/input-2/bar
+if test -e $drvPath; then false; fi
+
+# New paths are considered by the next collection.
+garbage=$(nix-store --add ./dependencies.nix)
+nix-collect-garbage 2>&1 | grep 'collecting incrementally'
+if test -e $garbage; then false; fi
+cat $outPath/foobar
+
+# So are the closures of roots that have disappeared.
+inUse=$(readLink $outPath/input-2)
+rm "$NIX_STATE_DIR"/gcroots/foo
+nix-collect-garbage 2>&1 | grep 'collecting incrementally'
+if test -e $outPath/foobar; then false; fi
+if test -e $inUse; then false; fi
+
+# Deleting paths behind the collector's back makes it examine every
+# path again.
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -rvv "$drvPath")
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+nix-collect-garbage
+garbage=$(nix-store --add ./dependencies.nix)
+nix-store --delete $garbage
+if nix-collect-garbage 2>&1 | grep 'collecting incrementally'; then false; fi
+cat $outPath/foobar
+
+# The same goes for invalidations by other processes while the
+# collector is running. To make the collector wait after it has
+# started, hold a lock on a temporary roots file, and delete a path
+# directly in the database in the meantime, orphaning its reference.
+if [[ -n $(type -p flock) && -n $(type -p sqlite3) ]]; then
+    orphan=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-orphan
+    referrer=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-referrer
+    touch $orphan $referrer
+    (echo $orphan && echo && echo 0 && echo $referrer && echo && echo 1 && echo $orphan) | nix-store --register-validity
+    ln -sf $referrer "$NIX_STATE_DIR"/gcroots/referrer
+    nix-collect-garbage 2>&1 | grep 'collecting incrementally'
+
+    fakeTempRoots="$NIX_STATE_DIR"/temproots/999999
+    exec 9> "$fakeTempRoots"
+    flock -x 9
+    nix-collect-garbage -vvvvv > $TEST_ROOT/gc.log 2>&1 9>&- &
+    pid=$!
+    while ! grep -q "waiting for read lock on '$fakeTempRoots'" $TEST_ROOT/gc.log; do sleep 0.1; done
+    sqlite3 "$NIX_STATE_DIR"/db/db.sqlite "pragma foreign_keys = on; delete from ValidPaths where path = '$referrer'"
+    flock -u 9
+    exec 9>&-
+    wait $pid
+    rm -f "$fakeTempRoots" "$NIX_STATE_DIR"/gcroots/referrer
+
+    grep 'not collecting incrementally because paths were invalidated' $TEST_ROOT/gc.log
+    if test -e $orphan; then false; fi
+    cat $outPath/foobar
+fi
+
+rm "$NIX_STATE_DIR"/gcroots/foo
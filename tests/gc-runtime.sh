@@ -28,6 +28,13 @@ nix-env -p $profiles/test --delete-generations old
 
 nix-store --gc
 
+# The second collection reuses what the first one found in the
+# program's environment. The cache reveals other users' processes, so
+# only its owner may read it.
+nix-store --gc --option gc-reuse-runtime-roots true
+nix-store --gc --option gc-reuse-runtime-roots true
+[[ $(stat -c %a "$NIX_STATE_DIR"/gc-runtime-roots) = 600 ]]
+
 kill -- -$child
 
 if ! test -e $outPath; then
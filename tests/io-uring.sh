@@ -0,0 +1,23 @@
+source common.sh
+
+# Dumping and restoring with io_uring (if the kernel supports it) must
+# give the same results as without.
+src=$TEST_ROOT/io-uring-src
+rm -rf $src
+mkdir -p $src/dir/subdir
+for i in $(seq 1 200); do echo "file $i" > $src/dir/file-$i; done
+touch $src/dir/empty
+echo '#! /bin/sh' > $src/dir/subdir/script
+chmod +x $src/dir/subdir/script
+ln -s file-1 $src/dir/link
+head -c 100000 /dev/urandom > $src/large
+
+nix-store --dump $src --option use-io-uring false > $TEST_ROOT/default.nar
+nix-store --dump $src --option use-io-uring true > $TEST_ROOT/io-uring.nar
+cmp $TEST_ROOT/default.nar $TEST_ROOT/io-uring.nar
+
+rm -rf $TEST_ROOT/io-uring-out
+nix-store --restore $TEST_ROOT/io-uring-out --option use-io-uring true < $TEST_ROOT/default.nar
+nix-store --dump $TEST_ROOT/io-uring-out --option use-io-uring false | cmp - $TEST_ROOT/default.nar
+test -x $TEST_ROOT/io-uring-out/dir/subdir/script
+[[ $(nix hash path $src) = $(nix hash path --option use-io-uring true $TEST_ROOT/io-uring-out) ]]
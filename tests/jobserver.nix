@@ -0,0 +1,36 @@
+with import ./config.nix;
+
+{
+  # Checks that MAKEFLAGS is not set.
+  noJobserver = mkDerivation {
+    name = "no-jobserver";
+    buildCommand = ''
+      [ -z "''${MAKEFLAGS:-}" ]
+      touch $out
+    '';
+  };
+
+  # Takes a token from the jobserver pipe and gives it back.
+  jobserver = mkDerivation {
+    name = "jobserver";
+    buildCommand = ''
+      [[ $MAKEFLAGS =~ --jobserver-auth=([0-9]+),([0-9]+) ]]
+      r=''${BASH_REMATCH[1]}
+      w=''${BASH_REMATCH[2]}
+      read -N 1 -u $r token
+      [ "$token" = + ]
+      printf + >&$w
+      echo "$MAKEFLAGS" > $out
+    '';
+  };
+
+  # Sets MAKEFLAGS itself, so it doesn't get the jobserver.
+  override = mkDerivation {
+    name = "jobserver-override";
+    MAKEFLAGS = "-j1";
+    buildCommand = ''
+      [ "$MAKEFLAGS" = -j1 ]
+      touch $out
+    '';
+  };
+}
@@ -0,0 +1,10 @@
+source common.sh
+
+clearStore
+
+nix-build --no-out-link jobserver.nix -A noJobserver
+
+outPath=$(nix-build --no-out-link --option jobserver-cores 4 jobserver.nix -A jobserver)
+grep -q -- '-j --jobserver-auth=' $outPath
+
+nix-build --no-out-link --option jobserver-cores 4 jobserver.nix -A override
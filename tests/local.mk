@@ -4,6 +4,11 @@ nix_tests = \
   gc.sh \
   gc-concurrent.sh \
   gc-auto.sh \
+  gc-incremental.sh \
+  path-info-snapshot.sh \
+  path-lock-table.sh \
+  speculative-build.sh \
+  build-times.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
   local-store.sh remote-store.sh export.sh export-graph.sh \
@@ -13,12 +18,15 @@ nix_tests = \
   binary-cache-build-remote.sh \
   nix-profile.sh repair.sh dump-db.sh case-hack.sh \
   check-reqs.sh pass-as-file.sh tarball.sh restricted.sh \
+  jobserver.sh \
   placeholders.sh nix-shell.sh \
   linux-sandbox.sh \
   build-dry.sh \
   build-remote-input-addressed.sh \
   ssh-relay.sh \
+  ssh-control-path.sh \
   nar-access.sh \
+  io-uring.sh \
   structured-attrs.sh \
   fetchGit.sh \
   fetchGitRefs.sh \
@@ -13,3 +13,47 @@ rm -rf $NIX_LOG_DIR
 (! nix-store -l $path)
 nix-build dependencies.nix --no-out-link --compress-build-log
 [ "$(nix-store -l $path)" = FOO ]
+
+# Test indexed logs.
+clearStore
+rm -rf $NIX_LOG_DIR
+nix-build dependencies.nix --no-out-link --index-build-log
+[ "$(nix-store -l $path)" = FOO ]
+[ "$(nix log --tail 1 $path)" = FOO ]
+[ "$(nix log --follow $path)" = FOO ]
+
+# Follow an indexed log while the builder is running. Output must
+# show up even if the builder goes quiet without closing the frame.
+clearStore
+rm -rf $NIX_LOG_DIR
+fifo=$TEST_ROOT/log.fifo
+rm -f $fifo
+mkfifo $fifo
+drvPath=$(nix-instantiate -E "
+  with import ./config.nix;
+  mkDerivation {
+    name = \"follow\";
+    fifo = \"$fifo\";
+    buildCommand = ''
+      echo FIRST
+      echo > \$fifo
+      cat \$fifo > /dev/null
+      echo SECOND
+      touch \$out
+    '';
+  }")
+nix-build $drvPath --no-out-link --index-build-log &
+buildPid=$!
+cat $fifo > /dev/null
+nix log --follow $drvPath > $TEST_ROOT/follow.log &
+followPid=$!
+for ((i = 0; i < 40; i++)); do
+    grep -q FIRST $TEST_ROOT/follow.log && break
+    sleep 0.25
+done
+grep FIRST $TEST_ROOT/follow.log
+(! grep SECOND $TEST_ROOT/follow.log)
+echo > $fifo
+wait $buildPid
+wait $followPid
+[ "$(cat $TEST_ROOT/follow.log)" = "$(printf 'FIRST\nSECOND')" ]
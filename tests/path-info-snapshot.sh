@@ -0,0 +1,44 @@
+source common.sh
+
+clearStore
+
+store="local?path-info-snapshot=true"
+
+path1=$(nix-store --add ./dependencies.nix)
+path2=$(nix-store --add ./config.nix)
+
+# The first process that uses the snapshot creates it.
+nix path-info --store "$store" $path1 $path2
+test -e "$NIX_STATE_DIR"/db/snapshot
+
+# Invalidating a path makes the snapshot stale, so processes using it
+# no longer report the path as valid.
+nix path-info --store "$store" $path2
+nix-store --delete $path2
+(! nix path-info --store "$store" $path2)
+(! nix-store --store "$store" --check-validity $path2)
+nix path-info --store "$store" $path1
+
+# Changed path info is not served from the snapshot either.
+(! nix path-info --store "$store" --sigs $path1 | grep 'test:')
+nix-store --generate-binary-cache-key test $TEST_ROOT/sk1 $TEST_ROOT/pk1
+nix store sign --key-file $TEST_ROOT/sk1 $path1
+nix path-info --store "$store" --sigs $path1 | grep 'test:'
+
+# Registering a path adds referrers to its references.
+reference=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-reference
+referrer=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-referrer
+touch $reference $referrer
+(echo $reference && echo && echo 0) | nix-store --register-validity
+nix-store --store "$store" -q --referrers $reference
+(echo $referrer && echo && echo 1 && echo $reference) | nix-store --register-validity
+[[ $(nix-store --store "$store" -q --referrers $reference) = $referrer ]]
+
+# A change that was committed to the database but never published
+# (e.g. because the process died right after committing) is picked
+# up by the next process that opens the store.
+if [[ -n $(type -p sqlite3) ]]; then
+    nix path-info --store "$store" $path1
+    sqlite3 "$NIX_STATE_DIR"/db/db.sqlite "pragma foreign_keys = on; delete from ValidPaths where path = '$path1'"
+    (! nix path-info --store "$store" $path1)
+fi
@@ -0,0 +1,58 @@
+source common.sh
+
+clearStore
+
+# Concurrent builds of the same derivation must be serialised by the
+# lock table, just like by per-path lock files.
+export NIX_CONFIG="path-lock-table = true"
+
+stateDir=$TEST_ROOT/path-lock-table
+rm -rf $stateDir
+mkdir -p $stateDir
+fifo=$stateDir/fifo
+mkfifo $fifo
+
+drvPath=$(nix-instantiate -E "
+  with import ./config.nix;
+  mkDerivation {
+    name = \"path-lock-table\";
+    stateDir = \"$stateDir\";
+    buildCommand = ''
+      if [ -e \$stateDir/running ]; then
+        echo CONCURRENT >> \$stateDir/log
+        exit 1
+      fi
+      touch \$stateDir/running
+      echo started >> \$stateDir/log
+      echo > \$stateDir/fifo
+      cat \$stateDir/fifo > /dev/null
+      rm \$stateDir/running
+      mkdir \$out
+    '';
+  }")
+
+nix-build --no-out-link $drvPath &
+pid1=$!
+
+# Wait until the first build is running, then start the second one
+# and give it time to get to the lock.
+cat $fifo > /dev/null
+nix-build --no-out-link $drvPath &
+pid2=$!
+sleep 2
+
+echo > $fifo
+wait $pid1
+wait $pid2
+
+[[ $(grep -c started $stateDir/log) = 1 ]]
+(! grep CONCURRENT $stateDir/log)
+
+# The table replaces the lock files, and the garbage collector leaves
+# it alone.
+outPath=$(nix-store -q $drvPath)
+test -e $NIX_STORE_DIR/.path-locks
+(! test -e $outPath.lock)
+nix-collect-garbage
+test -e $NIX_STORE_DIR/.path-locks
+(! test -e $outPath)
@@ -0,0 +1,78 @@
+# Test copying paths to and from an S3 binary cache, using MinIO as
+# a local S3-compatible server.
+
+{ nixpkgs, system, overlay }:
+
+with import (nixpkgs + "/nixos/lib/testing-python.nix") {
+  inherit system;
+  extraConfigurations = [ { nixpkgs.overlays = [ overlay ]; } ];
+};
+
+let
+
+  # A path that is larger than a few parts of the minimum part size
+  # (5 MiB), so that uploads and downloads are split into parts.
+  pkgA = pkgs.runCommand "big-file" {} ''
+    mkdir $out
+    head -c 20000000 /dev/urandom > $out/data
+  '';
+
+  accessKey = "BKIKJAA5BMMU2RHO6IBB";
+  secretKey = "V7f1CwQqAcwo80UEIJEjc5gVQUSSx5ohQ9GSrr12";
+  env = "AWS_ACCESS_KEY_ID=${accessKey} AWS_SECRET_ACCESS_KEY=${secretKey}";
+
+  storeUrl = "s3://my-cache?endpoint=http://server:9000&region=eu-west-1&compression=none";
+
+in
+
+makeTest {
+  name = "s3-binary-cache-store";
+
+  nodes =
+    { server =
+        { config, lib, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          virtualisation.pathsInNixDB = [ pkgA ];
+          environment.systemPackages = [ pkgs.minio-client ];
+          nix.binaryCaches = lib.mkForce [ ];
+          nix.extraOptions = "experimental-features = nix-command";
+          services.minio = {
+            enable = true;
+            region = "eu-west-1";
+            inherit accessKey secretKey;
+          };
+          networking.firewall.allowedTCPPorts = [ 9000 ];
+        };
+
+      client =
+        { config, lib, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          nix.binaryCaches = lib.mkForce [ ];
+          nix.extraOptions = "experimental-features = nix-command";
+        };
+    };
+
+  testScript = { nodes }: ''
+    # fmt: off
+    start_all()
+
+    # Create a binary cache.
+    server.wait_for_unit("minio")
+
+    server.succeed("mc config host add minio http://localhost:9000 ${accessKey} ${secretKey} --api s3v4")
+    server.succeed("mc mb minio/my-cache")
+
+    server.succeed("${env} nix copy --to '${storeUrl}&multipart-upload=true&multipart-concurrency=3' ${pkgA}")
+
+    # Copy a package from the binary cache, using parallel ranged requests.
+    client.wait_for_unit("network-online.target")
+    client.fail("nix path-info ${pkgA}")
+
+    client.succeed("${env} nix store ping --store '${storeUrl}' >&2")
+
+    client.succeed("${env} nix copy --no-check-sigs --from '${storeUrl}&multipart-download=true' ${pkgA}")
+
+    client.succeed("nix path-info ${pkgA}")
+    client.succeed("nix store verify --no-trust ${pkgA}")
+  '';
+}
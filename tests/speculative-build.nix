@@ -0,0 +1,52 @@
+with import ./config.nix;
+
+{ stateDir }:
+
+rec {
+
+  # Takes a minute once $stateDir/slow exists.
+  slowInput = mkDerivation {
+    name = "speculative-slow-input";
+    inherit stateDir;
+    buildCommand = ''
+      if [ -e $stateDir/slow ]; then
+        touch $stateDir/slow-started
+        sleep 60
+        exit 1
+      fi
+      mkdir $out
+    '';
+  };
+
+  waitsForInput = mkDerivation {
+    name = "speculative-waits-for-input";
+    inherit stateDir slowInput;
+    buildCommand = ''
+      echo waitsForInput >> $stateDir/built
+      echo foo > $out
+    '';
+  };
+
+  # Waits for the test once $stateDir/build-fifo exists.
+  blocking = mkDerivation {
+    name = "speculative-blocking";
+    inherit stateDir;
+    buildCommand = ''
+      if [ -e $stateDir/build-fifo ]; then
+        cat $stateDir/build-fifo > /dev/null
+      fi
+      echo blocking >> $stateDir/built
+      echo bar > $out
+    '';
+  };
+
+  afterBlocking = mkDerivation {
+    name = "speculative-after-blocking";
+    inherit stateDir blocking;
+    buildCommand = ''
+      echo afterBlocking >> $stateDir/built
+      echo $blocking > $out
+    '';
+  };
+
+}
@@ -0,0 +1,89 @@
+source common.sh
+
+clearStore
+clearCache
+clearCacheCache
+rm -f $TEST_HOME/.cache/nix/build-times.sqlite
+
+export NIX_CONFIG="speculative-build-max-time = 100"
+
+stateDir=$TEST_ROOT/speculative-build
+rm -rf $stateDir
+mkdir -p $stateDir
+
+build() {
+    nix-build speculative-build.nix --argstr stateDir $stateDir --no-out-link -j2 \
+        --substituters file://$cacheDir --option require-sigs false "$@"
+}
+
+hashPart() {
+    basename $1 | cut -c1-32
+}
+
+# Replace the NAR of a path in the binary cache by a FIFO, so that
+# substituting it blocks until the test writes the NAR into it.
+blockNar() {
+    local nar=$cacheDir/$(grep '^URL: ' $cacheDir/$(hashPart $1).narinfo | cut -d' ' -f2)
+    mv $nar $2
+    mkfifo $nar
+    echo $nar
+}
+
+# Build everything once, which records the build times, and put the
+# outputs into a binary cache.
+waitsForInput=$(build -A waitsForInput)
+blocking=$(build -A blocking)
+outPath() {
+    nix-store -q $(nix-instantiate speculative-build.nix --argstr stateDir $stateDir -A $1)
+}
+slowInput=$(outPath slowInput)
+afterBlocking=$(outPath afterBlocking)
+extra=$(nix-store --add ./config.nix)
+nix copy --to file://$cacheDir $waitsForInput $blocking $extra
+
+# Make the substitution of 'blocking' depend on that of 'extra'.
+sed -i "s|^References:.*|References: $(basename $extra)|" $cacheDir/$(hashPart $blocking).narinfo
+
+waitsForInputNar=$(blockNar $waitsForInput $TEST_ROOT/waits-for-input.nar)
+extraNar=$(blockNar $extra $TEST_ROOT/extra.nar)
+
+clearStore
+rm -f $stateDir/built
+
+# The substitution wins before the build takes the output locks: the
+# inputs are being built while the outputs are substituted, and the
+# build of the inputs is abandoned once the substitution is done.
+touch $stateDir/slow
+build -A waitsForInput &
+pid=$!
+for ((i = 0; i < 100; i++)); do
+    test -e $stateDir/slow-started && break
+    sleep 0.1
+done
+test -e $stateDir/slow-started
+cat $TEST_ROOT/waits-for-input.nar > $waitsForInputNar
+wait $pid
+nix-store --check-validity $waitsForInput
+(! nix-store --check-validity $slowInput)
+(! test -e $stateDir/built)
+
+# The build wins while the substitution is running. The substitution
+# is cancelled without holding up the rest of the build: 'afterBlocking'
+# is built while the download of 'extra' is still stuck.
+mkfifo $stateDir/build-fifo
+build -A afterBlocking &
+pid=$!
+# Wait for the substitution of 'extra' to open its NAR.
+exec 8> $extraNar
+echo > $stateDir/build-fifo
+for ((i = 0; i < 100; i++)); do
+    nix-store --check-validity $afterBlocking && break
+    sleep 0.1
+done
+nix-store --check-validity $blocking $afterBlocking
+# The process still waits for the cancelled download to give up, which
+# a blocked read of the NAR only does at the end of the file.
+exec 8>&-
+wait $pid
+(! nix-store --check-validity $extra)
+[[ $(cat $stateDir/built) = $'blocking\nafterBlocking' ]]
@@ -0,0 +1,58 @@
+source common.sh
+
+clearStore
+
+# A fake ssh that runs commands locally and logs what it was asked to
+# do. The control socket is simulated by a regular file.
+mkdir -p $TEST_ROOT/ssh-bin
+cat > $TEST_ROOT/ssh-bin/ssh <<EOF2
+#! $SHELL
+host=\$1; shift
+socket=
+while [ \$# -gt 0 ]; do
+    case \$1 in
+        -S) socket=\$2; shift 2;;
+        -O) op=\$2; shift 2;;
+        -o|-i) shift 2;;
+        -M) op=master; shift;;
+        -f|-N|-x|-a|-v|-C) shift;;
+        *) break;;
+    esac
+done
+echo "\${op:-command} \$socket" >> $TEST_ROOT/ssh.log
+case \$op in
+    check) test -e "\$socket";;
+    master) touch "\$socket";;
+    *) exec $SHELL -c "\$*";;
+esac
+EOF2
+chmod +x $TEST_ROOT/ssh-bin/ssh
+export PATH=$TEST_ROOT/ssh-bin:$PATH
+
+remoteStore=$TEST_ROOT/ssh-remote-store
+controlPath=$TEST_ROOT/ssh-control.ssh
+rm -rf $remoteStore $controlPath* $TEST_ROOT/ssh.log
+
+store="ssh://fakehost?remote-store=$remoteStore&ssh-control-path=$controlPath&ssh-control-persist=60"
+
+path1=$(nix-store --add ./dependencies.nix)
+path2=$(nix-store --add ./config.nix)
+
+# The first process starts the master connection; the second one finds
+# it running and reuses it.
+nix copy --to "$store" $path1
+nix copy --to "$store" $path2
+nix path-info --store "$store" $path1 $path2
+
+[[ $(grep -c "^master $controlPath\$" $TEST_ROOT/ssh.log) = 1 ]]
+[[ $(grep -c "^check $controlPath\$" $TEST_ROOT/ssh.log) = 3 ]]
+(! grep -v " $controlPath\$" $TEST_ROOT/ssh.log)
+
+# Starting the master is serialised through a lock file next to the
+# control path.
+test -e $controlPath.lock
+
+# Without a control path, no shared master is used.
+rm $TEST_ROOT/ssh.log
+nix path-info --store "ssh://fakehost?remote-store=$remoteStore" $path1
+(! grep -q '^master\|^check' $TEST_ROOT/ssh.log)